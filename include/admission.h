@@ -0,0 +1,96 @@
+/**
+ * File: admission.h
+ * Admission control for when we get flooded. Every server thread keeps a
+ * small table of the sources that connected to it recently, with a
+ * connection and a request rate limit per source and a cap on how many
+ * connections a source may hold open. On top of that there's a cap on open
+ * connections across all threads, so we shed load before running out of
+ * fds or memory.
+ *
+ * Rates are enforced with GCRA: a single theoretical arrival time per
+ * limit, pushed forward by one emission interval for every connection or
+ * request. A source is over its limit once that time runs more than a burst
+ * ahead of now. Checks are a hash lookup and a compare so they can run
+ * before anything gets parsed.
+ *
+ * Limits are per thread. With SO_REUSEPORT spreading connections a source
+ * can get up to nthreads times as much out of the whole server.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+
+/**
+ * Open connections the whole server takes before it starts turning new
+ * ones away. Lowered to what RLIMIT_NOFILE leaves room for.
+ */
+#define ADMIT_MAX_CONNS 65536
+
+/**
+ * Per source, per thread limits. Burst is how many connections or requests
+ * beyond the rate a source may send at once after being quiet.
+ */
+#define ADMIT_SOURCE_CONNS 1024
+#define ADMIT_CONN_RATE 1000
+#define ADMIT_CONN_BURST 1000
+#define ADMIT_REQUEST_RATE 250000
+#define ADMIT_REQUEST_BURST 250000
+
+/**
+ * Sources tracked per thread, and how many slots a lookup probes. A source
+ * that finds every slot it probes taken by a live one goes untracked.
+ */
+#define ADMIT_SOURCES 4096
+#define ADMIT_PROBE 8
+
+// The source of connections that aren't tracked
+#define ADMIT_UNTRACKED -1
+
+typedef enum {
+    ADMIT_OK,
+    ADMIT_SHED, // over capacity, worth telling the client with a 503
+    ADMIT_DROP, // an abusive source, close without another word
+} admit_t;
+
+typedef struct admission admission_t;
+
+
+/**
+ * Work out the global connection cap. Called once before any threads start.
+ */
+int admission_global_init(void);
+
+/**
+ * Set up the calling thread's source table
+ */
+admission_t *admission_init(void);
+
+void admission_destroy(admission_t *adm);
+
+/**
+ * Decide on a connection from addr at time now (ns). Admitted connections
+ * count against the caps until admission_disconnect and get the source
+ * they're tracked under back through source.
+ */
+admit_t admission_connect(admission_t *adm, const struct sockaddr *addr, uint64_t now, int32_t *source);
+
+/**
+ * Release a connection admitted under source
+ */
+void admission_disconnect(admission_t *adm, int32_t source);
+
+/**
+ * Check a read from source before it is parsed, charging it as one request.
+ * Returns false if the source is over its request rate.
+ */
+bool admission_request(admission_t *adm, int32_t source, uint64_t now);
+
+/**
+ * Settle up for a read once it's parsed and turned out to hold requests,
+ * admission_request only charged it for one. A read with a lot of pipelined
+ * requests puts the source in debt and the reads after it are refused until
+ * that is paid off.
+ */
+void admission_charge(admission_t *adm, int32_t source, uint64_t requests);
@@ -30,3 +30,14 @@ int buffer_clear(buffer_t *buffer);
 uint64_t buffer_length(buffer_t *buffer);
 char buffer_char_at(buffer_t *buffer, uint64_t index);
 int buffer_fast_clear(buffer_t *buffer);
+
+/**
+ * Write the decimal representation of value into dest, which must have room
+ * for 20 characters. Returns the number of characters written, no NUL.
+ */
+size_t u64toa(uint64_t value, char *dest);
+
+/**
+ * Append the decimal representation of value to the buffer
+ */
+uint64_t buffer_append_u64(buffer_t *buffer, uint64_t value);
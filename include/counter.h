@@ -8,9 +8,10 @@
 #pragma once
 
 #include <stdbool.h>
+#include <string.h>
 #include "buffer.h"
-
-#define KEYSZ 16
+#include "rates.h"
+#include "key.h"
 
 /**
  * Structure defining the global values required for the LMDB functions.
@@ -37,11 +38,20 @@ void counter_destroy(counter_t *lc);
 
 
 /**
- * Increment a counter with the given key. Disk write isn't implied.
+ * Increment a counter with the given key. Disk write isn't implied. Returns
+ * the count including this increment, backends that keep a key in several
+ * places may leave out what other threads added since the last stats tick.
  */
 uint64_t counter_inc(counter_t *lc, const char *key);
 
 
+/**
+ * The rank tier a key with count was in as of the last stats tick, 0 for the
+ * top tier up to RATE_TIERS - 1.
+ */
+unsigned counter_tier(counter_t *lc, uint64_t count);
+
+
 /**
  * Return the value of the given counter
  */
@@ -61,26 +71,26 @@ void counter_sync(counter_t *lc);
 void counter_dump(counter_t *lc, buffer_t *buffer);
 
 /**
- * Run via the timer system every 10 seconds to generate req/s statistics
+ * Run via the timer system every RATE_TICK_MSECS. Samples every counter into
+ * the backend's rates_t for the req/s statistics.
  */
 int counter_gen_stats(void *data);
 
 /**
- * Helper functions for filtering out non-alphanumeric characters.
+ * Append a single "name: count - 1s/10s/1m/5m rps" line of the status page.
+ * Shared by the backends' counter_dump so none of them need a printf per key.
  */
-static inline bool is_ascii(char c) {
-    return (c > 47 && c < 58) || (c > 64 && c < 91) || (c > 96 && c < 123);
-}
-
-static inline void key_clean(char *dest, const char *src) {
-    int clean_index = 0;
-    for(int i=0; i < KEYSZ-1; i++) {
-        if(src[i] == '\0') {
-             break;
-        }
-        if(is_ascii(src[i])) {
-            dest[clean_index] = src[i];
-            clean_index++;
+static inline void counter_dump_line(buffer_t *output, const char *key, uint64_t count,
+        const uint64_t rps[RATE_WINDOWS]) {
+    buffer_append(output, key, strnlen(key, KEYSZ));
+    buffer_append(output, ": ", 2);
+    buffer_append_u64(output, count);
+    buffer_append(output, " - ", 3);
+    for(int w = 0; w < RATE_WINDOWS; w++) {
+        if(w > 0) {
+            buffer_append(output, "/", 1);
         }
+        buffer_append_u64(output, rps[w]);
     }
+    buffer_append(output, " rps\n", 5);
 }
@@ -0,0 +1,54 @@
+/**
+ * File: epoch.h
+ * Quiescent state based reclamation for memory that threads read without
+ * taking a lock. Every such thread registers and reports a quiescent state,
+ * a point where it holds no pointer into shared memory, once per loop
+ * iteration. A thread about to block goes offline instead, so an idle one
+ * holds nobody up.
+ *
+ * Whoever unlinks something gets a stamp from epoch_retire and frees it once
+ * epoch_passed says every registered thread has been quiescent or offline
+ * since. However long a thread stalls, nothing it can still see is freed.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/**
+ * Start taking part, the calling thread is online from here on
+ */
+int epoch_register(void);
+
+
+/**
+ * Stop taking part. The thread must hold no pointers into shared memory.
+ */
+void epoch_unregister(void);
+
+
+/**
+ * Report that the calling thread holds no pointers into shared memory
+ */
+void epoch_quiescent(void);
+
+
+/**
+ * Report a quiescent state that lasts until epoch_online, like a blocking
+ * wait. Neither does anything on a thread that isn't registered.
+ */
+void epoch_offline(void);
+void epoch_online(void);
+
+
+/**
+ * Called right after unlinking something, returns its stamp.
+ */
+uint64_t epoch_retire(void);
+
+
+/**
+ * Whether everything retired with stamp can be freed
+ */
+bool epoch_passed(uint64_t stamp);
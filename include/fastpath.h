@@ -0,0 +1,20 @@
+/**
+ * File: fastpath.h
+ * Recognizer for the one request shape that makes up nearly all of our
+ * traffic, "GET /<name> HTTP/1.1" followed by a few headers and no body.
+ * It finds the end of such a request with vector compares and hands back
+ * the url without going through http_parser. Anything it isn't sure about
+ * is left to http_parser.
+ */
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Look for a complete plain GET request at the start of buf. On success the
+ * url is returned through url and url_len, pointing into buf, and the length
+ * of the whole request is returned. Returns 0 if the request is incomplete,
+ * uses another method or version, or carries a body. The caller then has to
+ * run http_parser over it instead.
+ */
+size_t fastpath_get(const char *buf, size_t len, const char **url, size_t *url_len);
@@ -0,0 +1,87 @@
+/**
+ * File: hist.h
+ * Log-linear latency histogram. Values below 2^HIST_SUB_BITS get a bucket
+ * each, above that every power of two is split into 2^HIST_SUB_BITS
+ * buckets, so any recorded value is off by at most ~3%. Recording is a
+ * couple of instructions and histograms from different threads merge by
+ * simply adding them up.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} hist_t;
+
+
+static inline size_t hist_index(uint64_t value) {
+    if(value < HIST_SUB) {
+        return value;
+    }
+    int exp = 63 - __builtin_clzll(value);
+    size_t sub = (value >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1);
+    return (exp - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+
+static inline void hist_record(hist_t *hist, uint64_t value) {
+    hist->counts[hist_index(value)]++;
+    hist->total++;
+    if(value > hist->max) {
+        hist->max = value;
+    }
+}
+
+/**
+ * hist_record for a histogram that other threads read while it is being
+ * written. Only one thread may record into it, readers go through
+ * hist_snapshot. Relaxed loads and stores, so still no locked instructions.
+ */
+static inline void hist_record_owned(hist_t *hist, uint64_t value) {
+    uint64_t *count = &hist->counts[hist_index(value)];
+    __atomic_store_n(count, __atomic_load_n(count, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->total, __atomic_load_n(&hist->total, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    if(value > __atomic_load_n(&hist->max, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Add a histogram that is concurrently written with hist_record_owned to
+ * dest.
+ */
+void hist_snapshot(hist_t *dest, const hist_t *src);
+
+/**
+ * Everything recorded into cur since it looked like prev. The max of the
+ * interval is only known to bucket precision.
+ */
+void hist_interval(hist_t *dest, const hist_t *cur, const hist_t *prev);
+
+/**
+ * Reset a histogram to empty
+ */
+void hist_init(hist_t *hist);
+
+/**
+ * Add every value recorded in src to dest
+ */
+void hist_merge(hist_t *dest, const hist_t *src);
+
+/**
+ * Highest value that lands in the given bucket
+ */
+uint64_t hist_value(size_t index);
+
+/**
+ * The value below which pct percent of the recorded values fall
+ */
+uint64_t hist_percentile(const hist_t *hist, double pct);
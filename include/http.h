@@ -16,11 +16,19 @@ void init_http_msg(http_msg_t *msg);
 void free_http_msg(http_msg_t *msg);
 void free_http_header(http_header_t *header);
 
+/**
+ * Copy any part of the message that still points into the read buffer into
+ * memory owned by the message. Must be called before the read buffer is
+ * reused while a request is only partially parsed.
+ */
+void http_msg_detach(http_msg_t *msg);
+
 // Thread Local Session Management
 void set_current_session(connection_t *session);
 connection_t *get_current_session(void);
 
 // callbacks for joyent's http-parser
+int on_message_begin(http_parser *_);
 int on_url(http_parser *_, const char *at, size_t len);
 int on_header_field(http_parser *_, const char *at, size_t len);
 int on_header_value(http_parser *_, const char *at, size_t len);
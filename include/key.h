@@ -0,0 +1,64 @@
+/**
+ * File: key.h
+ * Counter keys. A key is at most 15 letters and digits, zero padded to KEYSZ
+ * bytes, which is exactly one SSE register. Keys are compared a register at
+ * a time and hashed a word at a time. key_clean uses the widest vector
+ * support the cpu has, which is checked once at startup.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define KEYSZ 16
+
+
+/**
+ * Copy the letters and digits of src into dest. Stops at the first NUL or
+ * after KEYSZ - 1 bytes. dest must be KEYSZ zeroed bytes.
+ */
+void key_clean(char *dest, const char *src);
+
+static inline bool key_eq(const void *a, const void *b) {
+#ifdef __SSE2__
+    __m128i va = _mm_loadu_si128((const __m128i *)a);
+    __m128i vb = _mm_loadu_si128((const __m128i *)b);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) == 0xffff;
+#else
+    uint64_t a0, a1, b0, b1;
+    memcpy(&a0, a, 8);
+    memcpy(&a1, (const char *)a + 8, 8);
+    memcpy(&b0, b, 8);
+    memcpy(&b1, (const char *)b + 8, 8);
+    return ((a0 ^ b0) | (a1 ^ b1)) == 0;
+#endif
+}
+
+/**
+ * Whether a key is all zeroes, the empty key
+ */
+static inline bool key_empty(const void *key) {
+    uint64_t k0, k1;
+    memcpy(&k0, key, 8);
+    memcpy(&k1, (const char *)key + 8, 8);
+    return (k0 | k1) == 0;
+}
+
+/**
+ * Multiply the two halves of the key, each offset by a constant, and fold
+ * the 128 bit product. Both constants have bytes no key can have, so neither
+ * factor is ever zero. The low bits depend on every byte, so the table sizes
+ * can stay powers of two.
+ */
+static inline size_t key_hash(const void *key) {
+    uint64_t k0, k1;
+    memcpy(&k0, key, 8);
+    memcpy(&k1, (const char *)key + 8, 8);
+    __uint128_t m = (__uint128_t)(k0 ^ 0xa0761d6478bd642fULL) * (k1 ^ 0xe7037ed1a0b428dbULL);
+    return (size_t)((uint64_t)m ^ (uint64_t)(m >> 64));
+}
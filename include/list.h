@@ -76,6 +76,11 @@ struct rd_list_node *rd_list_remove(struct rd_list_head *head, uint64_t index);
 
 struct rd_list_node *rd_list_remove_by_func(struct rd_list_head *head, rd_list_filter_func func, void *cmpdata);
 
+/**
+ * Unlink a node that is known to be in the list
+ */
+void rd_list_unlink(struct rd_list_head *head, struct rd_list_node *node);
+
 struct rd_list_node *rd_list_get(struct rd_list_head *head, uint64_t index);
 
 struct rd_list_node *rd_list_get_by_func(struct rd_list_head *head, rd_list_filter_func func, void *cmpdata);
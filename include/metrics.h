@@ -0,0 +1,112 @@
+/**
+ * File: metrics.h
+ * Per-thread operational metrics. Every worker thread owns a cache line
+ * padded block of counters that only it writes, with plain loads and
+ * stores. GET /_metrics adds them up and renders them in the Prometheus
+ * text format.
+ *
+ * Latencies go into log-linear histograms instead. The timer thread merges
+ * those of all threads every STATS_SECS and keeps the percentiles of the
+ * last interval around for /_metrics.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "buffer.h"
+#include "hist.h"
+
+/**
+ * Power of two histogram buckets, bucket i counts values <= 2^i and the last
+ * one everything above.
+ */
+#define METRICS_BUCKETS 16
+
+typedef struct {
+    _Atomic uint64_t buckets[METRICS_BUCKETS + 1];
+    _Atomic uint64_t sum;
+    _Atomic uint64_t count;
+} metrics_hist_t;
+
+typedef struct {
+    _Atomic uint64_t accepts;
+    _Atomic uint64_t accepts_local_cpu;
+    _Atomic uint64_t accepts_remote_cpu;
+    _Atomic uint64_t accepts_remote_node;
+    _Atomic uint64_t closes;
+    _Atomic uint64_t reads;
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t bytes_out;
+    _Atomic uint64_t requests;
+    _Atomic uint64_t fastpath_requests;
+    _Atomic uint64_t parse_errors;
+    _Atomic uint64_t idle_timeouts;
+    _Atomic uint64_t conns_rejected;
+    _Atomic uint64_t requests_shed;
+    _Atomic uint64_t waits;
+    _Atomic uint64_t busy_polls;
+    _Atomic uint64_t busy_poll_hits;
+    _Atomic uint64_t busy_poll_budget;
+    _Atomic uint64_t pool_capacity;
+    metrics_hist_t wait_batch;
+    metrics_hist_t conn_requests;
+    hist_t response_latency; // ns from a read completing to the response being written
+    hist_t dispatch_delay; // ns from uvbloop_wait returning to an event being handled
+} __attribute__((aligned(64))) thread_metrics_t;
+
+
+/**
+ * Only the owning thread ever writes its metrics, so a relaxed load and
+ * store is all it takes. No locked instructions on the hot path.
+ */
+static inline void metric_add(_Atomic uint64_t *metric, uint64_t n) {
+    atomic_store_explicit(metric, atomic_load_explicit(metric, memory_order_relaxed) + n,
+            memory_order_relaxed);
+}
+
+static inline void metric_set(_Atomic uint64_t *metric, uint64_t value) {
+    atomic_store_explicit(metric, value, memory_order_relaxed);
+}
+
+static inline void metric_observe(metrics_hist_t *hist, uint64_t value) {
+    int bucket = value <= 1 ? 0 : 64 - __builtin_clzll(value - 1);
+    metric_add(&hist->buckets[bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS], 1);
+    metric_add(&hist->sum, value);
+    metric_add(&hist->count, 1);
+}
+
+static inline uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void metric_latency(hist_t *hist, uint64_t since, uint64_t now) {
+    hist_record_owned(hist, now > since ? now - since : 0);
+}
+
+
+/**
+ * Allocate the metrics of nthreads worker threads
+ */
+int metrics_init(size_t nthreads);
+
+/**
+ * Get the metrics block of a worker thread, called once from the thread
+ * itself so the block ends up in its local memory.
+ */
+thread_metrics_t *metrics_thread(size_t thread_id);
+
+/**
+ * Run via the timer system every STATS_SECS. Merges the latency histograms
+ * of all threads and works out the percentiles of the interval since the
+ * last run.
+ */
+int metrics_merge(void *data);
+
+/**
+ * Append the metrics of every thread in the Prometheus text format
+ */
+void metrics_render(buffer_t *out);
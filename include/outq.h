@@ -0,0 +1,70 @@
+/**
+ * File: outq.h
+ * Per connection output queue. Responses are queued while a read is parsed
+ * and written out together with a single writev. Whatever the socket does
+ * not take stays queued until it becomes writable again.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "buffer.h"
+#include "status.h"
+
+/**
+ * Max number of separate chunks (and so iovecs) in a queue
+ */
+#define OUTQ_CHUNKS 16
+
+/**
+ * Stop reading from a connection once this many bytes are queued for it
+ */
+#define OUTQ_HIGH_WATER (64 * 1024)
+
+/**
+ * A contiguous run of queued bytes. Either a range of the queue's own buffer
+ * or, if page is set, a range of a status page we hold a reference to.
+ */
+typedef struct {
+    uint64_t off;
+    uint64_t len;
+    status_page_t *page;
+} outq_chunk_t;
+
+typedef struct {
+    buffer_t buf;
+    outq_chunk_t chunks[OUTQ_CHUNKS];
+    uint32_t head;
+    uint32_t count;
+    uint64_t bytes;
+} outq_t;
+
+
+int outq_init(outq_t *q);
+
+/**
+ * Release any referenced pages and free the queue's buffer
+ */
+void outq_free(outq_t *q);
+
+/**
+ * Copy len bytes of data onto the end of the queue
+ */
+void outq_append(outq_t *q, const char *data, size_t len);
+
+/**
+ * Queue a status page without copying it. The queue takes over the caller's
+ * reference to the page.
+ */
+void outq_append_page(outq_t *q, status_page_t *page);
+
+/**
+ * Write as much of the queue to fd as the socket accepts. Returns the number
+ * of bytes still queued or -1 if the connection failed.
+ */
+int64_t outq_flush(outq_t *q, int fd);
+
+/**
+ * Number of bytes waiting to be written
+ */
+uint64_t outq_length(outq_t *q);
@@ -1,20 +1,48 @@
 #pragma once
 #include <stdint.h>
 
+/**
+ * Objects are carved out of chunks of this size. Chunks are aligned to it so
+ * the kernel can back each one with a single transparent hugepage.
+ */
+#define MEMPOOL_CHUNK_SIZE (2 * 1024 * 1024)
+
 /**
  * Structure of a memory pool.
- * Pools keep track of the object size, the number of objects,
- * and a bitmap of which objects are free. This is not thread safe
- * so each thread should have their own instance.
+ * Pools hand out fixed size objects from big chunks. Freed objects go on a
+ * free list and are handed out again first, otherwise the next unused object
+ * of the newest chunk is taken, so allocating and freeing are both O(1).
+ * Chunks are only returned to the system when the pool is destroyed. This is
+ * not thread safe so each thread should have their own instance.
  */
 typedef struct {
     uint64_t obj_size;
-    uint64_t obj_count;
-    uint8_t *free_map;
-    void *objects;
+    uint64_t chunk_objs;
+    void *free_list;
+    void *chunks;
+    char *next_obj; // next never used object in the newest chunk
+    char *chunk_end;
+    uint64_t nchunks;
+    uint64_t used;
+    uint64_t peak;
 } mempool_t;
 
+/**
+ * Occupancy of a pool
+ */
+typedef struct {
+    uint64_t obj_size;
+    uint64_t used;
+    uint64_t peak;
+    uint64_t capacity;
+    uint64_t chunks;
+} mempool_stats_t;
+
 
+/**
+ * Create a pool of obj_size objects with room for at least obj_count of them
+ * allocated up front.
+ */
 mempool_t *mempool_init(uint64_t obj_size, uint64_t obj_count);
 
 void mempool_destroy(mempool_t *pool);
@@ -22,3 +50,5 @@ void mempool_destroy(mempool_t *pool);
 void *mempool_alloc(mempool_t *pool);
 
 void mempool_free(mempool_t *pool, void *ptr);
+
+void mempool_stats(mempool_t *pool, mempool_stats_t *stats);
@@ -0,0 +1,84 @@
+/**
+ * File: rates.h
+ * Per-key request rates over several windows, shared by the counter
+ * backends. Every tick the stats timer feeds in the current count of each
+ * key and each key keeps a short ring of those samples: one per tick for the
+ * last RATE_FINE_TICKS ticks and one every RATE_FINE_TICKS ticks for the
+ * last RATE_COARSE_SAMPLES of those. A rate over any window is then just the
+ * difference between the newest sample and an older one, nothing is summed
+ * up and the counter tables are never copied.
+ *
+ * Every tick also ranks the keys by count and works out the tiers they fall
+ * in, those are the one thing here any thread may read.
+ *
+ * Not thread-safe otherwise, only the thread running the stats timer may use
+ * it.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Ticks are expected every RATE_TICK_MSECS, rates are computed against the
+ * time that actually passed between samples.
+ */
+#define RATE_TICK_MSECS 1000
+#define RATE_FINE_TICKS 10
+#define RATE_COARSE_SAMPLES 30
+
+/**
+ * The windows rates_get reports, in ticks: 1s, 10s, 1m and 5m
+ */
+#define RATE_WINDOWS 4
+#define RATE_WINDOW_TICKS { 1, 10, 60, 300 }
+#define RATE_WINDOW_NAMES "1s/10s/1m/5m"
+
+/**
+ * Rank tiers, by the share of keys with a higher count: the top 1%, 10% and
+ * 50% and everyone else.
+ */
+#define RATE_TIERS 4
+#define RATE_TIER_PERCENTS { 1, 10, 50 }
+
+typedef struct rates rates_t;
+
+/**
+ * Allocate an empty set of rates
+ */
+rates_t *rates_init(void);
+
+/**
+ * Free a set of rates
+ */
+void rates_destroy(rates_t *rates);
+
+/**
+ * Add count to the sample of key that's being taken. Backends that keep a
+ * key in several places call it once for each, the sample is the sum.
+ */
+int rates_add(rates_t *rates, const char *key, uint64_t count);
+
+/**
+ * Finish the sample being taken. Keys that weren't added since the last
+ * tick keep their previous count.
+ */
+void rates_tick(rates_t *rates);
+
+/**
+ * Get the rates of key in requests per second for every window, zeros for a
+ * key that has never been sampled.
+ */
+void rates_get(rates_t *rates, const char *key, uint64_t rps[RATE_WINDOWS]);
+
+/**
+ * The count of key in the last finished sample, 0 if it was never sampled
+ */
+uint64_t rates_count(rates_t *rates, const char *key);
+
+/**
+ * The tier a key with count would have been ranked in at the last tick, 0 for
+ * the top one up to RATE_TIERS - 1. Before the first tick everything is in
+ * the last tier. Safe to call from any thread.
+ */
+unsigned rates_tier(rates_t *rates, uint64_t count);
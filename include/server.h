@@ -13,11 +13,42 @@
 #include "counter.h"
 #include "http.h"
 #include "timers.h"
+#include "topology.h"
 
 
 #define MAXEVENTS 64
 #define MAXREAD 512
 #define STATS_SECS 10
+#define CONNECTION_POOL_SIZE 1024
+// Room for the increment response, its header and the longest count and tier
+#define INC_RESPONSE_MAX 128
+// Connections that send nothing for this long are dropped
+#define CONNECTION_IDLE_MSECS 60000
+
+/**
+ * Built with UVB_EDGE_TRIGGERED the readiness loop registers sockets edge
+ * triggered and drains them, but reads no more than READ_BUDGET times from
+ * one connection per wakeup so a busy client can't hold up the rest. Level
+ * triggered it reads once and lets the loop come back for the remainder.
+ * Either way a wakeup of the listen socket takes up to ACCEPT_BUDGET
+ * connections off the accept queue.
+ */
+#ifdef UVB_EDGE_TRIGGERED
+#define LOOP_EDGE UVBLOOP_EDGE
+#define READ_BUDGET 16
+#else
+#define LOOP_EDGE 0
+#define READ_BUDGET 1
+#endif
+#define ACCEPT_BUDGET 64
+
+/**
+ * Built with UVB_BUSY_POLL the worker loops poll without sleeping for up to
+ * BUSY_POLL_USECS before they block, and have the kernel busy poll the
+ * device queue of their sockets for as long. How long a loop spins follows
+ * the load, a thread that keeps coming up empty ends up not spinning at all.
+ */
+#define BUSY_POLL_USECS 50
 
 /**
  * Structure for the actual server. Stores the pthread handles the number of
@@ -42,14 +73,15 @@ typedef struct {
     int epoll_fd;
     void *data;
     uint64_t thread_id;
+    int cpu; // what the thread is pinned to, -1 if it isn't
+    int node; // the NUMA node of that cpu
 } thread_data_t;
 
 
-int make_http_response(char **resp_ptr, int status_code, const char *status, const char *content_type, const char* response);
 int unblock_socket(int fd);
 int make_server_socket(const char *port);
 void free_connection(connection_t *session);
 void init_connection(connection_t *session, int fd);
 void *epoll_loop(void *ptr);
-server_t *new_server(const size_t nthreads, const char *addr, const char *port);
+server_t *new_server(const size_t nthreads, const char *addr, const char *port, placement_t placement);
 void server_wait(server_t *server);
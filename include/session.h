@@ -1,23 +1,49 @@
 #pragma once
 #include <http_parser.h>
 #include "buffer.h"
+#include "outq.h"
+#include "uvbloop.h"
 
 typedef struct {
     buffer_t name;
     buffer_t value;
 } http_header_t;
 
+#define HTTP_URL_INLINE 64
+
 typedef struct {
     uint64_t current_header;
     bool header_ready; // can we put data into the header yet?
     bool reading_value;
+    bool started; // http_parser has seen the start of this message
     bool done;
     http_header_t headers[20];
-    buffer_t url;
+    // The url points straight into the read buffer while a request is parsed
+    // out of a single read and is copied into url_scratch if it has to
+    // outlive it. Only the first HTTP_URL_INLINE bytes are copied.
+    const char *url;
+    size_t url_len;
+    size_t url_cap; // bytes of url we own, 0 while borrowing
+    char url_scratch[HTTP_URL_INLINE];
 } http_msg_t;
 
 typedef struct {
     int fd;
     http_msg_t msg;
     http_parser parser;
+    uint64_t requests;
+    int32_t source; // what admission control tracks us under
+    uvbloop_timer_t idle; // closes the connection once nothing was read for a while
+#ifdef UVBLOOP_COMPLETION
+    buffer_t out; // responses queued while parsing the current recv
+    buffer_t sending; // owned by the kernel until the send completes
+    uint64_t sent;
+    uint64_t read_at; // when the oldest read with responses in out completed
+    uint64_t sending_at; // read_at of what is in sending
+    uint32_t inflight; // loop operations that still reference us
+    bool closing;
+#else
+    outq_t out; // responses the socket hasn't taken yet
+    uvbloop_nset_t interest;
+#endif
 } connection_t;
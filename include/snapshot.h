@@ -0,0 +1,70 @@
+/**
+ * File: snapshot.h
+ * Snapshots for the in-memory backends. A snapshot is the backend's hash
+ * table written out slot for slot behind a 64 byte header with a checksum,
+ * so loading one is mapping the file and checking it, nothing gets inserted
+ * again. The mapping is private: the backend increments right in it and the
+ * file on disk stays as it was.
+ *
+ * Backends copy their table into a buffer from snapshot_begin while the
+ * incrementing threads carry on. A writer thread checksums and writes it to
+ * a temporary file and moves that over the old snapshot once it's synced.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Stats ticks between snapshots
+ */
+#define SNAPSHOT_TICKS 30
+
+typedef struct snapshot snapshot_t;
+
+
+/**
+ * Start a writer for snapshots of a table with slots of slot_size bytes.
+ * backend is recorded in the file so no other backend ever loads it.
+ */
+snapshot_t *snapshot_init(const char *path, const char *backend, size_t slot_size);
+
+/**
+ * Wait for the write in progress and stop the writer
+ */
+void snapshot_destroy(snapshot_t *snap);
+
+/**
+ * Get a buffer to copy a table of nslots slots into. NULL while the last
+ * snapshot is still being written, the caller skips this one then.
+ */
+void *snapshot_begin(snapshot_t *snap, size_t nslots);
+
+/**
+ * Hand the buffer from snapshot_begin over to be written, used is how many
+ * of its slots hold a key.
+ */
+void snapshot_commit(snapshot_t *snap, size_t used);
+
+/**
+ * Give up on the buffer from snapshot_begin, the table changed too much
+ * while it was being copied.
+ */
+void snapshot_abort(snapshot_t *snap);
+
+/**
+ * Wait until nothing is being written. Returns -1 if the last write failed.
+ */
+int snapshot_wait(snapshot_t *snap);
+
+/**
+ * Map the snapshot at path and return its slots, writable and private to us.
+ * NULL if there is none or it isn't intact, which is reported. The table's
+ * size and how many slots are in use come back through nslots and used.
+ */
+void *snapshot_load(const char *path, const char *backend, size_t slot_size, size_t *nslots, size_t *used);
+
+/**
+ * Unmap slots returned by snapshot_load
+ */
+void snapshot_unmap(void *slots, size_t nslots, size_t slot_size);
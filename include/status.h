@@ -0,0 +1,51 @@
+/**
+ * File: status.h
+ * The status page served on GET /. It is rendered by the stats timer into an
+ * immutable snapshot holding the complete HTTP response, workers just grab
+ * the current snapshot and write it out.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include "counter.h"
+
+
+/**
+ * A rendered status page. data holds len bytes of HTTP response. Once
+ * replaced it waits on a list for the workers to be done with it.
+ */
+typedef struct status_page {
+    _Atomic uint64_t refs;
+    struct status_page *replaced;
+    uint64_t retired;
+    size_t len;
+    char data[];
+} status_page_t;
+
+
+/**
+ * Render and publish the first status page.
+ */
+int status_init(counter_t *counter);
+
+
+/**
+ * Run via the timer system every RATE_TICK_MSECS. Samples the counter rates and
+ * publishes a freshly rendered status page.
+ */
+int status_update(void *data);
+
+
+/**
+ * Take a reference to the current status page. Only for threads registered
+ * with epoch.h, between quiescent states.
+ */
+status_page_t *status_acquire(void);
+
+
+/**
+ * Drop a reference taken with status_acquire.
+ */
+void status_release(status_page_t *page);
@@ -0,0 +1,63 @@
+/**
+ * File: timer_wheel.h
+ * Hierarchical timer wheel behind the uvbloop timer API. Each backend embeds
+ * one in its uvbloop and drives it from uvbloop_wait: the time until the
+ * next timer is due becomes the wait timeout and due timers are run at the
+ * start of the next wait, before any events are handed out.
+ *
+ * WHEEL_LEVELS levels of WHEEL_SLOTS slots. Level 0 has a slot per tick,
+ * every slot of level n covers a full turn of level n - 1 and is cascaded
+ * into the lower levels once time gets there. Arming and stopping a timer is
+ * a list insert or unlink, a bitmap per level lets us find the next
+ * occupied slot without walking the wheel.
+ */
+#pragma once
+
+#include <stdint.h>
+#include "uvbloop.h"
+
+// A tick is 2^17ns, a little over 131us
+#define WHEEL_TICK_SHIFT 17
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+// Timers further out than this, about 36 minutes, are parked at the top
+// and cascade down again once they get in range.
+#define WHEEL_RANGE (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+
+typedef struct {
+    uvbloop_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    // Set for every slot that may be non-empty. Stopping a timer doesn't
+    // clear its bit, wheel_timeout does once it runs into an empty slot.
+    uint64_t occupied[WHEEL_LEVELS];
+    uint64_t tick; // the next tick to be run
+    uint64_t now; // ns as of the last wheel_update
+} timer_wheel_t;
+
+
+/**
+ * Set up an empty wheel starting at the current time
+ */
+void wheel_init(timer_wheel_t *wheel);
+
+/**
+ * Read the clock into wheel->now
+ */
+void wheel_update(timer_wheel_t *wheel);
+
+/**
+ * Arm timer to fire usecs after wheel->now
+ */
+void wheel_start(timer_wheel_t *wheel, uvbloop_timer_t *timer, uint64_t usecs);
+
+/**
+ * ns from wheel->now until the next timer may be due, 0 if one already is
+ * and -1 if there are no timers at all.
+ */
+int64_t wheel_timeout(timer_wheel_t *wheel);
+
+/**
+ * Run the callbacks of every timer that is due as of wheel->now. Returns
+ * the number of timers that fired.
+ */
+int wheel_expire(timer_wheel_t *wheel, uvbloop_t *loop);
@@ -1,11 +1,14 @@
 /**
  * File: timers.h
- * Define a system for periodically running tasks within UVB. This is done
- * using timerfd's and epoll.
+ * Define a system for periodically running tasks within UVB. All of them
+ * run on a single thread off the timer wheel of its uvbloop. Other threads
+ * hand new and cancelled timers over through the list and poke the thread
+ * awake with a pipe.
  */
 #pragma once
 
 #include <pthread.h>
+#include <stdbool.h>
 #include "list.h"
 #include "stdint.h"
 #include "uvbloop.h"
@@ -20,8 +23,11 @@ typedef int (*timer_func_t)(void *data);
 typedef struct {
     timer_func_t func;
     int id;
-    uint64_t secs;
+    uint64_t msecs;
     void *data;
+    uvbloop_timer_t timer;
+    uint64_t due; // ns, when the current period ends
+    bool cancelled;
     struct rd_list_node list;
 } timer_entry_t;
 
@@ -36,6 +42,8 @@ typedef struct {
     pthread_mutex_t mutex;
     pthread_t thread;
     uvbloop_t *loop;
+    int wake[2];
+    int next_id;
 } timer_mgr_t;
 
 
@@ -46,13 +54,14 @@ int timer_mgr_init(timer_mgr_t *p);
 
 
 /**
- * Register a new function to be run after the given number of seconds. Returns
- * -1 on failure, the timer file descriptor on success.
+ * Register a new function to be run every msecs milliseconds. Returns -1 on
+ * failure, the id of the timer on success.
  */
-int register_timer(timer_mgr_t *p, timer_func_t func, uint64_t secs, void *data);
+int register_timer(timer_mgr_t *p, timer_func_t func, uint64_t msecs, void *data);
 
 
 /**
- * Unregister the timer given by its FD. Which acts like an ID. Return 0 on
- * success and -1 if the given timer doesn't exist.
+ * Unregister the timer given by its id. Return 0 on success and -1 if the
+ * given timer doesn't exist.
  */
+int unregister_timer(timer_mgr_t *p, int id);
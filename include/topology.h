@@ -0,0 +1,72 @@
+/**
+ * File: topology.h
+ * The machine's cpus as sysfs describes them: which core, package and NUMA
+ * node each online cpu belongs to. The server places its threads with it
+ * and has them keep their memory on their own node. Without sysfs every
+ * cpu is taken to be a core of its own on node 0.
+ */
+#pragma once
+
+#include <stddef.h>
+
+#define TOPO_MAX_CPUS 1024
+
+/**
+ * How threads are put on cpus.
+ * PLACE_COMPACT fills one node at a time, a thread per physical core before
+ *     any SMT siblings are used.
+ * PLACE_SPREAD deals threads out over the nodes in turn, again physical cores
+ *     first.
+ * PLACE_LINEAR puts thread i on the i-th online cpu.
+ * PLACE_NONE doesn't pin at all.
+ */
+typedef enum {
+    PLACE_COMPACT,
+    PLACE_SPREAD,
+    PLACE_LINEAR,
+    PLACE_NONE
+} placement_t;
+
+typedef struct {
+    int cpu;
+    int core;
+    int package;
+    int node;
+    int smt; // 0 for the first cpu of a core, 1 for its first sibling, ...
+} topo_cpu_t;
+
+typedef struct {
+    size_t ncpus;
+    size_t nnodes;
+    topo_cpu_t cpus[TOPO_MAX_CPUS]; // online cpus, ascending
+} topology_t;
+
+
+/**
+ * Read the topology of the machine
+ */
+int topology_init(topology_t *topo);
+
+/**
+ * Look a placement up by name: compact, spread, linear or none
+ */
+int placement_parse(const char *name, placement_t *policy);
+
+const char *placement_name(placement_t policy);
+
+/**
+ * Pick a cpu for each of nthreads threads, -1 for threads left unpinned.
+ * With more threads than cpus the placement starts over.
+ */
+void topology_place(const topology_t *topo, placement_t policy, size_t nthreads, int *cpus);
+
+/**
+ * The node of a cpu, -1 if it isn't known
+ */
+int topology_node(const topology_t *topo, int cpu);
+
+/**
+ * Have the calling thread allocate from node for as long as it has memory
+ * there. A no-op where there's no NUMA support.
+ */
+int topology_bind_memory(int node);
@@ -6,20 +6,70 @@
 /**
  * Abstract the options for READ/WRITE notifications
  * nset -> notification set
+ * UVBLOOP_EDGE only reports an fd again once something new happens on it,
+ * so whoever handles it has to drain it or call uvbloop_modify_fd to hear
+ * about what's left. Completion backends ignore it.
  */
 typedef enum {
     UVBLOOP_R = 0x01,
-    UVBLOOP_W = 0x02
+    UVBLOOP_W = 0x02,
+    UVBLOOP_EDGE = 0x04
 } uvbloop_nset_t;
 
+/**
+ * The kind of operation an event belongs to. Readiness backends only ever
+ * produce UVBLOOP_OP_POLL events, completion backends report the result of
+ * the operation that was submitted.
+ */
+typedef enum {
+    UVBLOOP_OP_POLL = 0,
+    UVBLOOP_OP_ACCEPT,
+    UVBLOOP_OP_RECV,
+    UVBLOOP_OP_SEND,
+    UVBLOOP_OP_CANCEL
+} uvbloop_op_t;
+
 /**
  * Forward declare our structures
  */
 typedef struct uvbloop uvbloop_t;
+typedef struct uvbloop_timer uvbloop_timer_t;
+
+/**
+ * Called from uvbloop_wait once a timer is due. The timer is no longer
+ * armed by then and may be started again from the callback.
+ */
+typedef void (*uvbloop_timer_cb)(uvbloop_t *loop, uvbloop_timer_t *timer);
+
+/**
+ * A one shot timer on the loop's timer wheel. Embed one in whatever needs a
+ * deadline, it's owned by the caller and never allocated by the loop.
+ */
+struct uvbloop_timer {
+    uvbloop_timer_t *next;
+    uvbloop_timer_t **pprev; // NULL while the timer isn't armed
+    uint64_t expires; // in wheel ticks
+    uvbloop_timer_cb cb;
+    void *data;
+};
 
 #ifdef EPOLL_BACKEND
 #include <sys/epoll.h>
 typedef struct epoll_event uvbloop_event_t;
+#elif defined(IO_URING_BACKEND)
+#include <stddef.h>
+#include <linux/io_uring.h>
+/**
+ * io_uring is completion based, so on top of the readiness API this backend
+ * also provides the completion API declared below.
+ */
+#define UVBLOOP_COMPLETION
+typedef struct {
+    uvbloop_op_t op;
+    int32_t res;
+    uint32_t flags;
+    void *data;
+} uvbloop_event_t;
 #else
 #include <stdint.h>
 #include <sys/types.h>
@@ -37,41 +87,125 @@ uvbloop_t *uvbloop_init(void *options);
  */
 int uvbloop_register_fd(uvbloop_t *loop, int fd, void *data, uvbloop_nset_t nset);
 
+/**
+ * Change the notifications we want for an already registered file descriptor
+ */
+int uvbloop_modify_fd(uvbloop_t *loop, int fd, void *data, uvbloop_nset_t nset);
+
 /**
  * Unregister a file descriptor from the loop.
  */
 int uvbloop_unregister_fd(uvbloop_t *loop, int fd);
 
 /**
- * Register a timer with the given uvbloop_t.
+ * Prepare a timer, it starts out disarmed
  */
-int uvbloop_register_timer(uvbloop_t *loop, uint64_t ms, void *data);
+void uvbloop_timer_init(uvbloop_timer_t *timer, uvbloop_timer_cb cb, void *data);
 
 /**
- * Reset a timer after uvbloop_wait returns it's event
+ * Arm a timer to fire usecs from now, or push an armed one back. Times are
+ * rounded up to the wheel's resolution of a little over 100us.
  */
-int uvbloop_reset_timer(uvbloop_t *loop, int id);
+void uvbloop_timer_start(uvbloop_t *loop, uvbloop_timer_t *timer, uint64_t usecs);
 
 /**
- * Unregister a timer from this eventloop. This is done by passing in an event
+ * Disarm a timer, does nothing if it isn't armed
  */
-int uvbloop_unregister_timer(uvbloop_t *loop, int id);
+void uvbloop_timer_stop(uvbloop_timer_t *timer);
 
 /**
- * Wait for events from the given uvbloop_t
+ * Check if a timer is armed
+ */
+bool uvbloop_timer_active(const uvbloop_timer_t *timer);
+
+/**
+ * Monotonic time in ns as of the last time uvbloop_wait returned
+ */
+uint64_t uvbloop_now(uvbloop_t *loop);
+
+/**
+ * Wait for events from the given uvbloop_t. Runs the callbacks of due timers
+ * first and then sleeps no longer than until the next one is due, so it
+ * returns 0 events when a timer needs to run.
  */
 int uvbloop_wait(uvbloop_t *loop, uvbloop_event_t *events, int max_events);
 
+/**
+ * uvbloop_wait that never sleeps, for busy polling. Due timers still run.
+ */
+int uvbloop_poll(uvbloop_t *loop, uvbloop_event_t *events, int max_events);
+
 /**
  * Check if an event has errors
  */
 bool uvbloop_event_error(uvbloop_event_t *event);
 
+/**
+ * Check if an event reports its file descriptor as readable
+ */
+bool uvbloop_event_readable(uvbloop_event_t *event);
+
+/**
+ * Check if an event reports its file descriptor as writable
+ */
+bool uvbloop_event_writable(uvbloop_event_t *event);
+
 /**
  * Get the data from an event
  */
 void *uvbloop_event_data(uvbloop_event_t *event);
 
+#ifdef UVBLOOP_COMPLETION
+/**
+ * Completion API. Operations are queued and submitted in one batch by the
+ * next uvbloop_wait. The data pointer is handed back in the completion event
+ * and must be at least 8 byte aligned.
+ */
+
+/**
+ * Start a multishot accept on a listening socket. Each completion carries a
+ * new client fd as its result.
+ */
+int uvbloop_accept(uvbloop_t *loop, int fd, void *data);
+
+/**
+ * Start a multishot recv on a socket. Data lands in a buffer owned by the
+ * loop which must be handed back with uvbloop_release_buffer.
+ */
+int uvbloop_recv(uvbloop_t *loop, int fd, void *data);
+
+/**
+ * Queue a send of len bytes from buf. buf must stay valid until the
+ * completion for this send has been seen.
+ */
+int uvbloop_send(uvbloop_t *loop, int fd, const void *buf, size_t len, void *data);
+
+/**
+ * Which operation produced this event
+ */
+uvbloop_op_t uvbloop_event_op(uvbloop_event_t *event);
+
+/**
+ * Result of the operation, a negative errno on failure
+ */
+int uvbloop_event_result(uvbloop_event_t *event);
+
+/**
+ * True if a multishot operation is still armed after this event
+ */
+bool uvbloop_event_more(uvbloop_event_t *event);
+
+/**
+ * Get the buffer a recv completion was written into, NULL if there is none
+ */
+char *uvbloop_event_buffer(uvbloop_t *loop, uvbloop_event_t *event);
+
+/**
+ * Return the buffer of a recv completion to the loop
+ */
+void uvbloop_release_buffer(uvbloop_t *loop, uvbloop_event_t *event);
+#endif
+
 /**
  * Destroy an instance of uvbloop_t
  */
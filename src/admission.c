@@ -0,0 +1,185 @@
+#include "admission.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+
+#define NSECS 1000000000ULL
+#define CONN_INTERVAL (NSECS / ADMIT_CONN_RATE)
+#define REQUEST_INTERVAL (NSECS / ADMIT_REQUEST_RATE)
+// fds kept back for everything that isn't a client connection
+#define ADMIT_FD_RESERVE 64
+
+struct source {
+    uint8_t addr[16];
+    bool used;
+    uint32_t conns; // open right now
+    uint64_t conn_tat;
+    uint64_t req_tat;
+};
+
+struct admission {
+    uint64_t seed;
+    struct source sources[ADMIT_SOURCES];
+};
+
+static uint64_t open_conns = 0;
+static uint64_t max_conns = ADMIT_MAX_CONNS;
+
+
+int admission_global_init(void) {
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        perror("getrlimit");
+        return -1;
+    }
+    if(limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < max_conns + ADMIT_FD_RESERVE) {
+        max_conns = limit.rlim_cur > ADMIT_FD_RESERVE * 2 ? limit.rlim_cur - ADMIT_FD_RESERVE : limit.rlim_cur / 2;
+    }
+    return 0;
+}
+
+
+admission_t *admission_init(void) {
+    admission_t *adm = NULL;
+    if((adm = calloc(1, sizeof(admission_t))) == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    // Don't let clients pick addresses that pile up in one probe window
+    adm->seed = (uint64_t)(uintptr_t)adm * 0x9E3779B97F4A7C15ULL;
+    return adm;
+}
+
+
+void admission_destroy(admission_t *adm) {
+    free(adm);
+}
+
+
+/**
+ * Turn addr into the key its source is tracked under. IPv4 addresses are
+ * mapped into IPv6, IPv6 ones are cut down to their /64 since anyone with
+ * a single address usually has the whole /64 to pick from.
+ */
+static bool source_key(const struct sockaddr *addr, uint8_t key[16]) {
+    if(addr->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        memset(key, 0, 10);
+        key[10] = 0xff;
+        key[11] = 0xff;
+        memcpy(key + 12, &in->sin_addr, 4);
+        return true;
+    }
+    if(addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        memcpy(key, &in6->sin6_addr, 8);
+        // v4 mapped addresses keep all of it
+        if(IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+            memcpy(key + 8, (const uint8_t *)&in6->sin6_addr + 8, 8);
+        } else {
+            memset(key + 8, 0, 8);
+        }
+        return true;
+    }
+    return false;
+}
+
+
+static inline size_t source_hash(admission_t *adm, const uint8_t key[16]) {
+    uint64_t hi = 0, lo = 0;
+    memcpy(&hi, key, 8);
+    memcpy(&lo, key + 8, 8);
+    uint64_t h = (hi ^ adm->seed) * 0xff51afd7ed558ccdULL;
+    h = (h ^ lo ^ (h >> 29)) * 0xc4ceb9fe1a85ec53ULL;
+    return (size_t)(h ^ (h >> 32));
+}
+
+
+/**
+ * Find the slot of a source, claiming one if it isn't tracked yet. A slot
+ * can be taken over once its source has nothing open and both its limits
+ * have caught up with now, at that point it's no different from a new one.
+ */
+static struct source *source_find(admission_t *adm, const uint8_t key[16], uint64_t now) {
+    size_t idx = source_hash(adm, key);
+    struct source *claim = NULL;
+    for(size_t i = 0; i < ADMIT_PROBE; i++) {
+        struct source *src = &adm->sources[(idx + i) & (ADMIT_SOURCES - 1)];
+        if(src->used && memcmp(src->addr, key, 16) == 0) {
+            return src;
+        }
+        if(claim == NULL && (!src->used || (src->conns == 0 && src->conn_tat <= now && src->req_tat <= now))) {
+            claim = src;
+        }
+    }
+    if(claim != NULL) {
+        memcpy(claim->addr, key, 16);
+        claim->used = true;
+        claim->conns = 0;
+        claim->conn_tat = 0;
+        claim->req_tat = 0;
+    }
+    return claim;
+}
+
+
+/**
+ * GCRA: let one more through if tat isn't further than tolerance ns ahead
+ * of now, and push it on by interval if so.
+ */
+static inline bool gcra(uint64_t *tat, uint64_t now, uint64_t interval, uint64_t tolerance) {
+    uint64_t t = *tat > now ? *tat : now;
+    if(t - now > tolerance) {
+        return false;
+    }
+    *tat = t + interval;
+    return true;
+}
+
+
+admit_t admission_connect(admission_t *adm, const struct sockaddr *addr, uint64_t now, int32_t *source) {
+    *source = ADMIT_UNTRACKED;
+    struct source *src = NULL;
+    uint8_t key[16];
+    if(source_key(addr, key)) {
+        src = source_find(adm, key, now);
+    }
+    if(src != NULL && (src->conns >= ADMIT_SOURCE_CONNS ||
+                !gcra(&src->conn_tat, now, CONN_INTERVAL, ADMIT_CONN_BURST * CONN_INTERVAL))) {
+        return ADMIT_DROP;
+    }
+    if(__atomic_fetch_add(&open_conns, 1, __ATOMIC_RELAXED) >= max_conns) {
+        __atomic_fetch_sub(&open_conns, 1, __ATOMIC_RELAXED);
+        return ADMIT_SHED;
+    }
+    if(src != NULL) {
+        src->conns++;
+        *source = (int32_t)(src - adm->sources);
+    }
+    return ADMIT_OK;
+}
+
+
+void admission_disconnect(admission_t *adm, int32_t source) {
+    __atomic_fetch_sub(&open_conns, 1, __ATOMIC_RELAXED);
+    if(source != ADMIT_UNTRACKED) {
+        adm->sources[source].conns--;
+    }
+}
+
+
+bool admission_request(admission_t *adm, int32_t source, uint64_t now) {
+    if(source == ADMIT_UNTRACKED) {
+        return true;
+    }
+    return gcra(&adm->sources[source].req_tat, now, REQUEST_INTERVAL, ADMIT_REQUEST_BURST * REQUEST_INTERVAL);
+}
+
+
+void admission_charge(admission_t *adm, int32_t source, uint64_t requests) {
+    if(source != ADMIT_UNTRACKED && requests > 1) {
+        adm->sources[source].req_tat += (requests - 1) * REQUEST_INTERVAL;
+    }
+}
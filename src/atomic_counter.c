@@ -2,6 +2,21 @@
  * File: atomic_counter.c
  *
  * A thread-safe hash table counter implementation, written atomically
+ *
+ * The table grows online. Once it is 80% full a table twice the size is
+ * chained on as tbl->next and every thread that touches the table migrates
+ * a chunk of slots into it before doing its own work. Nothing ever waits on
+ * another thread: a slot that has been migrated has the MOVED bit set in its
+ * count, and an empty slot the migrator passed over is claimed with
+ * moved_key, so an increment that runs into either simply follows the chain
+ * to the next table.
+ *
+ * Every SNAPSHOT_TICKS stats runs the table is copied out to a snapshot at
+ * path, and counter_init maps the last one back in as its first table.
+ *
+ * Threads that increment or read have to be registered with epoch.h, a
+ * table that has been migrated is only freed once they've all been
+ * quiescent since it was unlinked.
  */
 
 #define _GNU_SOURCE
@@ -10,19 +25,30 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdatomic.h>
-#include <assert.h>
 #include <err.h>
 #include "counter.h"
+#include "epoch.h"
 #include "server.h"
+#include "snapshot.h"
 
 #define atomic_load_relaxed(X) (atomic_load_explicit(X, memory_order_relaxed))
+#define atomic_load_acquire(X) (atomic_load_explicit(X, memory_order_acquire))
 #define atomic_fetch_add_relaxed(X, i) (atomic_fetch_add_explicit(X, i, memory_order_relaxed))
-#define atomic_compare_exchange_relaxed(obj, exp, des)           \
+#define atomic_fetch_add_acq_rel(X, i) (atomic_fetch_add_explicit(X, i, memory_order_acq_rel))
+#define atomic_compare_exchange_acq_rel(obj, exp, des)           \
     (atomic_compare_exchange_strong_explicit(obj, exp, des,        \
-                                             memory_order_relaxed, \
-                                             memory_order_relaxed))
+                                             memory_order_acq_rel, \
+                                             memory_order_acquire))
 
-#define KEYSZ 16
+/**
+ * Set in a slot's count once its value has been copied to the next table
+ */
+#define MOVED (1ULL << 63)
+
+/**
+ * Number of slots a thread migrates each time it helps with a resize
+ */
+#define MIGRATE_CHUNK 64
 
 typedef struct {
     unsigned char chars[KEYSZ];
@@ -30,166 +56,440 @@ typedef struct {
 
 static const hashkey_t zero_key = { .chars = { 0 } };
 
+/**
+ * Marks an empty slot the migrator has already passed. Cleaned keys are
+ * plain ASCII so no real key can ever look like this.
+ */
+static const hashkey_t moved_key = { .chars = { 0xff } };
+
 struct hashslot {
     _Atomic hashkey_t key;
     _Atomic uint64_t count;
 };
 
-struct counter {
+struct table {
     size_t size;
     _Atomic size_t used;
     struct hashslot *slots;
-    _Atomic(struct counter *) prev, prev2;
+    _Atomic(struct table *) next;
+    _Atomic size_t migrate_pos; // next chunk to hand out
+    _Atomic size_t migrated; // slots that have been copied into next
+    struct table *retired;
+    uint64_t retired_epoch;
+    bool mapped; // slots come from snapshot_load
+};
+
+struct counter {
+    _Atomic(struct table *) current;
+    // Tables that have been fully migrated. A thread may still be probing
+    // them, so gen_stats moves them to retiring until epoch_passed.
+    _Atomic(struct table *) retired;
+    struct table *retiring;
+    rates_t *rates;
+    snapshot_t *snap;
+    uint64_t ticks;
 };
 
 static const int size0 = 128;
 const char *counter_backend_name = "atomic";
 
-counter_t *counter_init(const char *path, uint64_t threads) {
-    (void)path; (void)threads;
-    assert(atomic_is_lock_free((_Atomic hashkey_t*)NULL));
-    struct counter *tbl = malloc(sizeof(struct counter));
-    tbl->size = size0;
-    tbl->slots = calloc(size0, sizeof(struct hashslot));
-    tbl->used = 0;
-    tbl->prev = tbl->prev2 = NULL;
+static struct table *table_new(size_t size) {
+    struct table *tbl = NULL;
+    if ((tbl = malloc(sizeof(struct table))) == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    if ((tbl->slots = calloc(size, sizeof(struct hashslot))) == NULL) {
+        perror("calloc");
+        free(tbl);
+        return NULL;
+    }
+    tbl->size = size;
+    atomic_init(&tbl->used, 0);
+    atomic_init(&tbl->next, NULL);
+    atomic_init(&tbl->migrate_pos, 0);
+    atomic_init(&tbl->migrated, 0);
+    tbl->retired = NULL;
+    tbl->retired_epoch = 0;
+    tbl->mapped = false;
     return tbl;
 }
 
-/* djb2 hash
+/**
+ * A table on the slots of the snapshot at path, NULL without one. The
+ * snapshot never holds migration marks, its slots are used as they are.
  */
-size_t hash(const hashkey_t key) {
-    size_t hash = 5381;
-
-    int c, i = 0;
-    while ((c = key.chars[i++])) {
-        hash = (hash * 33) ^ c;
+static struct table *table_load(const char *path) {
+    size_t size = 0, used = 0;
+    struct hashslot *slots = snapshot_load(path, counter_backend_name, sizeof(struct hashslot), &size, &used);
+    if (slots == NULL) {
+        return NULL;
     }
-
-    return hash;
+    struct table *tbl = NULL;
+    if ((tbl = malloc(sizeof(struct table))) == NULL) {
+        perror("malloc");
+        snapshot_unmap(slots, size, sizeof(struct hashslot));
+        return NULL;
+    }
+    tbl->size = size;
+    tbl->slots = slots;
+    atomic_init(&tbl->used, used);
+    atomic_init(&tbl->next, NULL);
+    atomic_init(&tbl->migrate_pos, 0);
+    atomic_init(&tbl->migrated, 0);
+    tbl->retired = NULL;
+    tbl->retired_epoch = 0;
+    tbl->mapped = true;
+    return tbl;
 }
 
-void counter_destroy(counter_t *tbl) {
+static void table_destroy(struct table *tbl) {
     if (tbl != NULL) {
-        free(tbl->slots);
+        if (tbl->mapped) {
+            snapshot_unmap(tbl->slots, tbl->size, sizeof(struct hashslot));
+        } else {
+            free(tbl->slots);
+        }
         free(tbl);
     }
 }
 
-counter_t *counter_copy(counter_t *tbl) {
-    counter_t *tbl1 = malloc(sizeof(counter_t));
-    tbl1->size = tbl->size;
-    tbl1->used = tbl->used;
-    tbl1->slots = malloc(tbl1->size * sizeof(struct hashslot));
-    struct hashslot *slots = tbl->slots;
+counter_t *counter_init(const char *path, uint64_t threads) {
+    (void)threads;
+    struct counter *c = malloc(sizeof(struct counter));
+    if (c == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    struct table *tbl = table_load(path);
+    if (tbl == NULL && (tbl = table_new(size0)) == NULL) {
+        free(c);
+        return NULL;
+    }
+    if ((c->rates = rates_init()) == NULL) {
+        table_destroy(tbl);
+        free(c);
+        return NULL;
+    }
+    if ((c->snap = snapshot_init(path, counter_backend_name, sizeof(struct hashslot))) == NULL) {
+        rates_destroy(c->rates);
+        table_destroy(tbl);
+        free(c);
+        return NULL;
+    }
+    atomic_init(&c->current, tbl);
+    atomic_init(&c->retired, NULL);
+    c->retiring = NULL;
+    c->ticks = 0;
+    return c;
+}
 
-    for (size_t i = 0; i < tbl1->size; ++i) {
-        tbl1->slots[i].key = slots[i].key;
-        tbl1->slots[i].count = slots[i].count;
+static void retired_free(struct table *tbl) {
+    while (tbl != NULL) {
+        struct table *next = tbl->retired;
+        table_destroy(tbl);
+        tbl = next;
     }
+}
 
-    return tbl1;
+static void counter_snapshot(counter_t *c);
+
+void counter_destroy(counter_t *c) {
+    if (c != NULL) {
+        snapshot_wait(c->snap);
+        counter_snapshot(c);
+        snapshot_destroy(c->snap);
+        struct table *tbl = atomic_load(&c->current);
+        while (tbl != NULL) {
+            struct table *next = atomic_load(&tbl->next);
+            table_destroy(tbl);
+            tbl = next;
+        }
+        retired_free(atomic_load(&c->retired));
+        retired_free(c->retiring);
+        rates_destroy(c->rates);
+        free(c);
+    }
 }
 
-static inline bool key_eq(hashkey_t key1, hashkey_t key2) {
-    return memcmp(&key1, &key2, sizeof(key1)) == 0;
+/**
+ * Chain a table twice the size onto tbl. Only one of the threads that race
+ * here wins, the rest throw their allocation away.
+ */
+static void table_grow(struct table *tbl) {
+    if (atomic_load_acquire(&tbl->next) != NULL) {
+        return;
+    }
+    struct table *next = table_new(tbl->size * 2);
+    if (next == NULL) {
+        errx(1, "Hash table filled up");
+    }
+    struct table *expected = NULL;
+    if (!atomic_compare_exchange_acq_rel(&tbl->next, &expected, next)) {
+        table_destroy(next);
+    }
 }
 
-static uint64_t key_incr(counter_t *tbl,
-                                const hashkey_t key,
-                                uint64_t count) {
+static uint64_t table_incr(struct table *tbl, const hashkey_t key, uint64_t count) {
+retry: ;
     size_t size = tbl->size;
 
-    for (size_t i = hash(key) % size;; i = (i + 1) % size) {
-        hashkey_t key1 = atomic_load_relaxed(&tbl->slots[i].key);
+    for (size_t i = key_hash(&key) % size;; i = (i + 1) % size) {
+        hashkey_t key1 = atomic_load_acquire(&tbl->slots[i].key);
 
-        if (key_eq(key1, key)) {
-            return atomic_fetch_add_relaxed(&tbl->slots[i].count, count);
-        } else if (key_eq(key1, zero_key)) {
-            hashkey_t key2 = zero_key;
-            atomic_compare_exchange_relaxed(&tbl->slots[i].key, &key2, key);
-            if (key_eq(key2, key) || key_eq(key2, zero_key)) {
+        if (key_empty(&key1)) {
+            // Never insert behind a migration, new keys go to the newest table
+            struct table *next = atomic_load_acquire(&tbl->next);
+            if (next != NULL) {
+                tbl = next;
+                goto retry;
+            }
+            if (atomic_compare_exchange_acq_rel(&tbl->slots[i].key, &key1, key)) {
                 size_t used = atomic_fetch_add_relaxed(&tbl->used, 1);
                 if (used + 1 > (size * 8) / 10) {
-                    errx(1, "Hash table filled up");
+                    table_grow(tbl);
                 }
-                return atomic_fetch_add_relaxed(&tbl->slots[i].count, count);
+                key1 = key;
+            }
+        }
+        if (key_eq(&key1, &key)) {
+            uint64_t old = atomic_fetch_add_acq_rel(&tbl->slots[i].count, count);
+            if (old & MOVED) {
+                // Too late, this slot already lives in the next table
+                tbl = atomic_load_acquire(&tbl->next);
+                goto retry;
             }
+            return old;
+        } else if (key_eq(&key1, &moved_key)) {
+            tbl = atomic_load_acquire(&tbl->next);
+            goto retry;
         }
     }
 }
 
-static inline uint64_t key_get(counter_t *tbl, const hashkey_t key) {
-    size_t size = tbl->size;
-    for (size_t i = hash(key) % size;; i = (i + 1) % size) {
-        hashkey_t key1 = atomic_load_relaxed(&tbl->slots[i].key);
-
-        if (key_eq(key, key1)) {
-            return atomic_load_relaxed(&tbl->slots[i].count);
-        } else if (key_eq(key, zero_key)) {
-            return 0;
+/**
+ * Copy one slot into the next table. Freezing the count with MOVED tells us
+ * exactly which increments landed here, later ones see the bit and retry
+ * against the next table.
+ */
+static void migrate_slot(struct table *tbl, struct table *next, size_t i) {
+    hashkey_t key = atomic_load_relaxed(&tbl->slots[i].key);
+    while (key_empty(&key)) {
+        if (atomic_compare_exchange_acq_rel(&tbl->slots[i].key, &key, moved_key)) {
+            return;
         }
     }
+    uint64_t count = atomic_fetch_or_explicit(&tbl->slots[i].count, MOVED, memory_order_acq_rel);
+    table_incr(next, key, count & ~MOVED);
 }
 
-static inline hashkey_t key_clean1(const char *src) {
-    hashkey_t ret = { .chars = { 0 } };
-    int clean_index = 0;
-    for(int i=0; i < KEYSZ-1; i++) {
-        if(src[i] == '\0') {
-             break;
+/**
+ * Move current forward past every table whose migration has finished. The
+ * thread that unlinks a table is the one that retires it.
+ */
+static void advance_current(counter_t *c) {
+    struct table *cur = atomic_load_acquire(&c->current);
+    while (true) {
+        struct table *next = atomic_load_acquire(&cur->next);
+        if (next == NULL || atomic_load_acquire(&cur->migrated) < cur->size) {
+            return;
+        }
+        if (atomic_compare_exchange_acq_rel(&c->current, &cur, next)) {
+            cur->retired_epoch = epoch_retire();
+            cur->retired = atomic_load(&c->retired);
+            while (!atomic_compare_exchange_weak(&c->retired, &cur->retired, cur));
+            cur = next;
         }
-        if(is_ascii(src[i])) {
-            ret.chars[clean_index] = src[i];
-            clean_index++;
+    }
+}
+
+/**
+ * Migrate a single chunk of tbl if it is being resized. Returns false once
+ * there is nothing left to hand out.
+ */
+static bool migrate_help(counter_t *c, struct table *tbl) {
+    struct table *next = atomic_load_acquire(&tbl->next);
+    if (next == NULL) {
+        return false;
+    }
+    size_t start = atomic_fetch_add_relaxed(&tbl->migrate_pos, MIGRATE_CHUNK);
+    if (start >= tbl->size) {
+        return false;
+    }
+    size_t end = start + MIGRATE_CHUNK < tbl->size ? start + MIGRATE_CHUNK : tbl->size;
+    for (size_t i = start; i < end; ++i) {
+        migrate_slot(tbl, next, i);
+    }
+    if (atomic_fetch_add_acq_rel(&tbl->migrated, end - start) + (end - start) == tbl->size) {
+        advance_current(c);
+    }
+    return true;
+}
+
+/**
+ * Hand out every remaining chunk of every pending migration. Other threads
+ * may still be finishing chunks they grabbed, which is fine for readers.
+ */
+static struct table *migrate_finish(counter_t *c) {
+    for (struct table *tbl = atomic_load_acquire(&c->current); tbl != NULL;
+            tbl = atomic_load_acquire(&tbl->next)) {
+        while (migrate_help(c, tbl));
+    }
+    return atomic_load_acquire(&c->current);
+}
+
+static uint64_t key_incr(counter_t *c,
+                                const hashkey_t key,
+                                uint64_t count) {
+    struct table *tbl = atomic_load_acquire(&c->current);
+    migrate_help(c, tbl);
+    return table_incr(tbl, key, count);
+}
+
+/**
+ * Look a key up, following the chain while a resize is in flight. Reads are
+ * not linearizable against a concurrent migration, which is fine for stats.
+ */
+static inline uint64_t key_get(struct table *tbl, const hashkey_t key) {
+    while (tbl != NULL) {
+        size_t size = tbl->size;
+        struct table *next = atomic_load_acquire(&tbl->next);
+        for (size_t i = key_hash(&key) % size;; i = (i + 1) % size) {
+            hashkey_t key1 = atomic_load_acquire(&tbl->slots[i].key);
+
+            if (key_eq(&key, &key1)) {
+                uint64_t count = atomic_load_acquire(&tbl->slots[i].count);
+                if (!(count & MOVED)) {
+                    return count + (next != NULL ? key_get(next, key) : 0);
+                }
+                break;
+            } else if (key_empty(&key1) || key_eq(&key1, &moved_key)) {
+                break;
+            }
         }
+        tbl = atomic_load_acquire(&tbl->next);
     }
+    return 0;
+}
+
+static inline hashkey_t key_clean1(const char *src) {
+    hashkey_t ret = { .chars = { 0 } };
+    key_clean((char *)ret.chars, src);
     return ret;
 }
 
-uint64_t counter_inc(counter_t *tbl, const char *key) {
+uint64_t counter_inc(counter_t *c, const char *key) {
     hashkey_t clean_key = key_clean1(key);
 
-    return key_incr(tbl, clean_key, 1);
+    uint64_t count = key_incr(c, clean_key, 1) + 1;
+    // While a resize is in flight part of the count can still be in the
+    // table being migrated away from
+    struct table *tbl = atomic_load_acquire(&c->current);
+    if (atomic_load_acquire(&tbl->next) != NULL) {
+        count = key_get(tbl, clean_key);
+    }
+    return count;
+}
+
+unsigned counter_tier(counter_t *c, uint64_t count) {
+    return rates_tier(c->rates, count);
 }
 
-uint64_t counter_get(counter_t *tbl, const char *key) {
+uint64_t counter_get(counter_t *c, const char *key) {
     hashkey_t clean_key = key_clean1(key);
 
-    return key_get(tbl, clean_key);
+    return key_get(atomic_load_acquire(&c->current), clean_key);
 }
 
-void counter_dump(counter_t *tbl, buffer_t *output) {
-    size_t size = atomic_load_relaxed(&tbl->size);
-    counter_t *prev = atomic_load_relaxed(&tbl->prev);
-    counter_t *prev2 = atomic_load_relaxed(&tbl->prev2);
+void counter_dump(counter_t *c, buffer_t *output) {
+    struct table *tbl = migrate_finish(c);
+    uint64_t rps[RATE_WINDOWS];
+
+    for (size_t i = 0; i < tbl->size; ++i) {
+        hashkey_t key = atomic_load_relaxed(&tbl->slots[i].key);
+        if (!key_empty(&key) && !key_eq(&key, &moved_key)) {
+            uint64_t count = atomic_load_relaxed(&tbl->slots[i].count) & ~MOVED;
+
+            rates_get(c->rates, (const char *)key.chars, rps);
+            counter_dump_line(output, (const char *)key.chars, count, rps);
+        }
+    }
+}
 
-    for (size_t i = 0; i < size; ++i) {
+/**
+ * Copy the table out to the snapshot writer, unless the last snapshot is
+ * still being written. Incrementing threads carry on while we copy, so each
+ * count is as of when we passed its slot. A resize starting meanwhile could
+ * move keys behind us and the copy is dropped, the next try gets it.
+ */
+static void counter_snapshot(counter_t *c) {
+    struct table *tbl = migrate_finish(c);
+    struct hashslot *buf = NULL;
+    if ((buf = snapshot_begin(c->snap, tbl->size)) == NULL) {
+        return;
+    }
+    size_t used = 0;
+    for (size_t i = 0; i < tbl->size; ++i) {
         hashkey_t key = atomic_load_relaxed(&tbl->slots[i].key);
-        if (!key_eq(tbl->slots[i].key, zero_key)) {
-            uint64_t count = atomic_load_relaxed(&tbl->slots[i].count);
-            char *str = NULL;
-                
-            uint64_t prevc = prev != NULL ? key_get(prev, key) : 0;
-            uint64_t prevc2 = prev2 != NULL ? key_get(prev2, key) : 0;
-            uint64_t rate = (prevc - prevc2) / STATS_SECS;
-
-            size_t size = asprintf(&str, "%.*s: %lu - %lurps\n",
-                                   KEYSZ,
-                                   key.chars,
-                                   count,
-                                   rate);
-            buffer_append(output, str, size);
-            free(str);
+        uint64_t count = 0;
+        if (key_eq(&key, &moved_key)) {
+            key = zero_key;
+        } else if (!key_empty(&key)) {
+            count = atomic_load_relaxed(&tbl->slots[i].count) & ~MOVED;
+            used++;
         }
+        atomic_init(&buf[i].key, key);
+        atomic_init(&buf[i].count, count);
+    }
+    if (atomic_load_acquire(&tbl->next) != NULL || used >= tbl->size) {
+        snapshot_abort(c->snap);
+        return;
     }
+    snapshot_commit(c->snap, used);
+}
+
+void counter_sync(counter_t *c) {
+    snapshot_wait(c->snap);
+    counter_snapshot(c);
+    snapshot_wait(c->snap);
 }
 
 int counter_gen_stats(void *data) {
-    counter_t *tbl = data;
-    counter_destroy(tbl->prev2);
-    counter_t *prev = atomic_load_relaxed(&tbl->prev);
-    atomic_store(&tbl->prev2, prev);
-    atomic_store(&tbl->prev, counter_copy(tbl));
+    counter_t *c = data;
+    struct table *tbl = migrate_finish(c);
+
+    // Free what nobody can still be probing, keep the rest for next time
+    struct table *retired = atomic_exchange(&c->retired, NULL);
+    while (retired != NULL) {
+        struct table *next = retired->retired;
+        retired->retired = c->retiring;
+        c->retiring = retired;
+        retired = next;
+    }
+    for (struct table **p = &c->retiring; *p != NULL;) {
+        struct table *old = *p;
+        if (epoch_passed(old->retired_epoch)) {
+            *p = old->retired;
+            table_destroy(old);
+        } else {
+            p = &old->retired;
+        }
+    }
+
+    // Read the counts in place, the incrementing threads never notice
+    for (size_t i = 0; i < tbl->size; ++i) {
+        hashkey_t key = atomic_load_relaxed(&tbl->slots[i].key);
+        if (!key_empty(&key) && !key_eq(&key, &moved_key)) {
+            uint64_t count = atomic_load_relaxed(&tbl->slots[i].count) & ~MOVED;
+            if (rates_add(c->rates, (const char *)key.chars, count) == -1) {
+                return -1;
+            }
+        }
+    }
+    rates_tick(c->rates);
+
+    if (++c->ticks % SNAPSHOT_TICKS == 0) {
+        counter_snapshot(c);
+    }
     return 0;
 }
@@ -0,0 +1,393 @@
+/**
+ * File: counter_bench.c
+ * Benchmark for the counter backends. Worker threads hammer counter_inc and
+ * counter_get over a set of keys picked from a Zipf distribution while a
+ * separate thread runs counter_gen_stats and counter_dump like the stats
+ * timer does. Each thread count in the list is a separate run on a fresh
+ * counter and prints one JSON object per line, so a list of thread counts
+ * gives a scaling curve.
+ *
+ * With -R every run ends by closing the counter and opening it again from
+ * disk, timing how long that takes and checking nothing went missing. Only
+ * the persistent backends get anything back.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include "counter.h"
+#include "epoch.h"
+#include "hist.h"
+
+#define MAXTHREADS 256
+// Only every SAMPLE_EVERY'th inc or get is timed so reading the clock
+// doesn't dominate what we're measuring.
+#define SAMPLE_EVERY 64
+
+typedef struct {
+    uint64_t threads[MAXTHREADS];
+    uint64_t nthreads;
+    uint64_t keys;
+    double zipf;
+    uint64_t get_pct;
+    uint64_t dump_ms;
+    uint64_t secs;
+    bool recover;
+    const char *path;
+} bench_opts_t;
+
+typedef struct {
+    pthread_t thread;
+    uint64_t seed;
+    uint64_t incs;
+    uint64_t gets;
+    hist_t inc_hist;
+    hist_t get_hist;
+} worker_t;
+
+typedef struct {
+    pthread_t thread;
+    uint64_t runs;
+    hist_t dump_hist;
+    hist_t stats_hist;
+} dumper_t;
+
+static bench_opts_t opts;
+static counter_t *counter;
+static char (*keys)[KEYSZ];
+static double *zipf_cdf;
+static _Atomic bool stop;
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* xorshift64*
+ */
+static inline uint64_t next_rand(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+
+/**
+ * Cumulative distribution of a Zipf distribution with exponent s over n
+ * ranks. s of 0 is uniform, around 1 a handful of names get most of the
+ * traffic.
+ */
+static double *zipf_init(uint64_t n, double s) {
+    double *cdf = NULL;
+    if((cdf = malloc(n * sizeof(double))) == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    double sum = 0;
+    for(uint64_t i = 0; i < n; i++) {
+        sum += 1.0 / pow((double)(i + 1), s);
+        cdf[i] = sum;
+    }
+    for(uint64_t i = 0; i < n; i++) {
+        cdf[i] /= sum;
+    }
+    return cdf;
+}
+
+
+static inline const char *pick_key(uint64_t *state) {
+    double u = (next_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+    uint64_t lo = 0, hi = opts.keys - 1;
+    while(lo < hi) {
+        uint64_t mid = (lo + hi) / 2;
+        if(zipf_cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return keys[lo];
+}
+
+
+static void *worker(void *ptr) {
+    worker_t *w = ptr;
+    uint64_t state = w->seed;
+    uint64_t ops = 0;
+
+    // Like a server worker, quiescent between operations
+    if(epoch_register() == -1) {
+        return NULL;
+    }
+    while(!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        epoch_quiescent();
+        const char *key = pick_key(&state);
+        bool get = (next_rand(&state) % 100) < opts.get_pct;
+        bool sample = (++ops % SAMPLE_EVERY) == 0;
+        uint64_t start = sample ? now_ns() : 0;
+        if(get) {
+            counter_get(counter, key);
+            w->gets++;
+        } else {
+            counter_inc(counter, key);
+            w->incs++;
+        }
+        if(sample) {
+            hist_record(get ? &w->get_hist : &w->inc_hist, now_ns() - start);
+        }
+    }
+    epoch_unregister();
+    return NULL;
+}
+
+
+/**
+ * Does what the stats timer does every dump_ms instead of every
+ * RATE_TICK_MSECS.
+ */
+static void *dumper(void *ptr) {
+    dumper_t *d = ptr;
+    buffer_t out;
+    if(buffer_init(&out) == -1) {
+        return NULL;
+    }
+    while(!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        usleep(opts.dump_ms * 1000);
+        uint64_t start = now_ns();
+        counter_gen_stats(counter);
+        uint64_t mid = now_ns();
+        counter_dump(counter, &out);
+        hist_record(&d->stats_hist, mid - start);
+        hist_record(&d->dump_hist, now_ns() - mid);
+        buffer_fast_clear(&out);
+        d->runs++;
+    }
+    buffer_free(&out);
+    return NULL;
+}
+
+
+/**
+ * Remove a database left over from a previous run. Some backends keep a file
+ * there, others a directory of them.
+ */
+static void remove_db(const char *path) {
+    if(unlink(path) == 0 || errno != EISDIR) {
+        return;
+    }
+    DIR *dir = NULL;
+    if((dir = opendir(path)) == NULL) {
+        return;
+    }
+    struct dirent *entry = NULL;
+    while((entry = readdir(dir)) != NULL) {
+        if(strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            unlinkat(dirfd(dir), entry->d_name, 0);
+        }
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+
+/**
+ * Sum of every key's count
+ */
+static uint64_t count_total(void) {
+    uint64_t total = 0;
+    for(uint64_t i = 0; i < opts.keys; i++) {
+        total += counter_get(counter, keys[i]);
+    }
+    return total;
+}
+
+
+static void print_hist(const char *name, hist_t *hist, bool last) {
+    printf("\"%s\":{\"count\":%lu,\"p50_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu,\"max_ns\":%lu}%s",
+            name, hist->total, hist_percentile(hist, 50.0), hist_percentile(hist, 99.0),
+            hist_percentile(hist, 99.9), hist->max, last ? "" : ",");
+}
+
+
+static int run(uint64_t nthreads, double *base_rate) {
+    if(opts.path != NULL) {
+        remove_db(opts.path);
+    }
+    if((counter = counter_init(opts.path, nthreads + 1)) == NULL) {
+        return -1;
+    }
+    worker_t *workers = NULL;
+    dumper_t *d = NULL;
+    if((workers = calloc(nthreads, sizeof(worker_t))) == NULL || (d = calloc(1, sizeof(dumper_t))) == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    atomic_store(&stop, false);
+    uint64_t start = now_ns();
+    for(uint64_t i = 0; i < nthreads; i++) {
+        workers[i].seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+        if(pthread_create(&workers[i].thread, NULL, worker, &workers[i]) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+    }
+    if(opts.dump_ms > 0 && pthread_create(&d->thread, NULL, dumper, d) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    sleep(opts.secs);
+    atomic_store(&stop, true);
+
+    hist_t *inc_hist = NULL, *get_hist = NULL;
+    if((inc_hist = calloc(1, sizeof(hist_t))) == NULL || (get_hist = calloc(1, sizeof(hist_t))) == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    uint64_t incs = 0, gets = 0;
+    for(uint64_t i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        incs += workers[i].incs;
+        gets += workers[i].gets;
+        hist_merge(inc_hist, &workers[i].inc_hist);
+        hist_merge(get_hist, &workers[i].get_hist);
+    }
+    if(opts.dump_ms > 0) {
+        pthread_join(d->thread, NULL);
+    }
+    double secs = (now_ns() - start) / 1e9;
+    double rate = (incs + gets) / secs;
+    if(*base_rate == 0) {
+        *base_rate = rate / nthreads;
+    }
+
+    // Every increment has to be accounted for, whatever the backend
+    uint64_t total = count_total();
+
+    printf("{\"backend\":\"%s\",\"threads\":%lu,\"keys\":%lu,\"zipf\":%.2f,\"get_pct\":%lu,"
+            "\"secs\":%.2f,\"ops\":%lu,\"ops_per_sec\":%.0f,\"ops_per_sec_per_thread\":%.0f,"
+            "\"scaling\":%.2f,\"lost_incs\":%ld,",
+            counter_backend_name, nthreads, opts.keys, opts.zipf, opts.get_pct,
+            secs, incs + gets, rate, rate / nthreads, rate / *base_rate,
+            (int64_t)(incs - total));
+    print_hist("inc", inc_hist, false);
+    print_hist("get", get_hist, false);
+    print_hist("gen_stats", &d->stats_hist, false);
+    print_hist("dump", &d->dump_hist, !opts.recover);
+    if(opts.recover) {
+        counter_destroy(counter);
+        uint64_t open_start = now_ns();
+        if((counter = counter_init(opts.path, nthreads + 1)) == NULL) {
+            return -1;
+        }
+        double recover_ms = (now_ns() - open_start) / 1e6;
+        printf("\"recover_ms\":%.2f,\"lost_on_recover\":%ld", recover_ms, (int64_t)(total - count_total()));
+    }
+    printf("}\n");
+    fflush(stdout);
+
+    counter_destroy(counter);
+    free(inc_hist);
+    free(get_hist);
+    free(workers);
+    free(d);
+    return 0;
+}
+
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -t threads   comma separated thread counts, one run each (1,2,4,8)\n"
+        "  -k keys      distinct keys (1000)\n"
+        "  -z s         Zipf exponent of the key popularity, 0 for uniform (0.99)\n"
+        "  -g pct       percentage of operations that are counter_get (0)\n"
+        "  -D ms        run counter_gen_stats and counter_dump every ms, 0 to not (100)\n"
+        "  -s secs      duration of each run (5)\n"
+        "  -R           reopen the counter after each run and time its recovery\n"
+        "  -o path      database path for persistent backends (./counter-bench.db)\n",
+        name);
+}
+
+
+int main(int argc, char *argv[]) {
+    char default_threads[] = "1,2,4,8";
+    char *threads = default_threads;
+    opts.keys = 1000;
+    opts.zipf = 0.99;
+    opts.get_pct = 0;
+    opts.dump_ms = 100;
+    opts.secs = 5;
+    opts.path = "./counter-bench.db";
+
+    int opt;
+    while((opt = getopt(argc, argv, "t:k:z:g:D:s:Ro:")) != -1) {
+        switch(opt) {
+            case 't': threads = optarg; break;
+            case 'k': opts.keys = strtoull(optarg, NULL, 10); break;
+            case 'z': opts.zipf = strtod(optarg, NULL); break;
+            case 'g': opts.get_pct = strtoull(optarg, NULL, 10); break;
+            case 'D': opts.dump_ms = strtoull(optarg, NULL, 10); break;
+            case 's': opts.secs = strtoull(optarg, NULL, 10); break;
+            case 'R': opts.recover = true; break;
+            case 'o': opts.path = optarg; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    for(char *tok = strtok(threads, ","); tok != NULL && opts.nthreads < MAXTHREADS; tok = strtok(NULL, ",")) {
+        if((opts.threads[opts.nthreads] = strtoull(tok, NULL, 10)) == 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        opts.nthreads++;
+    }
+    if(opts.nthreads == 0 || opts.keys == 0 || opts.get_pct > 100 || opts.secs == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if((keys = calloc(opts.keys, KEYSZ)) == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for(uint64_t i = 0; i < opts.keys; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "key%lu", i);
+        memcpy(keys[i], key, KEYSZ - 1);
+    }
+    if((zipf_cdf = zipf_init(opts.keys, opts.zipf)) == NULL) {
+        return 1;
+    }
+
+    double base_rate = 0;
+    for(uint64_t i = 0; i < opts.nthreads; i++) {
+        if(run(opts.threads[i], &base_rate) == -1) {
+            return 1;
+        }
+    }
+    if(opts.path != NULL) {
+        remove_db(opts.path);
+    }
+    free(zipf_cdf);
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include "epoch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+
+/**
+ * A registered thread. epoch is the global epoch as of its last quiescent
+ * state, 0 while it's offline. Records are never freed, a thread that
+ * registers takes over one that's no longer in use.
+ */
+struct epoch_thread {
+    _Atomic uint64_t epoch;
+    _Atomic bool used;
+    struct epoch_thread *next;
+} __attribute__((aligned(64)));
+
+static _Atomic uint64_t global_epoch = 1;
+static _Atomic(struct epoch_thread *) threads = NULL;
+static __thread struct epoch_thread *local = NULL;
+
+
+int epoch_register(void) {
+    struct epoch_thread *t = NULL;
+    for(t = atomic_load(&threads); t != NULL; t = t->next) {
+        bool used = false;
+        if(!atomic_load_explicit(&t->used, memory_order_relaxed) &&
+                atomic_compare_exchange_strong(&t->used, &used, true)) {
+            break;
+        }
+    }
+    if(t == NULL) {
+        if((t = aligned_alloc(64, sizeof(struct epoch_thread))) == NULL) {
+            perror("aligned_alloc");
+            return -1;
+        }
+        atomic_init(&t->epoch, 0);
+        atomic_init(&t->used, true);
+        t->next = atomic_load(&threads);
+        while(!atomic_compare_exchange_weak(&threads, &t->next, t));
+    }
+    local = t;
+    epoch_online();
+    return 0;
+}
+
+
+void epoch_unregister(void) {
+    if(local != NULL) {
+        atomic_store_explicit(&local->epoch, 0, memory_order_release);
+        atomic_store_explicit(&local->used, false, memory_order_release);
+        local = NULL;
+    }
+}
+
+
+/**
+ * The acquire pairs with epoch_retire, anything unlinked before the epoch
+ * read here is out of sight from now on.
+ */
+void epoch_quiescent(void) {
+    if(local != NULL) {
+        uint64_t epoch = atomic_load_explicit(&global_epoch, memory_order_acquire);
+        atomic_store_explicit(&local->epoch, epoch, memory_order_release);
+    }
+}
+
+
+void epoch_offline(void) {
+    if(local != NULL) {
+        atomic_store_explicit(&local->epoch, 0, memory_order_release);
+    }
+}
+
+
+/**
+ * The epoch has to be visible before the thread reads any shared pointer,
+ * or epoch_passed could still see it offline and let go of what it reads.
+ */
+void epoch_online(void) {
+    if(local != NULL) {
+        atomic_store(&local->epoch, atomic_load(&global_epoch));
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+}
+
+
+uint64_t epoch_retire(void) {
+    return atomic_fetch_add(&global_epoch, 1) + 1;
+}
+
+
+bool epoch_passed(uint64_t stamp) {
+    atomic_thread_fence(memory_order_seq_cst);
+    for(struct epoch_thread *t = atomic_load(&threads); t != NULL; t = t->next) {
+        uint64_t epoch = atomic_load_explicit(&t->epoch, memory_order_acquire);
+        if(epoch != 0 && epoch < stamp) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -1,13 +1,19 @@
+#define _GNU_SOURCE
 #include "uvbloop.h"
 #include <sys/epoll.h>
-#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
+#include "timer_wheel.h"
 
 
 struct uvbloop {
     int epoll_fd;
+    bool pwait2; // epoll_pwait2 takes a timespec, epoll_wait only ms
+    timer_wheel_t wheel;
 };
 
 
@@ -27,12 +33,18 @@ uvbloop_t *uvbloop_init(void *options) {
         free(new);
         return NULL;
     }
+#ifdef __NR_epoll_pwait2
+    new->pwait2 = true;
+#else
+    new->pwait2 = false;
+#endif
+    wheel_init(&new->wheel);
     return new;
 }
 
 
-int uvbloop_register_fd(uvbloop_t *loop, int fd, void *data, uvbloop_nset_t nset) {
-    char events = 0;
+static int uvbloop_ctl(uvbloop_t *loop, int op, int fd, void *data, uvbloop_nset_t nset) {
+    uint32_t events = 0;
     struct epoll_event event;
 
     if(nset & UVBLOOP_R) {
@@ -41,9 +53,13 @@ int uvbloop_register_fd(uvbloop_t *loop, int fd, void *data, uvbloop_nset_t nset
     if(nset & UVBLOOP_W) {
         events |= EPOLLOUT;
     }
+    // A MOD checks the fd again, so it also rearms an edge that was missed
+    if(nset & UVBLOOP_EDGE) {
+        events |= EPOLLET;
+    }
     event.data.ptr = data;
     event.events = events;
-    if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    if(epoll_ctl(loop->epoll_fd, op, fd, &event) == -1) {
         perror("epoll_ctl");
         return -1;
     }
@@ -51,82 +67,84 @@ int uvbloop_register_fd(uvbloop_t *loop, int fd, void *data, uvbloop_nset_t nset
 }
 
 
-/**
- * Register a timer with the given uvbloop_t.
- * Editors Note: Fuck Linux
- */
-int uvbloop_register_timer(uvbloop_t *loop, uint64_t ms, void *data) {
-    uint64_t ns = ms * 1000000;
-    uint64_t sec = 0;
-    struct itimerspec new_value;
-    struct timespec now;
-    int ret = 0;
-
-    if(clock_gettime(CLOCK_REALTIME, &now) == -1) {
-        perror("clock_gettime");
-        return -1;
-    }
-    while(ns > 999999999) {
-        sec += 1;
-        ns -= 1000000000;
-    }
-    new_value.it_value.tv_sec = sec;
-    new_value.it_value.tv_nsec = ns;
-    new_value.it_interval.tv_sec = sec;
-    new_value.it_interval.tv_nsec = ns;
-    int fd = -1;
-    if((fd = timerfd_create(CLOCK_MONOTONIC, 0)) == -1) {
-        perror("timerfd_create");
-        return -1;
-    }
+int uvbloop_register_fd(uvbloop_t *loop, int fd, void *data, uvbloop_nset_t nset) {
+    return uvbloop_ctl(loop, EPOLL_CTL_ADD, fd, data, nset);
+}
 
-    if(timerfd_settime(fd, 0, &new_value, NULL) == -1) {
-        perror("timerfd_settime");
-        return -1;
-    }
 
-    if(uvbloop_register_fd(loop, fd, data, UVBLOOP_R) != 0) {
-        perror("uvbloop_register_fd");
+int uvbloop_modify_fd(uvbloop_t *loop, int fd, void *data, uvbloop_nset_t nset) {
+    return uvbloop_ctl(loop, EPOLL_CTL_MOD, fd, data, nset);
+}
+
+
+int uvbloop_unregister_fd(uvbloop_t *loop, int fd) {
+    if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+        perror("epoll_ctl");
         return -1;
     }
-    return fd;
+    return 0;
 }
 
 
-/**
- * Unregister a timer from this eventloop. This is done by passing in an event
- */
-int uvbloop_unregister_timer(uvbloop_t *loop, int id) {
-    close(id);
-    return uvbloop_unregister_fd(loop, id);
+void uvbloop_timer_start(uvbloop_t *loop, uvbloop_timer_t *timer, uint64_t usecs) {
+    wheel_start(&loop->wheel, timer, usecs);
 }
 
 
-int uvbloop_reset_timer(uvbloop_t *loop, int id) {
-    (void)loop;
-    uint64_t exp;
-    read(id, &exp, sizeof(uint64_t));
-    (void)exp;
-    return 0;
+uint64_t uvbloop_now(uvbloop_t *loop) {
+    return loop->wheel.now;
 }
 
 
-int uvbloop_unregister_fd(uvbloop_t *loop, int fd) {
-    if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1) {
-        perror("epoll_ctl");
-        return -1;
+/**
+ * epoll_wait until the next timer is due. Kernels from before 5.11 only
+ * have the millisecond timeout, there the timeout is rounded up.
+ */
+static int uvbloop_epoll_wait(uvbloop_t *loop, uvbloop_event_t *events, int max_events, int64_t timeout) {
+#ifdef __NR_epoll_pwait2
+    if(loop->pwait2) {
+        struct timespec ts = { timeout / 1000000000, timeout % 1000000000 };
+        int ret = (int)syscall(__NR_epoll_pwait2, loop->epoll_fd, events, max_events,
+                timeout < 0 ? NULL : &ts, NULL, 0);
+        if(ret != -1 || errno != ENOSYS) {
+            return ret;
+        }
+        loop->pwait2 = false;
     }
-    return 0;
+#endif
+    int ms = timeout < 0 ? -1 : (int)((timeout + 999999) / 1000000);
+    return epoll_wait(loop->epoll_fd, (struct epoll_event *)events, max_events, ms);
 }
 
 
 int uvbloop_wait(uvbloop_t *loop, uvbloop_event_t *events, int max_events) {
-    return epoll_wait(loop->epoll_fd, (struct epoll_event *)events, max_events, -1);
+    wheel_update(&loop->wheel);
+    wheel_expire(&loop->wheel, loop);
+    int ret = uvbloop_epoll_wait(loop, events, max_events, wheel_timeout(&loop->wheel));
+    wheel_update(&loop->wheel);
+    return ret;
+}
+
+
+int uvbloop_poll(uvbloop_t *loop, uvbloop_event_t *events, int max_events) {
+    wheel_update(&loop->wheel);
+    wheel_expire(&loop->wheel, loop);
+    return epoll_wait(loop->epoll_fd, (struct epoll_event *)events, max_events, 0);
 }
 
 
 bool uvbloop_event_error(uvbloop_event_t *e) {
-    return e->events & EPOLLERR || e->events & EPOLLHUP || !(e->events & EPOLLIN);
+    return e->events & EPOLLERR || e->events & EPOLLHUP || !(e->events & (EPOLLIN | EPOLLOUT));
+}
+
+
+bool uvbloop_event_readable(uvbloop_event_t *e) {
+    return e->events & EPOLLIN;
+}
+
+
+bool uvbloop_event_writable(uvbloop_event_t *e) {
+    return e->events & EPOLLOUT;
 }
 
 
@@ -0,0 +1,136 @@
+#include "fastpath.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define VEC_WIDTH 32
+typedef __m256i vec_t;
+#define vec_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define vec_set1(c) _mm256_set1_epi8(c)
+#define vec_eq(a, b) _mm256_cmpeq_epi8(a, b)
+#define vec_lt(a, b) _mm256_cmpgt_epi8(b, a)
+#define vec_or(a, b) _mm256_or_si256(a, b)
+#define vec_mask(a) ((uint32_t)_mm256_movemask_epi8(a))
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define VEC_WIDTH 16
+typedef __m128i vec_t;
+#define vec_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define vec_set1(c) _mm_set1_epi8(c)
+#define vec_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define vec_lt(a, b) _mm_cmplt_epi8(a, b)
+#define vec_or(a, b) _mm_or_si128(a, b)
+#define vec_mask(a) ((uint32_t)_mm_movemask_epi8(a))
+#endif
+
+#define REQUEST_PREFIX "GET /"
+#define REQUEST_VERSION " HTTP/1.1\r\n"
+
+
+/**
+ * Index of the first byte that can't be part of a url: controls, space,
+ * DEL and anything non ascii. Returns len if there is none.
+ */
+static size_t scan_url(const char *buf, size_t len) {
+    size_t i = 0;
+#ifdef VEC_WIDTH
+    // As signed bytes everything non ascii is negative, so a single
+    // less than catches it along with the controls and space.
+    const vec_t space = vec_set1(0x21);
+    const vec_t del = vec_set1(0x7f);
+    for(; i + VEC_WIDTH <= len; i += VEC_WIDTH) {
+        vec_t v = vec_load(buf + i);
+        uint32_t mask = vec_mask(vec_or(vec_lt(v, space), vec_eq(v, del)));
+        if(mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for(; i < len; i++) {
+        signed char c = buf[i];
+        if(c < 0x21 || c == 0x7f) {
+            return i;
+        }
+    }
+    return len;
+}
+
+
+/**
+ * Index of the first '\n' at or after from, or len if there is none.
+ */
+static size_t scan_newline(const char *buf, size_t from, size_t len) {
+    size_t i = from;
+#ifdef VEC_WIDTH
+    const vec_t nl = vec_set1('\n');
+    for(; i + VEC_WIDTH <= len; i += VEC_WIDTH) {
+        uint32_t mask = vec_mask(vec_eq(vec_load(buf + i), nl));
+        if(mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    const char *nl_at = memchr(buf + i, '\n', len - i);
+    return nl_at != NULL ? (size_t)(nl_at - buf) : len;
+}
+
+
+/**
+ * Case insensitive check whether the header line at buf is name. Headers
+ * that could give the request a body have to go through http_parser.
+ */
+static int header_is(const char *buf, size_t len, const char *name, size_t name_len) {
+    if(len < name_len) {
+        // Can't tell yet, assume the worst
+        return 1;
+    }
+    for(size_t i = 0; i < name_len; i++) {
+        if((buf[i] | 0x20) != name[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+size_t fastpath_get(const char *buf, size_t len, const char **url, size_t *url_len) {
+    const size_t prefix_len = sizeof(REQUEST_PREFIX) - 1;
+    const size_t version_len = sizeof(REQUEST_VERSION) - 1;
+    if(len < prefix_len + version_len + 2 || memcmp(buf, REQUEST_PREFIX, prefix_len) != 0) {
+        return 0;
+    }
+
+    // The url runs from the slash up to the space before the version
+    size_t url_end = prefix_len + scan_url(buf + prefix_len, len - prefix_len);
+    if(url_end + version_len > len || memcmp(buf + url_end, REQUEST_VERSION, version_len) != 0) {
+        return 0;
+    }
+
+    // Walk the header lines until the empty one that ends the request
+    size_t line = url_end + version_len;
+    while(line + 2 <= len) {
+        if(buf[line] == '\r') {
+            if(buf[line + 1] != '\n') {
+                return 0;
+            }
+            *url = buf + prefix_len - 1;
+            *url_len = url_end - prefix_len + 1;
+            return line + 2;
+        }
+        char c = buf[line] | 0x20;
+        if(c == 'c' && header_is(buf + line, len - line, "content-length:", 15)) {
+            return 0;
+        }
+        if(c == 't' && header_is(buf + line, len - line, "transfer-encoding:", 18)) {
+            return 0;
+        }
+        size_t nl = scan_newline(buf, line, len);
+        // Bare newlines are http_parser's problem
+        if(nl == len || buf[nl - 1] != '\r') {
+            return 0;
+        }
+        line = nl + 1;
+    }
+    return 0;
+}
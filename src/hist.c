@@ -0,0 +1,70 @@
+#include "hist.h"
+#include <string.h>
+
+
+void hist_init(hist_t *hist) {
+    memset(hist, 0, sizeof(hist_t));
+}
+
+
+void hist_merge(hist_t *dest, const hist_t *src) {
+    for(size_t i = 0; i < HIST_BUCKETS; i++) {
+        dest->counts[i] += src->counts[i];
+    }
+    dest->total += src->total;
+    if(src->max > dest->max) {
+        dest->max = src->max;
+    }
+}
+
+
+void hist_snapshot(hist_t *dest, const hist_t *src) {
+    for(size_t i = 0; i < HIST_BUCKETS; i++) {
+        dest->counts[i] += __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+    }
+    dest->total += __atomic_load_n(&src->total, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if(max > dest->max) {
+        dest->max = max;
+    }
+}
+
+
+void hist_interval(hist_t *dest, const hist_t *cur, const hist_t *prev) {
+    dest->total = 0;
+    dest->max = 0;
+    for(size_t i = 0; i < HIST_BUCKETS; i++) {
+        dest->counts[i] = cur->counts[i] - prev->counts[i];
+        dest->total += dest->counts[i];
+        if(dest->counts[i] != 0) {
+            dest->max = hist_value(i);
+        }
+    }
+    if(dest->max > cur->max) {
+        dest->max = cur->max;
+    }
+}
+
+
+uint64_t hist_value(size_t index) {
+    if(index < HIST_SUB) {
+        return index;
+    }
+    int exp = index / HIST_SUB + HIST_SUB_BITS - 1;
+    uint64_t sub = index % HIST_SUB;
+    return ((HIST_SUB + sub + 1) << (exp - HIST_SUB_BITS)) - 1;
+}
+
+
+uint64_t hist_percentile(const hist_t *hist, double pct) {
+    uint64_t rank = (uint64_t)(hist->total * pct / 100.0);
+    uint64_t seen = 0;
+    for(size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if(seen > rank) {
+            uint64_t value = hist_value(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
@@ -10,8 +10,10 @@ void init_http_msg(http_msg_t *msg) {
     msg->current_header = 0;
     msg->header_ready = false;
     msg->reading_value = false;
-    memset(&msg->headers, 0, sizeof(msg->headers));
-    buffer_init(&msg->url);
+    msg->url = NULL;
+    msg->url_len = 0;
+    msg->url_cap = 0;
+    msg->started = false;
     msg->done = false;
 }
 
@@ -21,20 +23,52 @@ void free_http_header(http_header_t *header) {
 }
 
 void free_http_msg(http_msg_t *msg) {
-    if(msg->done == false && msg->current_header == 0) {
-        // we got some weird ass invalid request...
-        goto free_http_msg_url_free;
-    }
-    for(uint64_t i=0; i<=msg->current_header; i++) {
+    // Only headers we have started filling were ever initialized
+    uint64_t headers = msg->current_header + (msg->header_ready ? 1 : 0);
+    for(uint64_t i=0; i<headers; i++) {
         free_http_header(&msg->headers[i]);
     }
-free_http_msg_url_free:
-    buffer_free(&msg->url);
 }
 
+/**
+ * Only the first url_cap bytes of a detached url are kept, url_len goes on
+ * counting. That's all anything looks at: the key is cut to KEYSZ - 1 and
+ * a url that long matches no route.
+ */
+void http_msg_detach(http_msg_t *msg) {
+    if(msg->url_len == 0 || msg->url_cap > 0) {
+        return;
+    }
+    size_t keep = msg->url_len < HTTP_URL_INLINE ? msg->url_len : HTTP_URL_INLINE;
+    memmove(msg->url_scratch, msg->url, keep);
+    msg->url = msg->url_scratch;
+    msg->url_cap = HTTP_URL_INLINE;
+}
+
+/**
+ * The first piece of the url is only referenced. Anything after it came
+ * from a later read, by then http_msg_detach has given us a copy to extend.
+ */
 int on_url(http_parser *hp, const char *at, size_t len) {
     connection_t *session = hp->data;
-    buffer_append(&session->msg.url, at, len);
+    http_msg_t *msg = &session->msg;
+    if(msg->url_len == 0) {
+        msg->url = at;
+        msg->url_len = len;
+        return 0;
+    }
+    http_msg_detach(msg);
+    if(msg->url_len < msg->url_cap) {
+        size_t room = msg->url_cap - msg->url_len;
+        memcpy(msg->url_scratch + msg->url_len, at, len < room ? len : room);
+    }
+    msg->url_len += len;
+    return 0;
+}
+
+int on_message_begin(http_parser *hp) {
+    connection_t *session = hp->data;
+    session->msg.started = true;
     return 0;
 }
 
@@ -76,7 +110,8 @@ int http_header_compare(http_msg_t *msg, const char *name, const char *value) {
 }
 
 int http_url_compare(http_msg_t *msg, const char *value) {
-    if (strlen(value) != buffer_length(&msg->url)) return 1;
-    int foo = strncmp(msg->url.buffer, value, buffer_length(&msg->url));
+    if (strlen(value) != msg->url_len) return 1;
+    if (msg->url_cap > 0 && msg->url_len > msg->url_cap) return 1;
+    int foo = memcmp(msg->url, value, msg->url_len);
     return foo;
 }
@@ -0,0 +1,561 @@
+/**
+ * File: io_uring_uvbloop.c
+ * io_uring implementation of uvbloop. Talks to the kernel directly through
+ * io_uring_setup/io_uring_enter instead of pulling in liburing.
+ *
+ * On top of the readiness API (emulated with multishot poll) this backend
+ * provides the completion API from uvbloop.h: multishot accept, multishot
+ * recv into a ring of provided buffers, and sends that are only queued in
+ * the submission ring. Everything queued between two uvbloop_wait calls goes
+ * to the kernel in a single io_uring_enter.
+ */
+#define _GNU_SOURCE
+#include "uvbloop.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/time_types.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "timer_wheel.h"
+
+
+#define URING_ENTRIES 1024
+#define URING_BUF_COUNT 1024
+#define URING_BUF_SIZE 4096
+#define URING_BUF_GROUP 0
+
+/**
+ * The operation type is stored in the low bits of the user_data we hand to
+ * the kernel, the rest is the caller's data pointer. Everything we get passed
+ * is a malloc'd structure so the bottom 3 bits are always free.
+ */
+#define URING_OP_MASK 0x7ULL
+
+
+struct uvbloop {
+    int ring_fd;
+    unsigned sq_entries;
+    unsigned sqe_tail;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_sz;
+    void *cq_ring;
+    size_t cq_ring_sz;
+    size_t sqes_sz;
+
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_sz;
+    char *bufs;
+    uint16_t buf_tail;
+
+    timer_wheel_t wheel;
+};
+
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+
+static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nargs) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+
+/**
+ * Map the submission and completion rings into our address space.
+ */
+static int uring_map(uvbloop_t *loop, struct io_uring_params *p) {
+    loop->sq_ring_sz = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    loop->cq_ring_sz = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if(p->features & IORING_FEAT_SINGLE_MMAP) {
+        if(loop->cq_ring_sz > loop->sq_ring_sz) {
+            loop->sq_ring_sz = loop->cq_ring_sz;
+        }
+        loop->cq_ring_sz = loop->sq_ring_sz;
+    }
+
+    loop->sq_ring = mmap(NULL, loop->sq_ring_sz, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_SQ_RING);
+    if(loop->sq_ring == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    if(p->features & IORING_FEAT_SINGLE_MMAP) {
+        loop->cq_ring = loop->sq_ring;
+    }
+    else {
+        loop->cq_ring = mmap(NULL, loop->cq_ring_sz, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_CQ_RING);
+        if(loop->cq_ring == MAP_FAILED) {
+            perror("mmap");
+            return -1;
+        }
+    }
+
+    loop->sqes_sz = p->sq_entries * sizeof(struct io_uring_sqe);
+    loop->sqes = mmap(NULL, loop->sqes_sz, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_SQES);
+    if(loop->sqes == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    char *sq = loop->sq_ring;
+    char *cq = loop->cq_ring;
+    loop->sq_entries = p->sq_entries;
+    loop->sq_head = (unsigned *)(sq + p->sq_off.head);
+    loop->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+    loop->sq_mask = (unsigned *)(sq + p->sq_off.ring_mask);
+    loop->sq_array = (unsigned *)(sq + p->sq_off.array);
+    loop->cq_head = (unsigned *)(cq + p->cq_off.head);
+    loop->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+    loop->cq_mask = (unsigned *)(cq + p->cq_off.ring_mask);
+    loop->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+
+    // We never reorder submissions so the indirection array is fixed
+    for(unsigned i=0; i<p->sq_entries; i++) {
+        loop->sq_array[i] = i;
+    }
+    loop->sqe_tail = *loop->sq_tail;
+    return 0;
+}
+
+
+/**
+ * Allocate the receive buffers and register them with the kernel as a
+ * provided buffer ring. Multishot recv picks a buffer out of this ring for
+ * every completion and we hand it back with uvbloop_release_buffer.
+ */
+static int uring_setup_buffers(uvbloop_t *loop) {
+    loop->buf_ring_sz = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    loop->buf_ring = mmap(NULL, loop->buf_ring_sz, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(loop->buf_ring == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    if((loop->bufs = malloc(URING_BUF_COUNT * URING_BUF_SIZE)) == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)loop->buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if(uring_register(loop->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        perror("io_uring_register");
+        return -1;
+    }
+
+    loop->buf_tail = 0;
+    for(uint16_t i=0; i<URING_BUF_COUNT; i++) {
+        struct io_uring_buf *buf = &loop->buf_ring->bufs[loop->buf_tail & (URING_BUF_COUNT - 1)];
+        buf->addr = (uint64_t)(uintptr_t)(loop->bufs + (size_t)i * URING_BUF_SIZE);
+        buf->len = URING_BUF_SIZE;
+        buf->bid = i;
+        loop->buf_tail++;
+    }
+    __atomic_store_n(&loop->buf_ring->tail, loop->buf_tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+/**
+ * Hand everything in the submission ring to the kernel, optionally waiting
+ * for at least one completion. A wait gives up after timeout ns, a negative
+ * timeout waits for as long as it takes.
+ */
+static int uring_submit_wait(uvbloop_t *loop, unsigned wait, int64_t timeout) {
+    __atomic_store_n(loop->sq_tail, loop->sqe_tail, __ATOMIC_RELEASE);
+    unsigned submit = loop->sqe_tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+    if(submit == 0 && wait == 0) {
+        return 0;
+    }
+    if(wait == 0 || timeout < 0) {
+        return uring_enter(loop->ring_fd, submit, wait, flags, NULL, 0);
+    }
+    struct __kernel_timespec ts = { timeout / 1000000000, timeout % 1000000000 };
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    int ret = uring_enter(loop->ring_fd, submit, wait, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if(ret == -1 && errno == ETIME) {
+        return 0;
+    }
+    return ret;
+}
+
+
+static int uring_submit(uvbloop_t *loop, unsigned wait) {
+    return uring_submit_wait(loop, wait, -1);
+}
+
+
+/**
+ * Grab a free submission queue entry. If the ring is full we flush it to
+ * the kernel first rather than failing.
+ */
+static struct io_uring_sqe *uring_get_sqe(uvbloop_t *loop) {
+    unsigned head = __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+    if(loop->sqe_tail - head >= loop->sq_entries) {
+        if(uring_submit(loop, 0) == -1) {
+            perror("io_uring_enter");
+            return NULL;
+        }
+        head = __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+        if(loop->sqe_tail - head >= loop->sq_entries) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &loop->sqes[loop->sqe_tail & *loop->sq_mask];
+    loop->sqe_tail++;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+
+static inline uint64_t uring_user_data(void *data, uvbloop_op_t op) {
+    return (uint64_t)(uintptr_t)data | (uint64_t)op;
+}
+
+
+uvbloop_t *uvbloop_init(void *options) {
+    (void)options;
+    uvbloop_t *new = NULL;
+    if((new = calloc(1, sizeof(uvbloop_t))) == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+
+    // Every loop is driven by exactly one thread, let the kernel know so it
+    // can skip cross thread task work notifications. Older kernels reject
+    // these flags so fall back to a plain ring.
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    if((new->ring_fd = uring_setup(URING_ENTRIES, &params)) == -1 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        new->ring_fd = uring_setup(URING_ENTRIES, &params);
+    }
+    if(new->ring_fd == -1) {
+        perror("io_uring_setup");
+        free(new);
+        return NULL;
+    }
+    if(uring_map(new, &params) == -1 || uring_setup_buffers(new) == -1) {
+        uvbloop_destroy(new);
+        return NULL;
+    }
+    wheel_init(&new->wheel);
+    return new;
+}
+
+
+/**
+ * Readiness notifications are emulated with multishot poll requests.
+ */
+int uvbloop_register_fd(uvbloop_t *loop, int fd, void *data, uvbloop_nset_t nset) {
+    struct io_uring_sqe *sqe = NULL;
+    if((sqe = uring_get_sqe(loop)) == NULL) {
+        perror("uring_get_sqe");
+        return -1;
+    }
+    uint32_t events = 0;
+    if(nset & UVBLOOP_R) {
+        events |= POLLIN;
+    }
+    if(nset & UVBLOOP_W) {
+        events |= POLLOUT;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = uring_user_data(data, UVBLOOP_OP_POLL);
+    return 0;
+}
+
+
+/**
+ * Update the events of the multishot poll registered for data in place.
+ */
+int uvbloop_modify_fd(uvbloop_t *loop, int fd, void *data, uvbloop_nset_t nset) {
+    (void)fd;
+    struct io_uring_sqe *sqe = NULL;
+    if((sqe = uring_get_sqe(loop)) == NULL) {
+        perror("uring_get_sqe");
+        return -1;
+    }
+    uint32_t events = 0;
+    if(nset & UVBLOOP_R) {
+        events |= POLLIN;
+    }
+    if(nset & UVBLOOP_W) {
+        events |= POLLOUT;
+    }
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = uring_user_data(data, UVBLOOP_OP_POLL);
+    sqe->poll32_events = events;
+    sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+    sqe->user_data = uring_user_data(NULL, UVBLOOP_OP_CANCEL);
+    return 0;
+}
+
+
+/**
+ * Cancel everything outstanding against the given fd. The cancelled requests
+ * still generate a final completion (-ECANCELED) so owners of the fd must
+ * keep their data alive until those arrive.
+ */
+int uvbloop_unregister_fd(uvbloop_t *loop, int fd) {
+    struct io_uring_sqe *sqe = NULL;
+    if((sqe = uring_get_sqe(loop)) == NULL) {
+        perror("uring_get_sqe");
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = uring_user_data(NULL, UVBLOOP_OP_CANCEL);
+    return 0;
+}
+
+
+void uvbloop_timer_start(uvbloop_t *loop, uvbloop_timer_t *timer, uint64_t usecs) {
+    wheel_start(&loop->wheel, timer, usecs);
+}
+
+
+uint64_t uvbloop_now(uvbloop_t *loop) {
+    return loop->wheel.now;
+}
+
+
+int uvbloop_accept(uvbloop_t *loop, int fd, void *data) {
+    struct io_uring_sqe *sqe = NULL;
+    if((sqe = uring_get_sqe(loop)) == NULL) {
+        perror("uring_get_sqe");
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = uring_user_data(data, UVBLOOP_OP_ACCEPT);
+    return 0;
+}
+
+
+int uvbloop_recv(uvbloop_t *loop, int fd, void *data) {
+    struct io_uring_sqe *sqe = NULL;
+    if((sqe = uring_get_sqe(loop)) == NULL) {
+        perror("uring_get_sqe");
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = uring_user_data(data, UVBLOOP_OP_RECV);
+    return 0;
+}
+
+
+int uvbloop_send(uvbloop_t *loop, int fd, const void *buf, size_t len, void *data) {
+    struct io_uring_sqe *sqe = NULL;
+    if((sqe = uring_get_sqe(loop)) == NULL) {
+        perror("uring_get_sqe");
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = uring_user_data(data, UVBLOOP_OP_SEND);
+    return 0;
+}
+
+
+static int uring_reap(uvbloop_t *loop, uvbloop_event_t *events, int max_events, unsigned head, unsigned tail);
+
+
+/**
+ * Submit everything queued since the last call and reap completions. We only
+ * block in the kernel when the completion ring is empty, and then no longer
+ * than until the next timer is due. Due timers run first, before any of the
+ * events they might refer to are handed out.
+ */
+int uvbloop_wait(uvbloop_t *loop, uvbloop_event_t *events, int max_events) {
+    wheel_update(&loop->wheel);
+    wheel_expire(&loop->wheel, loop);
+
+    unsigned head = *loop->cq_head;
+    unsigned tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+    if(head == tail) {
+        int64_t timeout = wheel_timeout(&loop->wheel);
+        if(uring_submit_wait(loop, timeout == 0 ? 0 : 1, timeout) == -1) {
+            return -1;
+        }
+        tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+        wheel_update(&loop->wheel);
+    }
+    else if(uring_submit(loop, 0) == -1 && errno != EBUSY && errno != EAGAIN) {
+        return -1;
+    }
+    return uring_reap(loop, events, max_events, head, tail);
+}
+
+
+/**
+ * Submit what's queued and take whatever completions are ready, without
+ * waiting for any. Entering with GETEVENTS also runs the task work that
+ * COOP_TASKRUN leaves for us to post completions.
+ */
+int uvbloop_poll(uvbloop_t *loop, uvbloop_event_t *events, int max_events) {
+    wheel_update(&loop->wheel);
+    wheel_expire(&loop->wheel, loop);
+
+    unsigned head = *loop->cq_head;
+    unsigned tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+    if(head == tail || loop->sqe_tail != __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(loop->sq_tail, loop->sqe_tail, __ATOMIC_RELEASE);
+        unsigned submit = loop->sqe_tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+        if(uring_enter(loop->ring_fd, submit, 0, IORING_ENTER_GETEVENTS, NULL, 0) == -1 &&
+                errno != EBUSY && errno != EAGAIN && errno != EINTR) {
+            return -1;
+        }
+        tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+    }
+    return uring_reap(loop, events, max_events, head, tail);
+}
+
+
+/**
+ * Hand out the completions from head up to tail, max_events at most, and
+ * give their slots back to the kernel.
+ */
+static int uring_reap(uvbloop_t *loop, uvbloop_event_t *events, int max_events, unsigned head, unsigned tail) {
+    int count = 0;
+    for(; head != tail && count < max_events; head++, count++) {
+        struct io_uring_cqe *cqe = &loop->cqes[head & *loop->cq_mask];
+        events[count].op = (uvbloop_op_t)(cqe->user_data & URING_OP_MASK);
+        events[count].data = (void *)(uintptr_t)(cqe->user_data & ~URING_OP_MASK);
+        events[count].res = cqe->res;
+        events[count].flags = cqe->flags;
+    }
+    __atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+
+bool uvbloop_event_error(uvbloop_event_t *event) {
+    if(event->res < 0) {
+        return true;
+    }
+    if(event->op == UVBLOOP_OP_POLL) {
+        return event->res & (POLLERR | POLLHUP);
+    }
+    return false;
+}
+
+
+bool uvbloop_event_readable(uvbloop_event_t *event) {
+    return event->op == UVBLOOP_OP_POLL && event->res > 0 && (event->res & POLLIN);
+}
+
+
+bool uvbloop_event_writable(uvbloop_event_t *event) {
+    return event->op == UVBLOOP_OP_POLL && event->res > 0 && (event->res & POLLOUT);
+}
+
+
+void *uvbloop_event_data(uvbloop_event_t *event) {
+    return event->data;
+}
+
+
+uvbloop_op_t uvbloop_event_op(uvbloop_event_t *event) {
+    return event->op;
+}
+
+
+int uvbloop_event_result(uvbloop_event_t *event) {
+    return event->res;
+}
+
+
+bool uvbloop_event_more(uvbloop_event_t *event) {
+    return event->flags & IORING_CQE_F_MORE;
+}
+
+
+char *uvbloop_event_buffer(uvbloop_t *loop, uvbloop_event_t *event) {
+    if(!(event->flags & IORING_CQE_F_BUFFER)) {
+        return NULL;
+    }
+    uint16_t bid = event->flags >> IORING_CQE_BUFFER_SHIFT;
+    return loop->bufs + (size_t)bid * URING_BUF_SIZE;
+}
+
+
+void uvbloop_release_buffer(uvbloop_t *loop, uvbloop_event_t *event) {
+    if(!(event->flags & IORING_CQE_F_BUFFER)) {
+        return;
+    }
+    uint16_t bid = event->flags >> IORING_CQE_BUFFER_SHIFT;
+    struct io_uring_buf *buf = &loop->buf_ring->bufs[loop->buf_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(loop->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    loop->buf_tail++;
+    __atomic_store_n(&loop->buf_ring->tail, loop->buf_tail, __ATOMIC_RELEASE);
+}
+
+
+void uvbloop_destroy(uvbloop_t *loop) {
+    if(loop->sqes != NULL && loop->sqes != MAP_FAILED) {
+        munmap(loop->sqes, loop->sqes_sz);
+    }
+    if(loop->cq_ring != NULL && loop->cq_ring != MAP_FAILED && loop->cq_ring != loop->sq_ring) {
+        munmap(loop->cq_ring, loop->cq_ring_sz);
+    }
+    if(loop->sq_ring != NULL && loop->sq_ring != MAP_FAILED) {
+        munmap(loop->sq_ring, loop->sq_ring_sz);
+    }
+    if(loop->buf_ring != NULL && loop->buf_ring != MAP_FAILED) {
+        munmap(loop->buf_ring, loop->buf_ring_sz);
+    }
+    free(loop->bufs);
+    close(loop->ring_fd);
+    free(loop);
+}
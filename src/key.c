@@ -0,0 +1,160 @@
+#include "key.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KEY_X86
+#endif
+
+/**
+ * Letters and digits, bit c of the 256
+ */
+static const uint64_t key_chars[4] = { 0x03ff000000000000ULL, 0x07fffffe07fffffeULL, 0, 0 };
+
+
+/**
+ * One byte at a time but without a branch per byte: every byte is stored
+ * and the position only advances past the ones that are kept.
+ */
+static void key_clean_scalar(char *dest, const char *src) {
+    size_t n = 0;
+    for(int i = 0; i < KEYSZ - 1 && src[i] != '\0'; i++) {
+        unsigned char c = (unsigned char)src[i];
+        dest[n] = (char)c;
+        n += (key_chars[c >> 6] >> (c & 63)) & 1;
+    }
+    dest[n] = '\0';
+}
+
+
+#ifdef KEY_X86
+
+/**
+ * Per-nibble classes of the key characters. A byte is a letter or digit iff
+ * the classes of its low and high nibble share a bit: 1 for 0-9, 2 for
+ * A-O and a-o, 4 for P-Z and p-z.
+ */
+#define KEY_LUT_LO 5, 7, 7, 7, 7, 7, 7, 7, 7, 7, 6, 2, 2, 2, 2, 2
+#define KEY_LUT_HI 0, 0, 0, 1, 2, 4, 2, 4, 0, 0, 0, 0, 0, 0, 0, 0
+
+/**
+ * For every 8 bit mask, the pshufb indices that gather the set bytes of an
+ * 8 byte half to its start. 0x80 fills the rest with zeroes.
+ */
+static uint64_t key_compress[256];
+
+static void key_compress_init(void) {
+    for(int mask = 0; mask < 256; mask++) {
+        uint64_t idx = 0x8080808080808080ULL;
+        int n = 0;
+        for(int i = 0; i < 8; i++) {
+            if(mask & (1 << i)) {
+                idx &= ~(0xffULL << (8 * n));
+                idx |= (uint64_t)i << (8 * n);
+                n++;
+            }
+        }
+        key_compress[mask] = idx;
+    }
+}
+
+/**
+ * Load the 16 bytes at src. Reading past the terminating NUL is harmless as
+ * long as it stays within the page, near the end of one the key is copied
+ * out first.
+ */
+static inline __m128i key_load(const char *src) {
+    if(((uintptr_t)src & 4095) > 4096 - KEYSZ) {
+        char buf[KEYSZ] = { 0 };
+        for(int i = 0; i < KEYSZ - 1 && src[i] != '\0'; i++) {
+            buf[i] = src[i];
+        }
+        return _mm_loadu_si128((const __m128i *)buf);
+    }
+    return _mm_loadu_si128((const __m128i *)src);
+}
+
+/**
+ * Bit i set if byte i of the key is to be kept: a letter or digit, before
+ * the first NUL and not the 16th.
+ */
+__attribute__((target("ssse3")))
+static inline unsigned key_keep(__m128i v) {
+    const __m128i lut_lo = _mm_setr_epi8(KEY_LUT_LO);
+    const __m128i lut_hi = _mm_setr_epi8(KEY_LUT_HI);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(v, nibble));
+    __m128i hi = _mm_shuffle_epi8(lut_hi, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+    unsigned kept = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) & 0xffff;
+    unsigned nul = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) | 0x8000;
+    return kept & ((nul & -nul) - 1);
+}
+
+/**
+ * Compact each half with pshufb and store the second right behind the
+ * first. Its trailing zeroes and dest's own cover everything after.
+ */
+__attribute__((target("ssse3,popcnt")))
+static void key_clean_ssse3(char *dest, const char *src) {
+    __m128i v = key_load(src);
+    unsigned keep = key_keep(v);
+    __m128i shuffle = _mm_set_epi64x((long long)(key_compress[keep >> 8] | 0x0808080808080808ULL),
+                                     (long long)key_compress[keep & 0xff]);
+    v = _mm_shuffle_epi8(v, shuffle);
+    _mm_storel_epi64((__m128i *)dest, v);
+    _mm_storel_epi64((__m128i *)(dest + __builtin_popcount(keep & 0xff)), _mm_unpackhi_epi64(v, v));
+}
+
+/**
+ * AVX-512 compresses the kept bytes in a single instruction
+ */
+__attribute__((target("avx512vl,avx512bw,avx512vbmi2")))
+static void key_clean_vbmi2(char *dest, const char *src) {
+    __m128i v = key_load(src);
+    _mm_storeu_si128((__m128i *)dest, _mm_maskz_compress_epi8((__mmask16)key_keep(v), v));
+}
+
+static void (*key_clean_resolve(void))(char *, const char *) {
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512bw") &&
+            __builtin_cpu_supports("avx512vbmi2")) {
+        return key_clean_vbmi2;
+    }
+    if(__builtin_cpu_supports("ssse3") && __builtin_cpu_supports("popcnt")) {
+        key_compress_init();
+        return key_clean_ssse3;
+    }
+    return key_clean_scalar;
+}
+
+#ifdef __ELF__
+
+void key_clean(char *dest, const char *src) __attribute__((ifunc("key_clean_resolve")));
+
+#else
+
+/**
+ * No ifunc outside ELF, resolve once at load time and call through a
+ * pointer instead.
+ */
+static void (*key_clean_impl)(char *, const char *) = key_clean_scalar;
+
+__attribute__((constructor))
+static void key_clean_init(void) {
+    key_clean_impl = key_clean_resolve();
+}
+
+void key_clean(char *dest, const char *src) {
+    key_clean_impl(dest, src);
+}
+
+#endif
+
+#else
+
+void key_clean(char *dest, const char *src) {
+    key_clean_scalar(dest, src);
+}
+
+#endif
@@ -3,9 +3,11 @@
 #include <sys/types.h>
 #include <sys/event.h>
 #include <sys/time.h>
+#include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include "timer_wheel.h"
 
 
 #define KQ_MAX_CL_SIZE 64
@@ -15,6 +17,7 @@ struct uvbloop {
     int kq_fd;
     int cl_index;
     struct kevent pending[KQ_MAX_CL_SIZE];
+    timer_wheel_t wheel;
 };
 
 
@@ -31,6 +34,7 @@ uvbloop_t *uvbloop_init(void *options) {
         return NULL;
     }
     new->cl_index = 0;
+    wheel_init(&new->wheel);
     return new;
 }
 
@@ -52,58 +56,33 @@ int uvbloop_register_fd(uvbloop_t *loop, int fd, void *data, uvbloop_nset_t nset
     if(nset & UVBLOOP_W) {
         filter |= EVFILT_WRITE;
     }
-    EV_SET(&loop->pending[loop->cl_index], (uintptr_t)fd, filter, EV_ADD, 0, 0, data);
+    u_short flags = EV_ADD | ((nset & UVBLOOP_EDGE) ? EV_CLEAR : 0);
+    EV_SET(&loop->pending[loop->cl_index], (uintptr_t)fd, filter, flags, 0, 0, data);
     loop->cl_index++;
     return 0;
 }
 
 
 /**
- * Register a timer using the timer system that is a part of kqueue. In this case
- * we explicitly call kevent after creating the timer to ensure it starts
- * immediately.
+ * Both filters stay registered, the ones that aren't wanted are disabled.
  */
-int uvbloop_register_timer(uvbloop_t *loop, uint64_t ms, void *data) {
-    short filter = EVFILT_TIMER;
-    short flags = EV_ADD;
-    short fflags = 0;
-    EV_SET(&loop->pending[loop->cl_index], (uintptr_t)data, filter, flags, fflags, ms, data);
-    loop->cl_index++;
-    const struct kevent *pending = loop->pending;
-    int res = kevent(loop->kq_fd, pending, loop->cl_index, NULL, 0, NULL);
-    if(res == -1) {
-        perror("kevent");
-        return -1;
+int uvbloop_modify_fd(uvbloop_t *loop, int fd, void *data, uvbloop_nset_t nset) {
+    if(loop->cl_index + 2 > KQ_MAX_CL_SIZE) {
+        const struct kevent *pending = loop->pending;
+        int res = kevent(loop->kq_fd, pending, loop->cl_index, NULL, 0, NULL);
+        if(res == -1) {
+            perror("kevent");
+            return -1;
+        }
+        loop->cl_index = 0;
     }
-    loop->cl_index = 0;
-    return (uintptr_t)data;
-}
-
-
-/**
- * the unregister_timer function looks a lot like the register timer function!
- * This is because kqueue uses the same syscall for pretty much everything.
- */
-int uvbloop_unregister_timer(uvbloop_t *loop, int id) {
-    short filter = 0;
-    short fflags = 0;
-    short flags = EV_DELETE;
-    EV_SET(&loop->pending[loop->cl_index], (uintptr_t)id, filter, flags, fflags, 0, NULL);
+    u_short clear = (nset & UVBLOOP_EDGE) ? EV_CLEAR : 0;
+    u_short rflags = EV_ADD | clear | ((nset & UVBLOOP_R) ? EV_ENABLE : EV_DISABLE);
+    u_short wflags = EV_ADD | clear | ((nset & UVBLOOP_W) ? EV_ENABLE : EV_DISABLE);
+    EV_SET(&loop->pending[loop->cl_index], (uintptr_t)fd, EVFILT_READ, rflags, 0, 0, data);
+    loop->cl_index++;
+    EV_SET(&loop->pending[loop->cl_index], (uintptr_t)fd, EVFILT_WRITE, wflags, 0, 0, data);
     loop->cl_index++;
-    const struct kevent *pending = loop->pending;
-    int res = kevent(loop->kq_fd, pending, loop->cl_index, NULL, 0, NULL);
-    if(res == -1) {
-        perror("kevent");
-        return -1;
-    }
-    loop->cl_index = 0;
-    return 0;
-}
-
-
-int uvbloop_reset_timer(uvbloop_t *loop, int id) {
-    (void)loop;
-    (void)id;
     return 0;
 }
 
@@ -127,10 +106,39 @@ int uvbloop_unregister_fd(uvbloop_t *loop, int fd) {
 }
 
 
+void uvbloop_timer_start(uvbloop_t *loop, uvbloop_timer_t *timer, uint64_t usecs) {
+    wheel_start(&loop->wheel, timer, usecs);
+}
+
+
+uint64_t uvbloop_now(uvbloop_t *loop) {
+    return loop->wheel.now;
+}
+
+
 int uvbloop_wait(uvbloop_t *loop, uvbloop_event_t *events, int max_events) {
+    wheel_update(&loop->wheel);
+    wheel_expire(&loop->wheel, loop);
+    int64_t timeout = wheel_timeout(&loop->wheel);
+    struct timespec ts = { timeout / 1000000000, timeout % 1000000000 };
+
+    const struct kevent *pending = loop->pending;
+    int res = kevent(loop->kq_fd, pending, loop->cl_index,
+            (struct kevent *)events, max_events, timeout < 0 ? NULL : &ts);
+    loop->cl_index = 0;
+    wheel_update(&loop->wheel);
+    return res;
+}
+
+
+int uvbloop_poll(uvbloop_t *loop, uvbloop_event_t *events, int max_events) {
+    wheel_update(&loop->wheel);
+    wheel_expire(&loop->wheel, loop);
+    struct timespec ts = { 0, 0 };
+
     const struct kevent *pending = loop->pending;
     int res = kevent(loop->kq_fd, pending, loop->cl_index,
-            (struct kevent *)events, max_events, NULL);
+            (struct kevent *)events, max_events, &ts);
     loop->cl_index = 0;
     return res;
 }
@@ -141,6 +149,16 @@ bool uvbloop_event_error(uvbloop_event_t *event) {
 }
 
 
+bool uvbloop_event_readable(uvbloop_event_t *event) {
+    return event->filter == EVFILT_READ;
+}
+
+
+bool uvbloop_event_writable(uvbloop_event_t *event) {
+    return event->filter == EVFILT_WRITE;
+}
+
+
 void *uvbloop_event_data(uvbloop_event_t *event) {
     return event->udata;
 }
@@ -65,3 +65,21 @@ struct rd_list_node *rd_list_remove_by_func(struct rd_list_head *head, rd_list_f
     node->prev->next = NULL;
     return node;
 }
+
+
+void rd_list_unlink(struct rd_list_head *head, struct rd_list_node *node) {
+    if(node->prev != NULL) {
+        node->prev->next = node->next;
+    }
+    else {
+        head->head = node->next;
+    }
+    if(node->next != NULL) {
+        node->next->prev = node->prev;
+    }
+    else {
+        head->tail = node->prev;
+    }
+    node->next = NULL;
+    node->prev = NULL;
+}
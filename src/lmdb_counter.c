@@ -4,29 +4,525 @@
  * LMDB. We explicity use MDB_WRITEMAP | MDB_MAPASYNC in order to get the speed
  * required for UVB. As such we do not have write durability. You have been
  * warned.
+ *
+ * Increments never touch LMDB directly. Every thread bumps pending deltas in
+ * its own table and a persister thread folds all of them into the database
+ * with one write transaction every FLUSH_MSECS, so workers don't serialize on
+ * LMDB's writer lock.
+ *
+ * Counters live in the "counters" sub-database and nothing else does, the
+ * "stats" one only holds what older versions kept next to them. The map
+ * starts at MDB_MAPSIZE0 and doubles whenever a flush runs out of room.
+ * Each thread keeps one read transaction and renews it for every read.
  */
 
 #define _GNU_SOURCE
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include <lmdb.h>
 #include "server.h"
 #include "counter.h"
 
+#define atomic_load_relaxed(X) (atomic_load_explicit(X, memory_order_relaxed))
+#define atomic_load_acquire(X) (atomic_load_explicit(X, memory_order_acquire))
+#define atomic_store_relaxed(X, v) (atomic_store_explicit(X, v, memory_order_relaxed))
+#define atomic_store_release(X, v) (atomic_store_explicit(X, v, memory_order_release))
+
+/**
+ * A pending delta. The key is written before used is published. Only the
+ * owning thread adds to delta, only the persister subtracts what it has
+ * committed. base is the persisted total as of the last commit and is only
+ * used to give counter_inc a sensible return value. dirty is set while the
+ * slot is on its shard's dirty list.
+ */
+struct deltaslot {
+    _Atomic bool used;
+    _Atomic bool dirty;
+    char key[KEYSZ];
+    _Atomic uint64_t delta;
+    _Atomic uint64_t base;
+};
+
+/**
+ * A single thread's pending deltas. The owner only takes the lock to grow
+ * the table, the persister and readers hold it for reading. dirty holds the
+ * index of every slot with a delta since the persister last looked, each at
+ * most once, so neither it nor draining ever needs more than size entries.
+ * dirty_lock only guards swapping the two lists and appending to dirty.
+ */
+struct shard {
+    size_t size;
+    size_t used;
+    struct deltaslot *slots;
+    pthread_rwlock_t lock;
+    pthread_mutex_t dirty_lock;
+    size_t *dirty;
+    size_t ndirty;
+    size_t *draining;
+    struct shard *next;
+} __attribute__((aligned(64)));
+
+/**
+ * A delta taken out of a shard to be committed
+ */
+struct flushent {
+    struct shard *shard;
+    char key[KEYSZ];
+    uint64_t amount;
+};
+
+/**
+ * A thread's read transaction, reset between reads. Kept on a list so
+ * counter_destroy can free them.
+ */
+struct reader {
+    MDB_txn *txn;
+    struct reader *next;
+};
+
 struct counter {
     MDB_env *env;
-    MDB_dbi *dbi;
+    MDB_dbi counts;
+    MDB_dbi stats;
+    uint64_t generation;
+    _Atomic(struct shard *) shards;
+    _Atomic(struct reader *) readers;
+    // Read transactions hold it shared, growing the map takes it exclusively
+    pthread_rwlock_t map_lock;
+    // Odd from just before a flush commits until its deltas are subtracted
+    _Atomic uint64_t flush_seq;
+    // Held for a whole flush, also guards batch
+    pthread_mutex_t flush_lock;
+    struct flushent *batch;
+    size_t batch_size;
+    pthread_mutex_t stop_lock;
+    pthread_cond_t stop_cond;
+    bool stop;
+    pthread_t persister;
+    rates_t *rates;
 };
 
-// who the fuck knows why this number is chosen
-// it was in an example.
-#define MDB_MAPSIZE 10485760
+/**
+ * Initial map size. Existing databases open at their own size if larger.
+ */
+#define MDB_MAPSIZE0 10485760
 #define MDB_CHECK(call, succ, ret) if((call) != succ) { perror(#call); return ret; }
 
+#define FLUSH_MSECS 10
+#define SHARD_SIZE0 64
+
 const char *counter_backend_name = "lmdb";
 
+static __thread struct shard *local_shard = NULL;
+static __thread counter_t *local_counter = NULL;
+static __thread struct reader *local_reader = NULL;
+static __thread uint64_t local_reader_generation = 0;
+
+/**
+ * Tells counters apart for the thread-local read transactions, a new
+ * counter may well be allocated where a destroyed one was.
+ */
+static _Atomic uint64_t generations = 0;
+
+
+static struct deltaslot *shard_find(struct shard *shard, const char *key) {
+    for(size_t i = key_hash(key) % shard->size;; i = (i + 1) % shard->size) {
+        if(!atomic_load_acquire(&shard->slots[i].used)) {
+            return NULL;
+        } else if(key_eq(key, shard->slots[i].key)) {
+            return &shard->slots[i];
+        }
+    }
+}
+
+/**
+ * Find or claim the slot for key. Only ever called by the shard's owner.
+ */
+static struct deltaslot *shard_slot(struct shard *shard, const char *key, bool *created) {
+    for(size_t i = key_hash(key) % shard->size;; i = (i + 1) % shard->size) {
+        struct deltaslot *slot = &shard->slots[i];
+        if(!atomic_load_relaxed(&slot->used)) {
+            memcpy(slot->key, key, KEYSZ);
+            atomic_store_release(&slot->used, true);
+            shard->used += 1;
+            *created = true;
+            return slot;
+        } else if(key_eq(key, slot->key)) {
+            *created = false;
+            return slot;
+        }
+    }
+}
+
+/**
+ * Put slot on its shard's dirty list unless it already is. The owner does
+ * this after adding to delta, the persister when a flush fails.
+ */
+static void shard_mark(struct shard *shard, struct deltaslot *slot) {
+    bool clean = false;
+    if(atomic_compare_exchange_strong(&slot->dirty, &clean, true)) {
+        pthread_mutex_lock(&shard->dirty_lock);
+        shard->dirty[shard->ndirty++] = slot - shard->slots;
+        pthread_mutex_unlock(&shard->dirty_lock);
+    }
+}
+
+/**
+ * Double the table. The caller holds the write lock, so the persister isn't
+ * draining and the dirty list can be rebuilt from the slots' flags.
+ */
+static int shard_expand(struct shard *shard) {
+    struct deltaslot *slots = NULL;
+    size_t *dirty = NULL, *draining = NULL;
+    size_t size = shard->size * 2;
+    if((slots = calloc(size, sizeof(struct deltaslot))) == NULL ||
+            (dirty = calloc(size, sizeof(size_t))) == NULL ||
+            (draining = calloc(size, sizeof(size_t))) == NULL) {
+        perror("calloc");
+        free(slots);
+        free(dirty);
+        return -1;
+    }
+    for(size_t i = 0; i < shard->size; ++i) {
+        struct deltaslot *old = &shard->slots[i];
+        if(!atomic_load_relaxed(&old->used)) {
+            continue;
+        }
+        for(size_t j = key_hash(old->key) % size;; j = (j + 1) % size) {
+            if(!atomic_load_relaxed(&slots[j].used)) {
+                memcpy(&slots[j], old, sizeof(struct deltaslot));
+                break;
+            }
+        }
+    }
+    size_t ndirty = 0;
+    for(size_t i = 0; i < size; ++i) {
+        if(atomic_load_relaxed(&slots[i].dirty)) {
+            dirty[ndirty++] = i;
+        }
+    }
+    free(shard->slots);
+    free(shard->dirty);
+    free(shard->draining);
+    shard->slots = slots;
+    shard->dirty = dirty;
+    shard->draining = draining;
+    shard->ndirty = ndirty;
+    shard->size = size;
+    return 0;
+}
+
+/**
+ * Read the persisted value of key, 0 if it has never been flushed.
+ */
+static uint64_t stored_get(counter_t *lc, MDB_txn *txn, const char *key) {
+    MDB_val mkey, data;
+    mkey.mv_size = KEYSZ * sizeof(char);
+    mkey.mv_data = (void *)key;
+    if(mdb_get(txn, lc->counts, &mkey, &data) == MDB_SUCCESS) {
+        return *(uint64_t *)data.mv_data;
+    }
+    return 0;
+}
+
+/**
+ * Renew the calling thread's read transaction, starting one the first time
+ * the thread reads. Give it back with read_end.
+ */
+static MDB_txn *read_begin(counter_t *lc) {
+    pthread_rwlock_rdlock(&lc->map_lock);
+    if(local_reader_generation == lc->generation) {
+        int rc = 0;
+        if((rc = mdb_txn_renew(local_reader->txn)) != MDB_SUCCESS) {
+            fprintf(stderr, "mdb_txn_renew: %s\n", mdb_strerror(rc));
+            pthread_rwlock_unlock(&lc->map_lock);
+            return NULL;
+        }
+        return local_reader->txn;
+    }
+
+    struct reader *reader = NULL;
+    if((reader = malloc(sizeof(struct reader))) == NULL) {
+        perror("malloc");
+        pthread_rwlock_unlock(&lc->map_lock);
+        return NULL;
+    }
+    int rc = 0;
+    if((rc = mdb_txn_begin(lc->env, NULL, MDB_RDONLY, &reader->txn)) != MDB_SUCCESS) {
+        fprintf(stderr, "mdb_txn_begin: %s\n", mdb_strerror(rc));
+        free(reader);
+        pthread_rwlock_unlock(&lc->map_lock);
+        return NULL;
+    }
+    reader->next = atomic_load(&lc->readers);
+    while(!atomic_compare_exchange_weak(&lc->readers, &reader->next, reader));
+    local_reader = reader;
+    local_reader_generation = lc->generation;
+    return reader->txn;
+}
+
+static void read_end(counter_t *lc, MDB_txn *txn) {
+    mdb_txn_reset(txn);
+    pthread_rwlock_unlock(&lc->map_lock);
+}
+
+/**
+ * Double the map. LMDB only allows that with no transaction running, the
+ * caller has aborted its write transaction and map_lock waits out readers.
+ */
+static int counter_grow(counter_t *lc) {
+    MDB_envinfo info;
+    mdb_env_info(lc->env, &info);
+    pthread_rwlock_wrlock(&lc->map_lock);
+    int rc = mdb_env_set_mapsize(lc->env, info.me_mapsize * 2);
+    pthread_rwlock_unlock(&lc->map_lock);
+    if(rc != MDB_SUCCESS) {
+        fprintf(stderr, "mdb_env_set_mapsize: %s\n", mdb_strerror(rc));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Swap out the shard's dirty list and copy what each slot on it has pending
+ * into the batch. The shard is only read locked for that long. A slot's flag
+ * is cleared before its delta is read and counter_inc adds before it checks
+ * the flag, so an increment either makes it into the amount or puts the slot
+ * back on the list.
+ */
+static int shard_drain(counter_t *lc, struct shard *shard, size_t *n) {
+    pthread_mutex_lock(&shard->dirty_lock);
+    size_t ndirty = shard->ndirty;
+    pthread_mutex_unlock(&shard->dirty_lock);
+    if(ndirty == 0) {
+        return 0;
+    }
+
+    pthread_rwlock_rdlock(&shard->lock);
+    if(*n + shard->size > lc->batch_size) {
+        size_t size = lc->batch_size == 0 ? SHARD_SIZE0 : lc->batch_size;
+        while(*n + shard->size > size) {
+            size *= 2;
+        }
+        struct flushent *batch = NULL;
+        if((batch = realloc(lc->batch, size * sizeof(struct flushent))) == NULL) {
+            perror("realloc");
+            pthread_rwlock_unlock(&shard->lock);
+            return -1;
+        }
+        lc->batch = batch;
+        lc->batch_size = size;
+    }
+    pthread_mutex_lock(&shard->dirty_lock);
+    size_t *draining = shard->dirty;
+    ndirty = shard->ndirty;
+    shard->dirty = shard->draining;
+    shard->draining = draining;
+    shard->ndirty = 0;
+    pthread_mutex_unlock(&shard->dirty_lock);
+
+    for(size_t i = 0; i < ndirty; ++i) {
+        struct deltaslot *slot = &shard->slots[draining[i]];
+        atomic_store(&slot->dirty, false);
+        uint64_t amount = 0;
+        if((amount = atomic_load(&slot->delta)) == 0) {
+            continue;
+        }
+        struct flushent *ent = &lc->batch[(*n)++];
+        ent->shard = shard;
+        memcpy(ent->key, slot->key, KEYSZ);
+        ent->amount = amount;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return 0;
+}
+
+/**
+ * Apply every pending delta in a single write transaction. Only shards with
+ * something on their dirty list are looked at, and only the slots on it.
+ * Nothing holds a shard's lock during the transaction, so owners can keep
+ * growing their tables. Readers that overlap handing the committed amounts
+ * back see flush_seq change and read again rather than count a delta twice.
+ * A full map is grown and the flush retried.
+ */
+static int counter_flush(counter_t *lc) {
+    pthread_mutex_lock(&lc->flush_lock);
+    int rc = 0;
+    size_t n = 0;
+    for(struct shard *s = atomic_load(&lc->shards); s != NULL; s = s->next) {
+        if((rc = shard_drain(lc, s, &n)) != 0) {
+            goto unlock;
+        }
+    }
+    if(n == 0) {
+        goto unlock;
+    }
+
+    MDB_txn *txn = NULL;
+retry:
+    if((rc = mdb_txn_begin(lc->env, NULL, 0, &txn)) == MDB_MAP_RESIZED) {
+        // Another process grew it, adopt its size
+        pthread_rwlock_wrlock(&lc->map_lock);
+        mdb_env_set_mapsize(lc->env, 0);
+        pthread_rwlock_unlock(&lc->map_lock);
+        goto retry;
+    }
+    if(rc != MDB_SUCCESS) {
+        fprintf(stderr, "mdb_txn_begin: %s\n", mdb_strerror(rc));
+        goto unlock;
+    }
+    for(size_t i = 0; i < n; ++i) {
+        struct flushent *ent = &lc->batch[i];
+        // Two threads can hold deltas for the same key, read back
+        // through the txn so the second one sees the first's put.
+        uint64_t stored_counter = stored_get(lc, txn, ent->key) + ent->amount;
+        MDB_val mkey, update;
+        mkey.mv_size = KEYSZ * sizeof(char);
+        mkey.mv_data = ent->key;
+        update.mv_size = sizeof(uint64_t);
+        update.mv_data = &stored_counter;
+        if((rc = mdb_put(txn, lc->counts, &mkey, &update, 0)) != MDB_SUCCESS) {
+            mdb_txn_abort(txn);
+            if(rc == MDB_MAP_FULL && counter_grow(lc) == 0) {
+                goto retry;
+            }
+            fprintf(stderr, "mdb_put: %s\n", mdb_strerror(rc));
+            goto unlock;
+        }
+    }
+    atomic_fetch_add_explicit(&lc->flush_seq, 1, memory_order_acq_rel);
+    if((rc = mdb_txn_commit(txn)) != MDB_SUCCESS) {
+        atomic_fetch_add_explicit(&lc->flush_seq, 1, memory_order_acq_rel);
+        if(rc == MDB_MAP_FULL && counter_grow(lc) == 0) {
+            goto retry;
+        }
+        fprintf(stderr, "mdb_txn_commit: %s\n", mdb_strerror(rc));
+        goto unlock;
+    }
+
+    // Committed, hand the flushed amounts over from delta to base. The
+    // batch is in shard order, so each shard is locked once.
+    txn = read_begin(lc);
+    for(size_t i = 0; i < n;) {
+        struct shard *s = lc->batch[i].shard;
+        pthread_rwlock_rdlock(&s->lock);
+        for(; i < n && lc->batch[i].shard == s; ++i) {
+            struct flushent *ent = &lc->batch[i];
+            struct deltaslot *slot = shard_find(s, ent->key);
+            if(txn != NULL) {
+                atomic_store_relaxed(&slot->base, stored_get(lc, txn, ent->key));
+            }
+            atomic_fetch_sub_explicit(&slot->delta, ent->amount, memory_order_relaxed);
+        }
+        pthread_rwlock_unlock(&s->lock);
+    }
+    if(txn != NULL) {
+        read_end(lc, txn);
+    }
+    atomic_fetch_add_explicit(&lc->flush_seq, 1, memory_order_acq_rel);
+    rc = 0;
+
+unlock:
+    if(rc != 0) {
+        // Still pending, put them back so the next flush tries again
+        for(size_t i = 0; i < n;) {
+            struct shard *s = lc->batch[i].shard;
+            pthread_rwlock_rdlock(&s->lock);
+            for(; i < n && lc->batch[i].shard == s; ++i) {
+                shard_mark(s, shard_find(s, lc->batch[i].key));
+            }
+            pthread_rwlock_unlock(&s->lock);
+        }
+    }
+    pthread_mutex_unlock(&lc->flush_lock);
+    return rc == 0 ? 0 : -1;
+}
+
+/**
+ * Persister thread. Flushes every FLUSH_MSECS until counter_destroy.
+ */
+static void *counter_persist(void *data) {
+    counter_t *lc = data;
+    pthread_mutex_lock(&lc->stop_lock);
+    while(!lc->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += FLUSH_MSECS * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&lc->stop_cond, &lc->stop_lock, &deadline);
+        pthread_mutex_unlock(&lc->stop_lock);
+        counter_flush(lc);
+        pthread_mutex_lock(&lc->stop_lock);
+    }
+    pthread_mutex_unlock(&lc->stop_lock);
+    return NULL;
+}
+
+/**
+ * Sum of key's deltas that haven't been committed yet
+ */
+static uint64_t pending_get(counter_t *lc, const char *key) {
+    uint64_t total = 0;
+    for(struct shard *s = atomic_load(&lc->shards); s != NULL; s = s->next) {
+        pthread_rwlock_rdlock(&s->lock);
+        struct deltaslot *slot = shard_find(s, key);
+        if(slot != NULL) {
+            total += atomic_load_relaxed(&slot->delta);
+        }
+        pthread_rwlock_unlock(&s->lock);
+    }
+    return total;
+}
+
+
+/**
+ * Older versions kept everything in the main database, counters as well as
+ * _<name>_last and _<name>_rps stats keys. Move them to where they go now.
+ * The main database otherwise only holds the sub-databases' records.
+ */
+static int counter_upgrade(counter_t *lc, MDB_txn *txn) {
+    MDB_dbi top;
+    MDB_cursor *cursor = NULL;
+    MDB_val key, data;
+    int rc = 0;
+    if((rc = mdb_dbi_open(txn, NULL, 0, &top)) != MDB_SUCCESS ||
+            (rc = mdb_cursor_open(txn, top, &cursor)) != MDB_SUCCESS) {
+        fprintf(stderr, "mdb_dbi_open: %s\n", mdb_strerror(rc));
+        return -1;
+    }
+    while((rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) == MDB_SUCCESS) {
+        MDB_dbi dbi;
+        if(key.mv_size > 0 && *(char *)key.mv_data == '_') {
+            dbi = lc->stats;
+        } else if(key.mv_size == KEYSZ && data.mv_size == sizeof(uint64_t)) {
+            dbi = lc->counts;
+        } else {
+            continue;
+        }
+        if((rc = mdb_put(txn, dbi, &key, &data, 0)) != MDB_SUCCESS ||
+                (rc = mdb_cursor_del(cursor, 0)) != MDB_SUCCESS) {
+            break;
+        }
+    }
+    mdb_cursor_close(cursor);
+    if(rc != MDB_NOTFOUND) {
+        fprintf(stderr, "upgrade: %s\n", mdb_strerror(rc));
+        return -1;
+    }
+    return 0;
+}
+
+
 counter_t *counter_init(const char *path, uint64_t readers) {
     counter_t *lc = NULL;
     if((lc = calloc(1, sizeof(counter_t))) == NULL) {
@@ -34,169 +530,247 @@ counter_t *counter_init(const char *path, uint64_t readers) {
         return NULL;
     }
 
-    // Setup and open the lmdb enviornment
+    // Setup and open the lmdb enviornment, one extra reader for the persister
     MDB_CHECK(mdb_env_create(&lc->env), MDB_SUCCESS, NULL);
-    MDB_CHECK(mdb_env_set_maxreaders(lc->env, readers), MDB_SUCCESS, NULL);
-    MDB_CHECK(mdb_env_set_mapsize(lc->env, MDB_MAPSIZE), MDB_SUCCESS, NULL);
+    MDB_CHECK(mdb_env_set_maxreaders(lc->env, readers + 1), MDB_SUCCESS, NULL);
+    MDB_CHECK(mdb_env_set_mapsize(lc->env, MDB_MAPSIZE0), MDB_SUCCESS, NULL);
+    MDB_CHECK(mdb_env_set_maxdbs(lc->env, 2), MDB_SUCCESS, NULL);
     MDB_CHECK(mdb_env_open(lc->env, path, MDB_WRITEMAP | MDB_MAPASYNC | MDB_NOSUBDIR, 0664), MDB_SUCCESS, NULL);
 
     MDB_txn *txn = NULL;
     MDB_CHECK(mdb_txn_begin(lc->env, NULL, 0, &txn), MDB_SUCCESS, NULL);
-
-    if((lc->dbi = calloc(1, sizeof(MDB_dbi))) == NULL) {
-        perror("calloc");
+    MDB_CHECK(mdb_dbi_open(txn, "counters", MDB_CREATE, &lc->counts), MDB_SUCCESS, NULL);
+    MDB_CHECK(mdb_dbi_open(txn, "stats", MDB_CREATE, &lc->stats), MDB_SUCCESS, NULL);
+    if(counter_upgrade(lc, txn) == -1) {
+        mdb_txn_abort(txn);
         return NULL;
     }
+    MDB_CHECK(mdb_txn_commit(txn), MDB_SUCCESS, NULL);
 
-    MDB_CHECK(mdb_dbi_open(txn, NULL, 0, lc->dbi), MDB_SUCCESS, NULL);
-    mdb_txn_commit(txn);
+    if((lc->rates = rates_init()) == NULL) {
+        return NULL;
+    }
+    lc->generation = atomic_fetch_add(&generations, 1) + 1;
+    atomic_init(&lc->shards, NULL);
+    atomic_init(&lc->readers, NULL);
+    atomic_init(&lc->flush_seq, 0);
+    pthread_rwlock_init(&lc->map_lock, NULL);
+    pthread_mutex_init(&lc->flush_lock, NULL);
+    pthread_mutex_init(&lc->stop_lock, NULL);
+    pthread_cond_init(&lc->stop_cond, NULL);
+    lc->stop = false;
+    if(pthread_create(&lc->persister, NULL, counter_persist, lc) != 0) {
+        perror("pthread_create");
+        return NULL;
+    }
     return lc;
 }
 
 
 void counter_destroy(counter_t *lc) {
-    mdb_dbi_close(lc->env, *lc->dbi);
-    free(lc->dbi);
+    pthread_mutex_lock(&lc->stop_lock);
+    lc->stop = true;
+    pthread_cond_signal(&lc->stop_cond);
+    pthread_mutex_unlock(&lc->stop_lock);
+    pthread_join(lc->persister, NULL);
+    counter_flush(lc);
+
+    struct shard *shard = atomic_load(&lc->shards);
+    while(shard != NULL) {
+        struct shard *next = shard->next;
+        pthread_rwlock_destroy(&shard->lock);
+        pthread_mutex_destroy(&shard->dirty_lock);
+        free(shard->slots);
+        free(shard->dirty);
+        free(shard->draining);
+        free(shard);
+        shard = next;
+    }
+    pthread_cond_destroy(&lc->stop_cond);
+    pthread_mutex_destroy(&lc->stop_lock);
+    pthread_mutex_destroy(&lc->flush_lock);
+    free(lc->batch);
+
+    struct reader *reader = atomic_load(&lc->readers);
+    while(reader != NULL) {
+        struct reader *next = reader->next;
+        mdb_txn_abort(reader->txn);
+        free(reader);
+        reader = next;
+    }
+    pthread_rwlock_destroy(&lc->map_lock);
+
+    mdb_dbi_close(lc->env, lc->stats);
+    mdb_dbi_close(lc->env, lc->counts);
     mdb_env_close(lc->env);
+    rates_destroy(lc->rates);
     free(lc);
 }
 
 
+/**
+ * Get the calling thread's shard, creating and publishing it the first time
+ * a thread increments.
+ */
+static struct shard *shard_get(counter_t *lc) {
+    if(local_counter == lc) {
+        return local_shard;
+    }
+    struct shard *shard = NULL;
+    if((shard = aligned_alloc(64, sizeof(struct shard))) == NULL) {
+        perror("aligned_alloc");
+        return NULL;
+    }
+    memset(shard, 0, sizeof(struct shard));
+    if((shard->slots = calloc(SHARD_SIZE0, sizeof(struct deltaslot))) == NULL ||
+            (shard->dirty = calloc(SHARD_SIZE0, sizeof(size_t))) == NULL ||
+            (shard->draining = calloc(SHARD_SIZE0, sizeof(size_t))) == NULL) {
+        perror("calloc");
+        free(shard->slots);
+        free(shard->dirty);
+        free(shard);
+        return NULL;
+    }
+    shard->size = SHARD_SIZE0;
+    shard->used = 0;
+    shard->ndirty = 0;
+    pthread_rwlock_init(&shard->lock, NULL);
+    pthread_mutex_init(&shard->dirty_lock, NULL);
+    shard->next = atomic_load(&lc->shards);
+    while(!atomic_compare_exchange_weak(&lc->shards, &shard->next, shard));
+
+    local_shard = shard;
+    local_counter = lc;
+    return shard;
+}
+
+
 /**
  * This function works in stages. First we clean up the given key to prevent
- * any trickery by users. Then we retrieve the existing value, increment it,
- * and store it back in the db.
+ * any trickery by users. Then we bump this thread's pending delta for it, the
+ * persister writes it back to the db within FLUSH_MSECS. The returned count
+ * is the last committed value plus this thread's own pending increments.
  */
 uint64_t counter_inc(counter_t *lc, const char *key) {
     char clean_key[KEYSZ] = { 0 };
     key_clean(clean_key, key);
     clean_key[15] = '\0';
 
-    MDB_val mkey, data, update;
-    MDB_txn *txn = NULL;
-
-    mkey.mv_size = (KEYSZ) * sizeof(char);
-    mkey.mv_data = (void *)clean_key;
-
-    mdb_txn_begin(lc->env, NULL, 0, &txn);
-    uint64_t stored_counter = 0;
-    // We only care about success here, since if mdb_get fails it is because
-    // the key doesn't exist and we need to make it.
-    if(mdb_get(txn, *lc->dbi, &mkey, &data) == MDB_SUCCESS) {
-        stored_counter = *(uint64_t *)data.mv_data;
-    }
-    stored_counter++;
-    update.mv_size = sizeof(uint64_t);
-    update.mv_data = (void *)&stored_counter;
-    if(mdb_put(txn, *lc->dbi, &mkey, &update, 0) != MDB_SUCCESS) {
-        perror("mdb_put");
-        mdb_txn_abort(txn);
+    struct shard *shard = NULL;
+    if((shard = shard_get(lc)) == NULL) {
         return 0;
     }
 
-    MDB_CHECK(mdb_txn_commit(txn), MDB_SUCCESS, 0);
+    bool created = false;
+    struct deltaslot *slot = shard_slot(shard, clean_key, &created);
+    if(created) {
+        // First time this thread sees the key, seed base from the db once.
+        MDB_txn *txn = NULL;
+        if((txn = read_begin(lc)) != NULL) {
+            atomic_store_relaxed(&slot->base, stored_get(lc, txn, clean_key));
+            read_end(lc, txn);
+        }
+    }
+    uint64_t stored_counter = atomic_load_relaxed(&slot->base);
+    // Add before looking at dirty, see shard_drain
+    stored_counter += atomic_fetch_add(&slot->delta, 1) + 1;
+    if(!atomic_load(&slot->dirty)) {
+        shard_mark(shard, slot);
+    }
+
+    if(shard->used > (shard->size * 8) / 10) {
+        pthread_rwlock_wrlock(&shard->lock);
+        shard_expand(shard);
+        pthread_rwlock_unlock(&shard->lock);
+    }
     return stored_counter;
 }
 
 
+unsigned counter_tier(counter_t *lc, uint64_t count) {
+    return rates_tier(lc->rates, count);
+}
+
+
 uint64_t counter_get(counter_t *lc, const char *key) {
     char clean_key[KEYSZ] = { 0 };
     key_clean(clean_key, key);
     clean_key[15] = '\0';
-    
-    MDB_val mkey, data;
-    MDB_txn *txn;
-    mdb_txn_begin(lc->env, NULL, 0, &txn);
 
-    mkey.mv_size = KEYSZ * sizeof(char);
-    mkey.mv_data = (void *)clean_key;
-
-    // First we get our data from the db
-    uint64_t stored_counter = 0;
-    if(mdb_get(txn, *lc->dbi, &mkey, &data) == MDB_SUCCESS) {
-        stored_counter = *(uint64_t *)data.mv_data;
-    }
-
-    MDB_CHECK(mdb_txn_commit(txn), MDB_SUCCESS, 0);
+    // First we get our data from the db, then add what hasn't been flushed.
+    // Should a flush hand deltas over to the db in between, read again.
+    uint64_t stored_counter = 0, seq = 0;
+    do {
+        while((seq = atomic_load_acquire(&lc->flush_seq)) & 1) {
+            sched_yield();
+        }
+        MDB_txn *txn = NULL;
+        if((txn = read_begin(lc)) == NULL) {
+            return 0;
+        }
+        stored_counter = stored_get(lc, txn, clean_key);
+        read_end(lc, txn);
+        stored_counter += pending_get(lc, clean_key);
+        atomic_thread_fence(memory_order_acquire);
+    } while(atomic_load_relaxed(&lc->flush_seq) != seq);
     return stored_counter;
 }
 
 
 void counter_sync(counter_t *lc) {
+    counter_flush(lc);
     mdb_env_sync(lc->env, 1);
 }
 
 
+/**
+ * flush_lock keeps the pending deltas from being handed over to the db
+ * halfway through, a dump takes too long to simply read it again.
+ */
 void counter_dump(counter_t *lc, buffer_t *output) {
-    MDB_val key, data, rps_key, rps_data;
+    MDB_val key, data;
     MDB_txn *txn = NULL;
     MDB_cursor *cursor = NULL;
-    mdb_txn_begin(lc->env, NULL, MDB_RDONLY, &txn);
-    mdb_cursor_open(txn, *lc->dbi, &cursor);
-    int rc = 0;
-    char *tmp_str = NULL;
-    int size = 0;
-    uint64_t rps = 0;
-    while((rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) == 0) {
-        if((*(char *)key.mv_data) == '_') {
-            continue;
-        }
-        size = asprintf(&tmp_str, "_%s_rps", (char *)key.mv_data);
-        rps_key.mv_size = size;
-        rps_key.mv_data = tmp_str;
-        if(mdb_get(txn, *lc->dbi, &rps_key, &rps_data) == MDB_SUCCESS) {
-            rps = *(uint64_t *)rps_data.mv_data;
-        }
-        free(tmp_str);
-        size = asprintf(&tmp_str, "%s: %lu - %lurps\n", (char *)key.mv_data, *(uint64_t *)data.mv_data, rps);
-        buffer_append(output, tmp_str, size);
-        free(tmp_str);
+    uint64_t rps[RATE_WINDOWS];
+    pthread_mutex_lock(&lc->flush_lock);
+    if((txn = read_begin(lc)) == NULL) {
+        pthread_mutex_unlock(&lc->flush_lock);
+        return;
+    }
+    mdb_cursor_open(txn, lc->counts, &cursor);
+    while(mdb_cursor_get(cursor, &key, &data, MDB_NEXT) == 0) {
+        rates_get(lc->rates, key.mv_data, rps);
+        uint64_t count = *(uint64_t *)data.mv_data + pending_get(lc, key.mv_data);
+        counter_dump_line(output, (char *)key.mv_data, count, rps);
     }
     mdb_cursor_close(cursor);
-    mdb_txn_abort(txn);
+    read_end(lc, txn);
+    pthread_mutex_unlock(&lc->flush_lock);
 }
 
 
 int counter_gen_stats(void *tdata) {
     counter_t *lc = (counter_t *)tdata;
+    // Rates are sampled from the db alone, bring it up to date first.
+    counter_flush(lc);
     MDB_val key, data;
-    MDB_val stat_key, stat_data;
     MDB_txn *txn = NULL;
     MDB_cursor *cursor = NULL;
-    mdb_txn_begin(lc->env, NULL, 0, &txn);
-    mdb_cursor_open(txn, *lc->dbi, &cursor);
     int rc = 0;
-    char *tmp_str = NULL;
-    uint64_t last_counter = 0;
-    uint64_t reqs_per_sec = 0;
-    int size = 0;
+    if((txn = read_begin(lc)) == NULL) {
+        return -1;
+    }
+    mdb_cursor_open(txn, lc->counts, &cursor);
     while((rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) == 0) {
-        if((*(char *)key.mv_data) == '_') {
-            continue;
+        if(rates_add(lc->rates, key.mv_data, *(uint64_t *)data.mv_data) == -1) {
+            break;
         }
-        size = asprintf(&tmp_str, "_%s_last", (char *)key.mv_data);
-        stat_key.mv_size = size;
-        stat_key.mv_data = tmp_str;
-        last_counter = 0;
-        if(mdb_get(txn, *lc->dbi, &stat_key, &stat_data) == MDB_SUCCESS) {
-            last_counter = *(uint64_t *)stat_data.mv_data;
-        }
-        // runs every STATS_SECS secs
-        reqs_per_sec = (*(uint64_t *)data.mv_data - last_counter) / STATS_SECS;
-        stat_data.mv_size = sizeof(uint64_t);
-        stat_data.mv_data = data.mv_data;
-        mdb_put(txn, *lc->dbi, &stat_key, &data, 0);
-        free(tmp_str);
-        size = asprintf(&tmp_str, "_%s_rps", (char *)key.mv_data);
-        stat_key.mv_size = size;
-        stat_key.mv_data = tmp_str;
-        stat_data.mv_size = sizeof(uint64_t);
-        stat_data.mv_data = &reqs_per_sec;
-        mdb_put(txn, *lc->dbi, &stat_key, &stat_data, 0);
-        free(tmp_str);
-
     }
     mdb_cursor_close(cursor);
-    mdb_txn_commit(txn);
+    read_end(lc, txn);
+    if(rc != MDB_NOTFOUND) {
+        return -1;
+    }
+    rates_tick(lc->rates);
     return 0;
 }
@@ -0,0 +1,237 @@
+#include "metrics.h"
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/**
+ * Every thread's block starts on a page of its own. Nothing touches a block
+ * before its thread does, so first touch puts it on that thread's node.
+ */
+static char *metrics = NULL;
+static size_t metrics_stride = 0;
+static size_t metrics_threads = 0;
+
+/**
+ * Everything that's rendered as a plain per-thread counter or gauge
+ */
+static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+    size_t offset;
+} metric_defs[] = {
+    { "uvb_accepts_total", "counter", "Connections accepted.", offsetof(thread_metrics_t, accepts) },
+    { "uvb_accepts_local_cpu_total", "counter", "Connections whose packets arrived on the cpu of the thread that accepted them.", offsetof(thread_metrics_t, accepts_local_cpu) },
+    { "uvb_accepts_remote_cpu_total", "counter", "Connections whose packets arrived on another cpu.", offsetof(thread_metrics_t, accepts_remote_cpu) },
+    { "uvb_accepts_remote_node_total", "counter", "Connections whose packets arrived on another NUMA node.", offsetof(thread_metrics_t, accepts_remote_node) },
+    { "uvb_closes_total", "counter", "Connections closed.", offsetof(thread_metrics_t, closes) },
+    { "uvb_reads_total", "counter", "Read calls and recv completions.", offsetof(thread_metrics_t, reads) },
+    { "uvb_bytes_in_total", "counter", "Bytes read from clients.", offsetof(thread_metrics_t, bytes_in) },
+    { "uvb_bytes_out_total", "counter", "Bytes written to clients.", offsetof(thread_metrics_t, bytes_out) },
+    { "uvb_requests_total", "counter", "Requests answered.", offsetof(thread_metrics_t, requests) },
+    { "uvb_fastpath_requests_total", "counter", "Requests recognized without http_parser.", offsetof(thread_metrics_t, fastpath_requests) },
+    { "uvb_parse_errors_total", "counter", "Connections dropped for unparsable requests.", offsetof(thread_metrics_t, parse_errors) },
+    { "uvb_idle_timeouts_total", "counter", "Connections dropped for being idle too long.", offsetof(thread_metrics_t, idle_timeouts) },
+    { "uvb_connections_rejected_total", "counter", "Connections turned away by admission control.", offsetof(thread_metrics_t, conns_rejected) },
+    { "uvb_requests_shed_total", "counter", "Connections dropped for going over their source's request rate.", offsetof(thread_metrics_t, requests_shed) },
+    { "uvb_waits_total", "counter", "Calls to uvbloop_wait.", offsetof(thread_metrics_t, waits) },
+    { "uvb_busy_polls_total", "counter", "Times a worker spun before blocking.", offsetof(thread_metrics_t, busy_polls) },
+    { "uvb_busy_poll_hits_total", "counter", "Spins that found events before running out of budget.", offsetof(thread_metrics_t, busy_poll_hits) },
+    { "uvb_busy_poll_budget_nanoseconds", "gauge", "How long the thread currently spins before blocking.", offsetof(thread_metrics_t, busy_poll_budget) },
+    { "uvb_connection_pool_capacity", "gauge", "Connections the thread's slab has room for.", offsetof(thread_metrics_t, pool_capacity) },
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+    size_t offset;
+} hist_defs[] = {
+    { "uvb_wait_batch_size", "Events returned per uvbloop_wait.", offsetof(thread_metrics_t, wait_batch) },
+    { "uvb_connection_requests", "Requests served per connection, observed on close.", offsetof(thread_metrics_t, conn_requests) },
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+    size_t offset;
+} latency_defs[] = {
+    { "uvb_response_latency_seconds", "Time from a read completing to its responses being written, over the last stats interval.", offsetof(thread_metrics_t, response_latency) },
+    { "uvb_dispatch_delay_seconds", "Time from uvbloop_wait returning to an event being handled, over the last stats interval.", offsetof(thread_metrics_t, dispatch_delay) },
+};
+
+#define LATENCY_HISTS (sizeof(latency_defs) / sizeof(latency_defs[0]))
+
+typedef struct {
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+} latency_summary_t;
+
+/**
+ * Only the timer thread touches the histograms, the summaries it leaves
+ * behind are read by whichever worker renders /_metrics.
+ */
+static hist_t *latency_prev = NULL;
+static hist_t *latency_cur = NULL;
+static hist_t *latency_interval = NULL;
+static latency_summary_t latency_summary[LATENCY_HISTS];
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+int metrics_init(size_t nthreads) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    metrics_stride = (sizeof(thread_metrics_t) + page - 1) & ~(page - 1);
+    // Anonymous memory comes zeroed without being touched
+    if((metrics = mmap(NULL, nthreads * metrics_stride, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        perror("mmap");
+        metrics = NULL;
+        return -1;
+    }
+    metrics_threads = nthreads;
+    if((latency_prev = calloc(LATENCY_HISTS, sizeof(hist_t))) == NULL ||
+            (latency_cur = calloc(1, sizeof(hist_t))) == NULL ||
+            (latency_interval = calloc(1, sizeof(hist_t))) == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    return 0;
+}
+
+
+static inline thread_metrics_t *metrics_at(size_t thread_id) {
+    return (thread_metrics_t *)(metrics + thread_id * metrics_stride);
+}
+
+
+thread_metrics_t *metrics_thread(size_t thread_id) {
+    thread_metrics_t *block = metrics_at(thread_id);
+    memset(block, 0, sizeof(thread_metrics_t));
+    return block;
+}
+
+
+static inline uint64_t metric_get(_Atomic uint64_t *metric) {
+    return atomic_load_explicit(metric, memory_order_relaxed);
+}
+
+
+int metrics_merge(void *data) {
+    (void)data;
+    for(size_t h = 0; h < LATENCY_HISTS; h++) {
+        hist_init(latency_cur);
+        for(size_t t = 0; t < metrics_threads; t++) {
+            hist_snapshot(latency_cur, (hist_t *)((char *)metrics_at(t) + latency_defs[h].offset));
+        }
+        hist_interval(latency_interval, latency_cur, &latency_prev[h]);
+        memcpy(&latency_prev[h], latency_cur, sizeof(hist_t));
+
+        latency_summary_t summary = {
+            hist_percentile(latency_interval, 50.0),
+            hist_percentile(latency_interval, 99.0),
+            hist_percentile(latency_interval, 99.9),
+            latency_interval->max,
+        };
+        pthread_mutex_lock(&latency_lock);
+        latency_summary[h] = summary;
+        pthread_mutex_unlock(&latency_lock);
+    }
+    return 0;
+}
+
+
+static void render_header(buffer_t *out, const char *name, const char *type, const char *help) {
+    buffer_append(out, "# HELP ", 7);
+    buffer_append(out, name, strlen(name));
+    buffer_append(out, " ", 1);
+    buffer_append(out, help, strlen(help));
+    buffer_append(out, "\n# TYPE ", 8);
+    buffer_append(out, name, strlen(name));
+    buffer_append(out, " ", 1);
+    buffer_append(out, type, strlen(type));
+    buffer_append(out, "\n", 1);
+}
+
+
+/**
+ * Append name{thread="id"[,le="bound"]} value
+ */
+static void render_sample(buffer_t *out, const char *name, const char *suffix, size_t thread,
+        const char *le, uint64_t value) {
+    buffer_append(out, name, strlen(name));
+    buffer_append(out, suffix, strlen(suffix));
+    buffer_append(out, "{thread=\"", 9);
+    buffer_append_u64(out, thread);
+    if(le != NULL) {
+        buffer_append(out, "\",le=\"", 6);
+        buffer_append(out, le, strlen(le));
+    }
+    buffer_append(out, "\"} ", 3);
+    buffer_append_u64(out, value);
+    buffer_append(out, "\n", 1);
+}
+
+
+/**
+ * Append name[suffix]{quantile="q"} with ns rendered as seconds
+ */
+static void render_latency(buffer_t *out, const char *name, const char *suffix, const char *quantile,
+        uint64_t ns) {
+    char value[48];
+    buffer_append(out, name, strlen(name));
+    buffer_append(out, suffix, strlen(suffix));
+    if(quantile != NULL) {
+        buffer_append(out, "{quantile=\"", 11);
+        buffer_append(out, quantile, strlen(quantile));
+        buffer_append(out, "\"}", 2);
+    }
+    int len = snprintf(value, sizeof(value), " %lu.%09lu\n", ns / 1000000000, ns % 1000000000);
+    buffer_append(out, value, len);
+}
+
+
+void metrics_render(buffer_t *out) {
+    for(size_t m = 0; m < sizeof(metric_defs) / sizeof(metric_defs[0]); m++) {
+        render_header(out, metric_defs[m].name, metric_defs[m].type, metric_defs[m].help);
+        for(size_t t = 0; t < metrics_threads; t++) {
+            _Atomic uint64_t *metric = (_Atomic uint64_t *)((char *)metrics_at(t) + metric_defs[m].offset);
+            render_sample(out, metric_defs[m].name, "", t, NULL, metric_get(metric));
+        }
+    }
+
+    for(size_t h = 0; h < sizeof(hist_defs) / sizeof(hist_defs[0]); h++) {
+        render_header(out, hist_defs[h].name, "histogram", hist_defs[h].help);
+        for(size_t t = 0; t < metrics_threads; t++) {
+            metrics_hist_t *hist = (metrics_hist_t *)((char *)metrics_at(t) + hist_defs[h].offset);
+            uint64_t cumulative = 0;
+            char le[24];
+            for(size_t b = 0; b < METRICS_BUCKETS; b++) {
+                cumulative += metric_get(&hist->buckets[b]);
+                le[u64toa((uint64_t)1 << b, le)] = '\0';
+                render_sample(out, hist_defs[h].name, "_bucket", t, le, cumulative);
+            }
+            // _count repeats +Inf so the two always agree
+            cumulative += metric_get(&hist->buckets[METRICS_BUCKETS]);
+            render_sample(out, hist_defs[h].name, "_bucket", t, "+Inf", cumulative);
+            render_sample(out, hist_defs[h].name, "_sum", t, NULL, metric_get(&hist->sum));
+            render_sample(out, hist_defs[h].name, "_count", t, NULL, cumulative);
+        }
+    }
+
+    latency_summary_t summary[LATENCY_HISTS];
+    pthread_mutex_lock(&latency_lock);
+    memcpy(summary, latency_summary, sizeof(summary));
+    pthread_mutex_unlock(&latency_lock);
+    for(size_t h = 0; h < LATENCY_HISTS; h++) {
+        // The quantiles come from the merged histogram, so there is no
+        // thread label and no _sum to go with them.
+        render_header(out, latency_defs[h].name, "gauge", latency_defs[h].help);
+        render_latency(out, latency_defs[h].name, "", "0.5", summary[h].p50);
+        render_latency(out, latency_defs[h].name, "", "0.99", summary[h].p99);
+        render_latency(out, latency_defs[h].name, "", "0.999", summary[h].p999);
+        render_latency(out, latency_defs[h].name, "_max", NULL, summary[h].max);
+    }
+}
@@ -0,0 +1,160 @@
+#include "outq.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+
+
+int outq_init(outq_t *q) {
+    q->head = 0;
+    q->count = 0;
+    q->bytes = 0;
+    return buffer_init(&q->buf);
+}
+
+
+void outq_free(outq_t *q) {
+    for(uint32_t i=0; i<q->count; i++) {
+        outq_chunk_t *chunk = &q->chunks[(q->head + i) % OUTQ_CHUNKS];
+        if(chunk->page != NULL) {
+            status_release(chunk->page);
+        }
+    }
+    q->count = 0;
+    q->bytes = 0;
+    buffer_free(&q->buf);
+}
+
+
+static outq_chunk_t *outq_push(outq_t *q) {
+    outq_chunk_t *chunk = &q->chunks[(q->head + q->count) % OUTQ_CHUNKS];
+    q->count++;
+    return chunk;
+}
+
+
+void outq_append(outq_t *q, const char *data, size_t len) {
+    uint64_t off = buffer_length(&q->buf);
+    buffer_append(&q->buf, data, len);
+    q->bytes += len;
+
+    // Buffer chunks are laid out in order, so if the last chunk is one it
+    // ends right where we just appended and we can simply grow it.
+    if(q->count > 0) {
+        outq_chunk_t *tail = &q->chunks[(q->head + q->count - 1) % OUTQ_CHUNKS];
+        if(tail->page == NULL) {
+            tail->len += len;
+            return;
+        }
+    }
+    outq_chunk_t *chunk = outq_push(q);
+    chunk->off = off;
+    chunk->len = len;
+    chunk->page = NULL;
+}
+
+
+void outq_append_page(outq_t *q, status_page_t *page) {
+    // Always keep a chunk free for buffer data, if we are out of chunks the
+    // page is copied instead.
+    if(q->count >= OUTQ_CHUNKS - 1) {
+        outq_append(q, page->data, page->len);
+        status_release(page);
+        return;
+    }
+    outq_chunk_t *chunk = outq_push(q);
+    chunk->off = 0;
+    chunk->len = page->len;
+    chunk->page = page;
+    q->bytes += page->len;
+}
+
+
+/**
+ * Drop written bytes from the front of the queue
+ */
+static void outq_consume(outq_t *q, uint64_t written) {
+    q->bytes -= written;
+    while(written > 0) {
+        outq_chunk_t *chunk = &q->chunks[q->head];
+        if(written < chunk->len) {
+            chunk->off += written;
+            chunk->len -= written;
+            return;
+        }
+        written -= chunk->len;
+        if(chunk->page != NULL) {
+            status_release(chunk->page);
+        }
+        q->head = (q->head + 1) % OUTQ_CHUNKS;
+        q->count--;
+    }
+}
+
+
+/**
+ * Slide buffer data down over the bytes that have already been written so a
+ * queue that never fully drains doesn't grow its buffer forever.
+ */
+static void outq_compact(outq_t *q) {
+    uint64_t start = buffer_length(&q->buf);
+    for(uint32_t i=0; i<q->count; i++) {
+        outq_chunk_t *chunk = &q->chunks[(q->head + i) % OUTQ_CHUNKS];
+        if(chunk->page == NULL) {
+            start = chunk->off;
+            break;
+        }
+    }
+    if(start < 4096 || start < buffer_length(&q->buf) / 2) {
+        return;
+    }
+    uint64_t remaining = buffer_length(&q->buf) - start;
+    memmove(q->buf.buffer, q->buf.buffer + start, remaining);
+    q->buf.data_size = remaining;
+    for(uint32_t i=0; i<q->count; i++) {
+        outq_chunk_t *chunk = &q->chunks[(q->head + i) % OUTQ_CHUNKS];
+        if(chunk->page == NULL) {
+            chunk->off -= start;
+        }
+    }
+}
+
+
+int64_t outq_flush(outq_t *q, int fd) {
+    struct iovec iov[OUTQ_CHUNKS];
+
+    while(q->count > 0) {
+        for(uint32_t i=0; i<q->count; i++) {
+            outq_chunk_t *chunk = &q->chunks[(q->head + i) % OUTQ_CHUNKS];
+            if(chunk->page != NULL) {
+                iov[i].iov_base = chunk->page->data + chunk->off;
+            }
+            else {
+                iov[i].iov_base = q->buf.buffer + chunk->off;
+            }
+            iov[i].iov_len = chunk->len;
+        }
+        ssize_t written = writev(fd, iov, q->count);
+        if(written == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        outq_consume(q, (uint64_t)written);
+    }
+    if(q->count == 0) {
+        buffer_fast_clear(&q->buf);
+    }
+    else {
+        outq_compact(q);
+    }
+    return (int64_t)q->bytes;
+}
+
+
+uint64_t outq_length(outq_t *q) {
+    return q->bytes;
+}
@@ -0,0 +1,141 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <http_parser.h>
+#include "fastpath.h"
+
+#define NREQUESTS 65536
+#define ROUNDS 50
+#define READSZ 4096
+
+/**
+ * What a browser or curl pipelining against us looks like on the wire.
+ */
+static const char *request_fmt =
+    "GET /player%d HTTP/1.1\r\n"
+    "Host: localhost:8000\r\n"
+    "User-Agent: uvb-bench/1.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+static uint64_t messages = 0;
+static uint64_t url_bytes = 0;
+static bool started = false;
+
+static int on_message_begin(http_parser *hp) {
+    (void)hp;
+    started = true;
+    return 0;
+}
+
+static int on_url(http_parser *hp, const char *at, size_t len) {
+    (void)hp; (void)at;
+    url_bytes += len;
+    return 0;
+}
+
+static int on_message_complete(http_parser *hp) {
+    (void)hp;
+    started = false;
+    messages++;
+    return 0;
+}
+
+static int on_message_complete_pause(http_parser *hp) {
+    on_message_complete(hp);
+    http_parser_pause(hp, 1);
+    return 0;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Every request through http_parser, the way the server used to parse.
+ */
+static size_t parse_plain(http_parser *parser, http_parser_settings *settings, const char *buf, size_t len) {
+    return http_parser_execute(parser, settings, buf, len);
+}
+
+/**
+ * The fast path with http_parser as fallback, like connection_parse.
+ */
+static size_t parse_fast(http_parser *parser, http_parser_settings *settings, const char *buf, size_t len) {
+    size_t off = 0;
+    while(off < len) {
+        if(!started) {
+            const char *url = NULL;
+            size_t url_len = 0;
+            size_t request_len = fastpath_get(buf + off, len - off, &url, &url_len);
+            if(request_len > 0) {
+                url_bytes += url_len;
+                messages++;
+                off += request_len;
+                continue;
+            }
+        }
+        off += http_parser_execute(parser, settings, buf + off, len - off);
+        if(HTTP_PARSER_ERRNO(parser) != HPE_PAUSED) {
+            break;
+        }
+        http_parser_pause(parser, 0);
+    }
+    return off;
+}
+
+static void run(const char *name, size_t (*parse)(http_parser *, http_parser_settings *, const char *, size_t),
+        http_parser_settings *settings, const char *buf, size_t len) {
+    http_parser parser;
+    http_parser_init(&parser, HTTP_REQUEST);
+    messages = url_bytes = 0;
+    started = false;
+
+    double start = now();
+    for(int r = 0; r < ROUNDS; r++) {
+        // Feed it in read sized pieces so requests straddle reads
+        for(size_t off = 0; off < len; off += READSZ) {
+            size_t n = len - off < READSZ ? len - off : READSZ;
+            if(parse(&parser, settings, buf + off, n) != n) {
+                fprintf(stderr, "%s: parse error\n", name);
+                exit(1);
+            }
+        }
+    }
+    double secs = now() - start;
+    printf("%-12s %10lu requests %8.1f MB/s %12.0f req/s %6.1f ns/req (url bytes %lu)\n",
+            name, messages, (len * ROUNDS) / secs / 1e6, messages / secs,
+            secs * 1e9 / messages, url_bytes);
+}
+
+int main() {
+    size_t cap = NREQUESTS * 128;
+    size_t len = 0;
+    char *buf = NULL;
+    if((buf = malloc(cap)) == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for(int i = 0; i < NREQUESTS; i++) {
+        len += snprintf(buf + len, cap - len, request_fmt, i % 1000);
+    }
+
+    http_parser_settings settings;
+    memset(&settings, 0, sizeof(settings));
+    settings.on_message_begin = on_message_begin;
+    settings.on_url = on_url;
+    settings.on_message_complete = on_message_complete;
+    run("http_parser", parse_plain, &settings, buf, len);
+
+    settings.on_message_complete = on_message_complete_pause;
+    run("fastpath", parse_fast, &settings, buf, len);
+
+    free(buf);
+    return 0;
+}
@@ -1,58 +1,125 @@
+#define _GNU_SOURCE
 #include "pool.h"
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <sys/mman.h>
+
+/**
+ * Every chunk starts with this header, objects follow it.
+ */
+struct mempool_chunk {
+    struct mempool_chunk *next;
+};
+
+#define MEMPOOL_ALIGN 64
+#define MEMPOOL_HEADER ((sizeof(struct mempool_chunk) + MEMPOOL_ALIGN - 1) & ~(MEMPOOL_ALIGN - 1))
+
+
+static int mempool_grow(mempool_t *pool) {
+    struct mempool_chunk *chunk = NULL;
+    if((chunk = aligned_alloc(MEMPOOL_CHUNK_SIZE, MEMPOOL_CHUNK_SIZE)) == NULL) {
+        perror("aligned_alloc");
+        return -1;
+    }
+    // Whatever the current chunk never handed out goes on the free list
+    while(pool->next_obj != pool->chunk_end) {
+        *(void **)pool->next_obj = pool->free_list;
+        pool->free_list = pool->next_obj;
+        pool->next_obj += pool->obj_size;
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(chunk, MEMPOOL_CHUNK_SIZE, MADV_HUGEPAGE);
+#endif
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+    pool->nchunks++;
+    pool->next_obj = (char *)chunk + MEMPOOL_HEADER;
+    pool->chunk_end = pool->next_obj + pool->chunk_objs * pool->obj_size;
+    return 0;
+}
 
 
 mempool_t *mempool_init(uint64_t obj_size, uint64_t obj_count) {
     mempool_t *new_pool = NULL;
-    if((new_pool = malloc(sizeof(mempool_t))) == NULL) {
-        perror("malloc");
+    if((new_pool = calloc(1, sizeof(mempool_t))) == NULL) {
+        perror("calloc");
         return NULL;
     }
-    new_pool->obj_size = obj_size;
-    new_pool->obj_count = obj_count;
-    new_pool->free_map = NULL;
-    if((new_pool->free_map = calloc(obj_count/8, sizeof(uint8_t))) == NULL) {
-        perror("calloc");
-        goto mempool_init_pool_err;
+    // Objects hold the free list link while free and are cache line aligned
+    if(obj_size < sizeof(void *)) {
+        obj_size = sizeof(void *);
     }
-    new_pool->objects = NULL;
-    if((new_pool->objects = calloc(obj_count, obj_size)) == NULL) {
-        perror("calloc");
-        goto mempool_init_freemap_err;
+    new_pool->obj_size = (obj_size + MEMPOOL_ALIGN - 1) & ~(uint64_t)(MEMPOOL_ALIGN - 1);
+    new_pool->chunk_objs = (MEMPOOL_CHUNK_SIZE - MEMPOOL_HEADER) / new_pool->obj_size;
+    if(new_pool->chunk_objs == 0) {
+        fprintf(stderr, "mempool_init: %lu byte objects don't fit a chunk\n", obj_size);
+        goto mempool_init_pool_err;
     }
+    // Reserve the requested capacity up front, the objects are threaded onto
+    // the free list lazily as they are first handed out.
+    do {
+        if(mempool_grow(new_pool) == -1) {
+            goto mempool_init_chunks_err;
+        }
+    } while(new_pool->nchunks * new_pool->chunk_objs < obj_count);
     goto mempool_init_ret;
 
-mempool_init_freemap_err:
-    free(new_pool->free_map);
+mempool_init_chunks_err:
+    mempool_destroy(new_pool);
+    return NULL;
 mempool_init_pool_err:
     free(new_pool);
+    new_pool = NULL;
 mempool_init_ret:
     return new_pool;
 }
 
 
 void mempool_destroy(mempool_t *pool) {
-    free(pool->free_map);
+    struct mempool_chunk *chunk = pool->chunks;
+    while(chunk != NULL) {
+        struct mempool_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
     free(pool);
 }
 
 
 void *mempool_alloc(mempool_t *pool) {
-    for(uint64_t i=0; i<pool->obj_count/8; i++) {
-        for(int k=0;k<8;k++) {
-            if(pool->free_map[i] & (1 << k)) {
-                return (void *)(((uint64_t)pool->objects) + (uint64_t)((i+k) * pool->obj_size));
-            }
+    void *obj = NULL;
+    if(pool->free_list != NULL) {
+        obj = pool->free_list;
+        pool->free_list = *(void **)obj;
+    } else {
+        if(pool->next_obj == pool->chunk_end && mempool_grow(pool) == -1) {
+            return NULL;
         }
+        obj = pool->next_obj;
+        pool->next_obj += pool->obj_size;
     }
-    return NULL;
+    if(++pool->used > pool->peak) {
+        pool->peak = pool->used;
+    }
+    return obj;
 }
 
 
 void mempool_free(mempool_t *pool, void *ptr) {
-    uint64_t ptr_diff = ((uint64_t)ptr - (uint64_t)pool->objects) / pool->obj_size;
-    uint64_t index = ptr_diff / 8;
-    uint64_t byte_index = ptr_diff % 8;
-    pool->free_map[index] ^= (1 << byte_index);
+    if(ptr == NULL) {
+        return;
+    }
+    *(void **)ptr = pool->free_list;
+    pool->free_list = ptr;
+    pool->used--;
+}
+
+
+void mempool_stats(mempool_t *pool, mempool_stats_t *stats) {
+    stats->obj_size = pool->obj_size;
+    stats->used = pool->used;
+    stats->peak = pool->peak;
+    stats->capacity = pool->nchunks * pool->chunk_objs;
+    stats->chunks = pool->nchunks;
 }
@@ -0,0 +1,261 @@
+#include "rates.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "counter.h"
+
+// One more sample than ticks in the longest window, so the newest sample
+// and the one a full window back both fit.
+#define FINE_LEN (RATE_FINE_TICKS + 1)
+#define COARSE_LEN (RATE_COARSE_SAMPLES + 1)
+
+static const uint64_t window_ticks[RATE_WINDOWS] = RATE_WINDOW_TICKS;
+static const uint64_t tier_percents[RATE_TIERS - 1] = RATE_TIER_PERCENTS;
+
+struct rateslot {
+    char key[KEYSZ];
+    bool used;
+    bool sampled; // added to since the last tick
+    bool fresh; // no samples yet
+    uint64_t pending;
+    uint64_t fine[FINE_LEN];
+    uint64_t coarse[COARSE_LEN];
+};
+
+struct rates {
+    size_t size;
+    size_t used;
+    struct rateslot *slots;
+    uint64_t ticks;
+    uint64_t coarse_ticks;
+    // When each sample in the rings was taken, the same for every key
+    uint64_t fine_times[FINE_LEN];
+    uint64_t coarse_times[COARSE_LEN];
+    // The lowest count that still makes each tier, read by the workers
+    _Atomic uint64_t tier_floor[RATE_TIERS - 1];
+    // Scratch space for ranking the counts, reused between ticks
+    uint64_t *ranked;
+    size_t ranked_size;
+};
+
+static const size_t size0 = 128;
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+rates_t *rates_init(void) {
+    rates_t *rates = NULL;
+    if((rates = calloc(1, sizeof(rates_t))) == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    if((rates->slots = calloc(size0, sizeof(struct rateslot))) == NULL) {
+        perror("calloc");
+        free(rates);
+        return NULL;
+    }
+    rates->size = size0;
+    for(size_t t = 0; t < RATE_TIERS - 1; t++) {
+        atomic_init(&rates->tier_floor[t], UINT64_MAX);
+    }
+    return rates;
+}
+
+
+void rates_destroy(rates_t *rates) {
+    if(rates != NULL) {
+        free(rates->slots);
+        free(rates->ranked);
+        free(rates);
+    }
+}
+
+
+static struct rateslot *rates_find(struct rateslot *slots, size_t size, const char *key) {
+    for(size_t i = key_hash(key) % size;; i = (i + 1) % size) {
+        if(!slots[i].used || key_eq(key, slots[i].key)) {
+            return &slots[i];
+        }
+    }
+}
+
+
+static int rates_expand(rates_t *rates) {
+    struct rateslot *slots = NULL;
+    size_t size = rates->size * 2;
+    if((slots = calloc(size, sizeof(struct rateslot))) == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    for(size_t i = 0; i < rates->size; ++i) {
+        if(rates->slots[i].used) {
+            memcpy(rates_find(slots, size, rates->slots[i].key), &rates->slots[i], sizeof(struct rateslot));
+        }
+    }
+    free(rates->slots);
+    rates->slots = slots;
+    rates->size = size;
+    return 0;
+}
+
+
+int rates_add(rates_t *rates, const char *key, uint64_t count) {
+    struct rateslot *slot = rates_find(rates->slots, rates->size, key);
+    if(!slot->used) {
+        if(rates->used + 1 > (rates->size * 8) / 10) {
+            if(rates_expand(rates) == -1) {
+                return -1;
+            }
+            slot = rates_find(rates->slots, rates->size, key);
+        }
+        memcpy(slot->key, key, KEYSZ);
+        slot->used = true;
+        slot->fresh = true;
+        rates->used += 1;
+    }
+    slot->pending += count;
+    slot->sampled = true;
+    return 0;
+}
+
+
+static int count_cmp(const void *a, const void *b) {
+    uint64_t ca = *(const uint64_t *)a;
+    uint64_t cb = *(const uint64_t *)b;
+    return ca > cb ? -1 : ca < cb;
+}
+
+
+/**
+ * Rank the newest samples and publish the count each tier starts at. Keeps
+ * the previous tiers if there's no memory to rank in.
+ */
+static void rates_rank(rates_t *rates, size_t newest) {
+    if(rates->used == 0) {
+        return;
+    }
+    if(rates->ranked_size < rates->used) {
+        uint64_t *ranked = NULL;
+        if((ranked = realloc(rates->ranked, rates->size * sizeof(uint64_t))) == NULL) {
+            perror("realloc");
+            return;
+        }
+        rates->ranked = ranked;
+        rates->ranked_size = rates->size;
+    }
+    size_t n = 0;
+    for(size_t i = 0; i < rates->size; ++i) {
+        if(rates->slots[i].used) {
+            rates->ranked[n++] = rates->slots[i].fine[newest];
+        }
+    }
+    qsort(rates->ranked, n, sizeof(uint64_t), count_cmp);
+    for(size_t t = 0; t < RATE_TIERS - 1; t++) {
+        size_t last = (n * tier_percents[t] + 99) / 100;
+        atomic_store_explicit(&rates->tier_floor[t], rates->ranked[last > 0 ? last - 1 : 0], memory_order_relaxed);
+    }
+}
+
+
+void rates_tick(rates_t *rates) {
+    uint64_t now = now_ns();
+    size_t fine = rates->ticks % FINE_LEN;
+    size_t last = (rates->ticks + FINE_LEN - 1) % FINE_LEN;
+    bool coarse = rates->ticks % RATE_FINE_TICKS == 0;
+    size_t coarse_idx = rates->coarse_ticks % COARSE_LEN;
+
+    rates->fine_times[fine] = now;
+    if(coarse) {
+        rates->coarse_times[coarse_idx] = now;
+    }
+    for(size_t i = 0; i < rates->size; ++i) {
+        struct rateslot *slot = &rates->slots[i];
+        if(!slot->used) {
+            continue;
+        }
+        uint64_t count = slot->sampled ? slot->pending : slot->fine[last];
+        if(slot->fresh) {
+            // Keys that show up after the first sample started from zero,
+            // anything there from the start has no history to go by.
+            uint64_t history = rates->ticks == 0 ? count : 0;
+            for(size_t j = 0; j < FINE_LEN; j++) {
+                slot->fine[j] = history;
+            }
+            for(size_t j = 0; j < COARSE_LEN; j++) {
+                slot->coarse[j] = history;
+            }
+            slot->fresh = false;
+        }
+        slot->fine[fine] = count;
+        if(coarse) {
+            slot->coarse[coarse_idx] = count;
+        }
+        slot->pending = 0;
+        slot->sampled = false;
+    }
+    rates_rank(rates, fine);
+    rates->ticks++;
+    if(coarse) {
+        rates->coarse_ticks++;
+    }
+}
+
+
+void rates_get(rates_t *rates, const char *key, uint64_t rps[RATE_WINDOWS]) {
+    memset(rps, 0, RATE_WINDOWS * sizeof(uint64_t));
+    struct rateslot *slot = rates_find(rates->slots, rates->size, key);
+    if(!slot->used || slot->fresh) {
+        return;
+    }
+
+    size_t newest = (rates->ticks - 1) % FINE_LEN;
+    for(int w = 0; w < RATE_WINDOWS; w++) {
+        // Windows that reach back before the first sample get the rate
+        // since then instead.
+        uint64_t count = 0, time = 0;
+        if(window_ticks[w] <= RATE_FINE_TICKS) {
+            uint64_t back = window_ticks[w] < rates->ticks - 1 ? window_ticks[w] : rates->ticks - 1;
+            size_t idx = (rates->ticks - 1 - back) % FINE_LEN;
+            count = slot->fine[idx];
+            time = rates->fine_times[idx];
+        } else {
+            uint64_t back = window_ticks[w] / RATE_FINE_TICKS;
+            back = back < rates->coarse_ticks - 1 ? back : rates->coarse_ticks - 1;
+            size_t idx = (rates->coarse_ticks - 1 - back) % COARSE_LEN;
+            count = slot->coarse[idx];
+            time = rates->coarse_times[idx];
+        }
+        // Counts read without stopping the incrementing threads can lag a
+        // little, never report those as a negative rate.
+        if(rates->fine_times[newest] > time && slot->fine[newest] > count) {
+            rps[w] = (uint64_t)((slot->fine[newest] - count) * 1e9 / (rates->fine_times[newest] - time));
+        }
+    }
+}
+
+
+uint64_t rates_count(rates_t *rates, const char *key) {
+    struct rateslot *slot = rates_find(rates->slots, rates->size, key);
+    if(!slot->used || slot->fresh || rates->ticks == 0) {
+        return 0;
+    }
+    return slot->fine[(rates->ticks - 1) % FINE_LEN];
+}
+
+
+unsigned rates_tier(rates_t *rates, uint64_t count) {
+    // One compare per tier boundary instead of a search, there are only a few
+    unsigned tier = 0;
+    for(size_t t = 0; t < RATE_TIERS - 1; t++) {
+        tier += count < atomic_load_explicit(&rates->tier_floor[t], memory_order_relaxed);
+    }
+    return tier;
+}
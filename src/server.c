@@ -9,12 +9,22 @@
 #include <sys/socket.h>
 #include <errno.h>
 #include <signal.h>
+#include "admission.h"
+#include "epoch.h"
+#include "fastpath.h"
+#include "metrics.h"
+#include "pool.h"
 #include "server.h"
+#include "status.h"
+#include "topology.h"
 #include "uvbloop.h"
 
 
 #ifdef __linux__
 #include <sched.h>
+#ifdef UVB_CPU_STEERING
+#include <linux/filter.h>
+#endif
 #endif
 
 #ifdef __FreeBSD__
@@ -24,29 +34,53 @@
 #endif
 
 
-static const char header_page1[] = "--- Ultimate Victory Battle (v4.0.0) ---\n"
-                                   " Rules: \n"
-                                   "  - Increment your counter higher/faster than everyone else\n"
-                                   "  - GET /<name> Increments your counter\n"
-                                   "  - GET / Displays this page\n"
-                                   " Source: http://github.com/rossdylan/uvb-server\n"
-                                   " Backend: ";
-static const char header_page2[] = "\n----------------------------------------\n\n";
-static uint64_t header_size1 = (sizeof(header_page1)/sizeof(header_page1[0])) - 1;
-static uint64_t header_size2 = (sizeof(header_page2)/sizeof(header_page2[0])) - 1;
-
 static counter_t *counter;
-static char *inc_response;
-static uint64_t inc_response_sz;
+static topology_t topology;
 
 /**
- * Use asprintf to generate a HTTP response.
+ * The response to an increment is "<count> <tier>\n" for the name that was
+ * incremented. Every thread builds it in its own buffer that starts out
+ * with the header up to the Content-Length value already in place.
  */
-int make_http_response(char **resp_ptr, int status_code, const char *status, const char *content_type, const char* response) {
-    return asprintf(resp_ptr, "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %lu\r\n\r\n%s",
-            status_code, status, content_type, strlen(response), response);
-}
+static const char inc_header[] = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: ";
+static const struct {
+    const char *name;
+    size_t len;
+} tier_names[RATE_TIERS] = {
+    { "platinum", 8 }, { "gold", 4 }, { "silver", 6 }, { "bronze", 6 },
+};
+static __thread char inc_response[INC_RESPONSE_MAX];
+
+/**
+ * Each thread's connection_t slab. Connections never leave the thread that
+ * accepted them, so neither does their memory.
+ */
+static __thread mempool_t *connection_pool = NULL;
+
+/**
+ * This thread's block of metrics, and the buffer /_metrics is rendered into
+ */
+static __thread thread_metrics_t *metrics = NULL;
+static __thread int local_node = -1;
+static __thread buffer_t metrics_body = { NULL, 0, 0 };
+
+/**
+ * This thread's view of where its connections come from. Whoever gets
+ * turned away for overload is told so with a canned 503.
+ */
+static __thread admission_t *admission = NULL;
+static const char overload_response[] = "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Length: 0\r\nConnection: close\r\nRetry-After: 1\r\n\r\n";
 
+#ifdef UVBLOOP_COMPLETION
+static void connection_close(uvbloop_t *loop, connection_t *session, bool abort);
+#endif
+
+#ifdef UVB_BUSY_POLL
+#define BUSY_POLL_NS (BUSY_POLL_USECS * 1000ULL)
+// How long the thread spins before it blocks, adjusted on every wait
+static __thread uint64_t spin_ns = 0;
+#endif
 
 /**
  * Unblock the given socket.
@@ -65,6 +99,28 @@ int unblock_socket(int fd) {
     return 0;
 }
 
+#ifndef UVBLOOP_COMPLETION
+/**
+ * Accept a connection as a non-blocking, close-on-exec socket. Without
+ * accept4 that takes a couple more calls.
+ */
+static int accept_socket(int fd, struct sockaddr *addr, socklen_t *len) {
+#ifdef __APPLE__
+    int in_fd = -1;
+    if((in_fd = accept(fd, addr, len)) == -1) {
+        return -1;
+    }
+    if(unblock_socket(in_fd) == -1 || fcntl(in_fd, F_SETFD, FD_CLOEXEC) == -1) {
+        close(in_fd);
+        return -1;
+    }
+    return in_fd;
+#else
+    return accept4(fd, addr, len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#endif
+}
+#endif
+
 
 /**
  * Create a server socket on the given port.
@@ -104,6 +160,29 @@ int make_server_socket(const char *port) {
 
 
 
+/**
+ * A connection went CONNECTION_IDLE_MSECS without sending anything
+ */
+static void connection_expired(uvbloop_t *loop, uvbloop_timer_t *timer) {
+    connection_t *session = timer->data;
+    metric_add(&metrics->idle_timeouts, 1);
+#ifdef UVBLOOP_COMPLETION
+    connection_close(loop, session, true);
+#else
+    (void)loop;
+    free_connection(session);
+#endif
+}
+
+
+/**
+ * Push a connection's idle deadline out again
+ */
+static inline void connection_touch(uvbloop_t *loop, connection_t *session) {
+    uvbloop_timer_start(loop, &session->idle, CONNECTION_IDLE_MSECS * 1000);
+}
+
+
 /**
  * Set the initial state of a connection.
  * Initialize the parser, allocate and setup the http_msg_t struct
@@ -112,7 +191,22 @@ void init_connection(connection_t *session, int fd) {
     session->fd = fd;
     http_parser_init(&session->parser, HTTP_REQUEST);
     session->parser.data = session;
+    session->requests = 0;
+    session->source = ADMIT_UNTRACKED;
+    uvbloop_timer_init(&session->idle, connection_expired, session);
     init_http_msg(&session->msg);
+#ifdef UVBLOOP_COMPLETION
+    buffer_init(&session->out);
+    buffer_init(&session->sending);
+    session->sent = 0;
+    session->read_at = 0;
+    session->sending_at = 0;
+    session->inflight = 0;
+    session->closing = false;
+#else
+    outq_init(&session->out);
+    session->interest = UVBLOOP_R | LOOP_EDGE;
+#endif
 }
 
 
@@ -120,16 +214,152 @@ void init_connection(connection_t *session, int fd) {
  * Deallocate session structures and close the socket.
  */
 void free_connection(connection_t *session) {
+    metric_add(&metrics->closes, 1);
+    metric_observe(&metrics->conn_requests, session->requests);
+    admission_disconnect(admission, session->source);
+    uvbloop_timer_stop(&session->idle);
     close(session->fd);
     free_http_msg(&session->msg);
+#ifdef UVBLOOP_COMPLETION
+    buffer_free(&session->out);
+    buffer_free(&session->sending);
+#else
+    outq_free(&session->out);
+#endif
     // I May need to do some tear down of the parser, idk
-    free(session);
+    mempool_free(connection_pool, session);
+}
+
+/**
+ * Write the 503 straight from the static buffer, as much of it as the
+ * socket takes right now. Only for sockets with nothing queued ahead of it.
+ */
+static void connection_overloaded(int fd) {
+    if(send(fd, overload_response, sizeof(overload_response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+        // Nobody left to tell
+    }
 }
 
-__thread buffer_t rsp_buffer;
 
-static int on_message_complete(http_parser *hp) {
-    connection_t *session = hp->data;
+/**
+ * Run a freshly accepted socket past admission control. Rejected ones are
+ * closed on the spot, before anything is allocated for them.
+ */
+static bool connection_admit(uvbloop_t *loop, int fd, const struct sockaddr *addr, int32_t *source) {
+    admit_t admit = admission_connect(admission, addr, uvbloop_now(loop), source);
+    if(admit == ADMIT_OK) {
+        return true;
+    }
+    metric_add(&metrics->conns_rejected, 1);
+    if(admit == ADMIT_SHED) {
+        connection_overloaded(fd);
+    }
+    close(fd);
+    return false;
+}
+
+
+/**
+ * Count a new connection and note how far the slab has grown to hold it,
+ * and whether its packets came in on the cpu we are running on.
+ */
+static void connection_accepted(int fd) {
+    mempool_stats_t stats;
+    mempool_stats(connection_pool, &stats);
+    metric_add(&metrics->accepts, 1);
+    metric_set(&metrics->pool_capacity, stats.capacity);
+#ifdef SO_INCOMING_CPU
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if(getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 && cpu >= 0) {
+        if(cpu == sched_getcpu()) {
+            metric_add(&metrics->accepts_local_cpu, 1);
+        } else {
+            metric_add(&metrics->accepts_remote_cpu, 1);
+        }
+        if(local_node >= 0 && topology_node(&topology, cpu) != local_node) {
+            metric_add(&metrics->accepts_remote_node, 1);
+        }
+    }
+#else
+    (void)fd;
+#endif
+}
+
+
+/**
+ * Queue a response for the client. Everything generated while parsing a
+ * single read goes out together once parsing is done.
+ */
+static void connection_write(connection_t *session, const char *buf, size_t len) {
+#ifdef UVBLOOP_COMPLETION
+    buffer_append(&session->out, buf, len);
+#else
+    outq_append(&session->out, buf, len);
+#endif
+}
+
+
+/**
+ * Queue the status page, taking over the caller's reference to it. The
+ * readiness path writes straight out of the page without copying it.
+ */
+static void connection_write_page(connection_t *session, status_page_t *page) {
+#ifdef UVBLOOP_COMPLETION
+    buffer_append(&session->out, page->data, page->len);
+    status_release(page);
+#else
+    outq_append_page(&session->out, page);
+#endif
+}
+
+/**
+ * Render every thread's metrics and queue them as a response.
+ */
+static void connection_write_metrics(connection_t *session) {
+    static const char header[] = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: ";
+    if(metrics_body.buffer == NULL && buffer_init(&metrics_body) == -1) {
+        return;
+    }
+    buffer_fast_clear(&metrics_body);
+    metrics_render(&metrics_body);
+
+    char len[24];
+    size_t len_sz = u64toa(buffer_length(&metrics_body), len);
+    connection_write(session, header, sizeof(header) - 1);
+    connection_write(session, len, len_sz);
+    connection_write(session, "\r\n\r\n", 4);
+    connection_write(session, metrics_body.buffer, buffer_length(&metrics_body));
+}
+
+/**
+ * Queue the response to an increment that brought a name to count. Nothing
+ * but the digits, the tier and the lengths is written per request.
+ */
+static void connection_write_count(connection_t *session, uint64_t count) {
+    char digits[20];
+    size_t digits_len = u64toa(count, digits);
+    unsigned tier = counter_tier(counter, count);
+
+    char *p = inc_response + sizeof(inc_header) - 1;
+    p += u64toa(digits_len + 1 + tier_names[tier].len + 1, p);
+    memcpy(p, "\r\n\r\n", 4);
+    p += 4;
+    memcpy(p, digits, digits_len);
+    p += digits_len;
+    *p++ = ' ';
+    memcpy(p, tier_names[tier].name, tier_names[tier].len);
+    p += tier_names[tier].len;
+    *p++ = '\n';
+    connection_write(session, inc_response, p - inc_response);
+}
+
+/**
+ * Respond to the request in session->msg and reset it for the next one.
+ */
+static void connection_request(connection_t *session) {
+    session->requests++;
+    metric_add(&metrics->requests, 1);
 
 #ifdef GPROF
     if(http_url_compare(&session->msg, "/quit") == 0) {
@@ -138,36 +368,33 @@ static int on_message_complete(http_parser *hp) {
     }
 #endif
 
-    if(http_url_compare(&session->msg, "/") != 0) {
-        // OH GOD DON'T LOOK I'M A HIDEOUS HACK
-        // We peak into the buffer and take away the first
-        // character in order to just get the key
-        char *key = (char *)(session->msg.url.buffer + 1);
-        // Forcefully cap out keys at 15 characters
-        // 16th char is NULL
-        if(buffer_length(&session->msg.url) > 15) {
-            session->msg.url.buffer[15] = '\0';
+    if(http_url_compare(&session->msg, "/_metrics") == 0) {
+        connection_write_metrics(session);
+    }
+    else if(http_url_compare(&session->msg, "/") != 0) {
+        // Drop the leading slash to get the key and forcefully cap it at
+        // 15 characters, the 16th char is NULL. The url isn't terminated
+        // and may still point into the read buffer so copy it out.
+        char key[KEYSZ] = { 0 };
+        if(session->msg.url_len > 1) {
+            size_t key_len = session->msg.url_len - 1;
+            memcpy(key, session->msg.url + 1, key_len < KEYSZ - 1 ? key_len : KEYSZ - 1);
         }
-        counter_inc(counter, key);
-        write(session->fd, inc_response, inc_response_sz);
+        connection_write_count(session, counter_inc(counter, key));
     }
     else {
-        buffer_append(&rsp_buffer, header_page1, header_size1);
-        buffer_append(&rsp_buffer, counter_backend_name, strlen(counter_backend_name));
-        buffer_append(&rsp_buffer, header_page2, header_size2);
-        counter_dump(counter, &rsp_buffer);
-        char *resp = NULL;
-        int len = make_http_response(&resp, 200, "OK", "text/plain", rsp_buffer.buffer);
-
-        write(session->fd, resp, len);
-
-        free(resp);
-        buffer_fast_clear(&rsp_buffer);
+        connection_write_page(session, status_acquire());
     }
 
     free_http_msg(&session->msg);
     init_http_msg(&session->msg);
+}
 
+static int on_message_complete(http_parser *hp) {
+    // Stop after every message so connection_parse can try the following
+    // requests on the fast path again.
+    http_parser_pause(hp, 1);
+    connection_request(hp->data);
     return 0;
 }
 
@@ -182,11 +409,349 @@ static void configure_parser(http_parser_settings *settings) {
     settings->on_header_value = NULL;
 #endif
     settings->on_headers_complete = on_headers_complete;
-    settings->on_message_begin = NULL;
+    settings->on_message_begin = on_message_begin;
     settings->on_message_complete = on_message_complete;
     settings->on_body = NULL;
 }
 
+/**
+ * Parse a read worth of requests. Plain GET requests that start in this read
+ * are answered straight from fastpath_get, anything else goes through
+ * http_parser. Returns the number of bytes parsed, less than len on errors.
+ */
+static size_t connection_parse(connection_t *session, http_parser_settings *settings, const char *buf, size_t len) {
+    size_t off = 0;
+    while(off < len) {
+        if(!session->msg.started) {
+            const char *url = NULL;
+            size_t url_len = 0;
+            size_t request_len = fastpath_get(buf + off, len - off, &url, &url_len);
+            if(request_len > 0) {
+                session->msg.url = url;
+                session->msg.url_len = url_len;
+                metric_add(&metrics->fastpath_requests, 1);
+                connection_request(session);
+                off += request_len;
+                continue;
+            }
+        }
+        off += http_parser_execute(&session->parser, settings, buf + off, len - off);
+        if(HTTP_PARSER_ERRNO(&session->parser) != HPE_PAUSED) {
+            break;
+        }
+        http_parser_pause(&session->parser, 0);
+    }
+    return off;
+}
+
+
+#ifdef UVB_BUSY_POLL
+/**
+ * uvbloop_wait, but spin on uvbloop_poll for up to spin_ns before blocking.
+ * A spin that finds events doubles the budget and one that runs dry halves
+ * it, so a quiet thread soon goes straight to sleep. A sleep short enough
+ * that spinning would have covered it sets the budget to twice its length.
+ */
+static int loop_wait(uvbloop_t *loop, uvbloop_event_t *events, int max_events) {
+    uint64_t now = metrics_now();
+    int waiting = 0;
+    if(spin_ns > 0) {
+        uint64_t until = now + spin_ns;
+        metric_add(&metrics->busy_polls, 1);
+        while((waiting = uvbloop_poll(loop, events, max_events)) == 0 && (now = metrics_now()) < until);
+        if(waiting != 0) {
+            if(waiting > 0) {
+                metric_add(&metrics->busy_poll_hits, 1);
+                spin_ns = spin_ns * 2 < BUSY_POLL_NS ? spin_ns * 2 : BUSY_POLL_NS;
+                metric_set(&metrics->busy_poll_budget, spin_ns);
+            }
+            return waiting;
+        }
+        // Not worth spinning for less than a syscall or two
+        spin_ns = spin_ns / 2 < 1000 ? 0 : spin_ns / 2;
+    }
+    waiting = uvbloop_wait(loop, events, max_events);
+    uint64_t slept = metrics_now() - now;
+    if(waiting > 0 && slept < BUSY_POLL_NS && slept * 2 > spin_ns) {
+        spin_ns = slept * 2 < BUSY_POLL_NS ? slept * 2 : BUSY_POLL_NS;
+    }
+    metric_set(&metrics->busy_poll_budget, spin_ns);
+    return waiting;
+}
+#else
+#define loop_wait uvbloop_wait
+#endif
+
+#ifndef UVBLOOP_COMPLETION
+/**
+ * outq_flush that keeps track of the bytes written
+ */
+static int64_t connection_send(connection_t *session) {
+    uint64_t before = outq_length(&session->out);
+    int64_t queued = outq_flush(&session->out, session->fd);
+    if(queued != -1) {
+        metric_add(&metrics->bytes_out, before - queued);
+    }
+    return queued;
+}
+
+
+/**
+ * Write out as much queued output as the socket takes and keep the loop's
+ * interest in sync with what is left. We only watch for writability while
+ * output is queued, and stop reading from a client once more than
+ * OUTQ_HIGH_WATER bytes are waiting for it.
+ */
+static int connection_flush(uvbloop_t *loop, connection_t *session) {
+    int64_t queued = connection_send(session);
+    if(queued == -1) {
+        return -1;
+    }
+    uvbloop_nset_t nset = LOOP_EDGE;
+    if(queued < OUTQ_HIGH_WATER) {
+        nset |= UVBLOOP_R;
+    }
+    if(queued > 0) {
+        nset |= UVBLOOP_W;
+    }
+    if(nset != session->interest) {
+        if(uvbloop_modify_fd(loop, session->fd, (void *)session, nset) == -1) {
+            return -1;
+        }
+        session->interest = nset;
+    }
+    return 0;
+}
+#endif
+
+#ifdef UVBLOOP_COMPLETION
+/**
+ * Free a connection once it is closing and the loop no longer has any
+ * operations in flight that reference it.
+ */
+static void connection_put(connection_t *session) {
+    if(session->closing && session->inflight == 0) {
+        free_connection(session);
+    }
+}
+
+
+/**
+ * Stop servicing a connection. If abort is set everything still outstanding
+ * against the socket is cancelled, otherwise queued output is still sent.
+ */
+static void connection_close(uvbloop_t *loop, connection_t *session, bool abort) {
+    if(abort && !session->closing) {
+        uvbloop_unregister_fd(loop, session->fd);
+    }
+    session->closing = true;
+    connection_put(session);
+}
+
+
+/**
+ * Hand the queued output to the loop as a single send. Only one send is in
+ * flight per connection, anything queued meanwhile goes out when it completes.
+ */
+static void connection_flush(uvbloop_t *loop, connection_t *session) {
+    if(buffer_length(&session->sending) > 0 || buffer_length(&session->out) == 0) {
+        return;
+    }
+    buffer_t tmp = session->sending;
+    session->sending = session->out;
+    session->out = tmp;
+    session->sent = 0;
+    session->sending_at = session->read_at;
+    if(uvbloop_send(loop, session->fd, session->sending.buffer, buffer_length(&session->sending), session) == -1) {
+        connection_close(loop, session, true);
+        return;
+    }
+    session->inflight++;
+}
+
+
+static void on_accept_complete(uvbloop_t *loop, uvbloop_event_t *event, connection_t *server_session) {
+    int in_fd = uvbloop_event_result(event);
+
+    if(!uvbloop_event_more(event)) {
+        if(uvbloop_accept(loop, server_session->fd, (void *)server_session) == -1) {
+            perror("uvbloop_accept");
+        }
+    }
+    if(in_fd < 0) {
+        errno = -in_fd;
+        perror("accept");
+        return;
+    }
+
+    // Multishot accepts don't hand back the peer address
+    struct sockaddr_storage in_addr;
+    socklen_t in_len = sizeof(in_addr);
+    memset(&in_addr, 0, sizeof(in_addr));
+    getpeername(in_fd, (struct sockaddr *)&in_addr, &in_len);
+    int32_t source = ADMIT_UNTRACKED;
+    if(!connection_admit(loop, in_fd, (struct sockaddr *)&in_addr, &source)) {
+        return;
+    }
+
+    connection_t *new_session = NULL;
+    if((new_session = mempool_alloc(connection_pool)) == NULL) {
+        perror("mempool_alloc");
+        admission_disconnect(admission, source);
+        close(in_fd);
+        return;
+    }
+    init_connection(new_session, in_fd);
+    new_session->source = source;
+    connection_accepted(in_fd);
+    if(uvbloop_recv(loop, in_fd, (void *)new_session) == -1) {
+        perror("uvbloop_recv");
+        free_connection(new_session);
+        return;
+    }
+    new_session->inflight++;
+    connection_touch(loop, new_session);
+}
+
+
+static void on_recv_complete(uvbloop_t *loop, uvbloop_event_t *event, connection_t *session, http_parser_settings *settings) {
+    int count = uvbloop_event_result(event);
+    bool more = uvbloop_event_more(event);
+
+    if(!more) {
+        session->inflight--;
+    }
+    metric_add(&metrics->reads, 1);
+    if(count > 0 && !session->closing) {
+        metric_add(&metrics->bytes_in, count);
+        bool idle = buffer_length(&session->out) == 0;
+        if(!admission_request(admission, session->source, uvbloop_now(loop))) {
+            uvbloop_release_buffer(loop, event);
+            metric_add(&metrics->requests_shed, 1);
+            if(idle && buffer_length(&session->sending) == 0) {
+                connection_overloaded(session->fd);
+            }
+            connection_close(loop, session, true);
+            return;
+        }
+        connection_touch(loop, session);
+        uint64_t requests = session->requests;
+        char *buf = uvbloop_event_buffer(loop, event);
+        size_t parsed = connection_parse(session, settings, buf, (size_t)count);
+        if(parsed == (size_t)count) {
+            http_msg_detach(&session->msg);
+        }
+        uvbloop_release_buffer(loop, event);
+        admission_charge(admission, session->source, session->requests - requests);
+
+        if(parsed != (size_t)count) {
+            metric_add(&metrics->parse_errors, 1);
+            connection_close(loop, session, true);
+            return;
+        }
+        // Responses are timed from the oldest read that has some queued
+        if(idle && session->requests != requests) {
+            session->read_at = metrics_now();
+        }
+        connection_flush(loop, session);
+        if(!more) {
+            if(uvbloop_recv(loop, session->fd, (void *)session) == -1) {
+                connection_close(loop, session, true);
+                return;
+            }
+            session->inflight++;
+        }
+        return;
+    }
+    uvbloop_release_buffer(loop, event);
+
+    // The buffer ring ran dry, the multishot recv has to be rearmed
+    if(count == -ENOBUFS && !more && !session->closing) {
+        if(uvbloop_recv(loop, session->fd, (void *)session) == -1) {
+            connection_close(loop, session, true);
+            return;
+        }
+        session->inflight++;
+        return;
+    }
+    // EOF lets the queued responses drain, errors tear everything down
+    connection_close(loop, session, count < 0);
+}
+
+
+static void on_send_complete(uvbloop_t *loop, uvbloop_event_t *event, connection_t *session) {
+    int count = uvbloop_event_result(event);
+
+    session->inflight--;
+    if(count < 0) {
+        connection_close(loop, session, true);
+        return;
+    }
+    session->sent += count;
+    metric_add(&metrics->bytes_out, count);
+    if(session->sent < buffer_length(&session->sending)) {
+        if(uvbloop_send(loop, session->fd, session->sending.buffer + session->sent,
+                    buffer_length(&session->sending) - session->sent, session) == -1) {
+            connection_close(loop, session, true);
+            return;
+        }
+        session->inflight++;
+        return;
+    }
+    metric_latency(&metrics->response_latency, session->sending_at, metrics_now());
+    buffer_fast_clear(&session->sending);
+    connection_flush(loop, session);
+    connection_put(session);
+}
+
+
+/**
+ * Event loop for completion backends. Accepts and reads are multishot so
+ * the only resubmissions needed are sends, and all of those are batched
+ * into the next uvbloop_wait.
+ */
+static void *completion_loop(uvbloop_t *loop, uvbloop_event_t *events, http_parser_settings *settings) {
+    int waiting;
+    connection_t *session = NULL;
+
+    while(true) {
+        epoch_offline();
+        waiting = loop_wait(loop, events, MAXEVENTS);
+        if(waiting < 0) {
+            if(errno != EINTR) {
+                perror("uvbloop_wait");
+                return NULL;
+            }
+        } else {
+            metric_add(&metrics->waits, 1);
+            metric_observe(&metrics->wait_batch, waiting);
+        }
+        epoch_online();
+        uint64_t woke = metrics_now();
+        for(int i=0; i<waiting; i++) {
+            session = (connection_t *)uvbloop_event_data(&events[i]);
+            if(session == NULL) {
+                continue;
+            }
+            metric_latency(&metrics->dispatch_delay, woke, metrics_now());
+            switch(uvbloop_event_op(&events[i])) {
+                case UVBLOOP_OP_ACCEPT:
+                    on_accept_complete(loop, &events[i], session);
+                    break;
+                case UVBLOOP_OP_RECV:
+                    on_recv_complete(loop, &events[i], session, settings);
+                    break;
+                case UVBLOOP_OP_SEND:
+                    on_send_complete(loop, &events[i], session);
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+}
+#endif
+
 /**
  * Function executed within a pthread to multiplex epoll acrossed threads
  * ptr is a reference to the port
@@ -196,154 +761,344 @@ void *epoll_loop(void *ptr) {
     uvbloop_t *loop = NULL;
     uvbloop_event_t *events;
     http_parser_settings parser_settings;
+#ifndef UVBLOOP_COMPLETION
     int waiting;
     connection_t *session = NULL;
+#endif
     connection_t *server_session = NULL;
 
+    // Before anything is allocated, so all of it comes from our own node
+    local_node = data->node;
+    topology_bind_memory(data->node);
+
     if((loop = uvbloop_init(NULL)) == NULL) {
         perror("uvbloop_init");
         return NULL;
     }
 
-    buffer_init(&rsp_buffer);
-
     configure_parser(&parser_settings);
+    memcpy(inc_response, inc_header, sizeof(inc_header) - 1);
 
-    if((data->listen_fd = make_server_socket(data->port)) < 0) {
-        perror("make_server_socket");
+    metrics = metrics_thread(data->thread_id);
+    if((admission = admission_init()) == NULL) {
         return NULL;
     }
-
-    if((server_session = malloc(sizeof(connection_t))) == NULL) {
-        perror("malloc");
+    if((connection_pool = mempool_init(sizeof(connection_t), CONNECTION_POOL_SIZE)) == NULL) {
+        perror("mempool_init");
         return NULL;
     }
-    server_session->fd = data->listen_fd;
 
-    if(unblock_socket(server_session->fd) == -1) {
-        perror("unblock_socket");
+    if((server_session = mempool_alloc(connection_pool)) == NULL) {
+        perror("mempool_alloc");
         return NULL;
     }
-    if(listen(server_session->fd, SOMAXCONN) == -1) {
-        perror("listen");
+    server_session->fd = data->listen_fd;
+
+#ifdef UVBLOOP_COMPLETION
+    if(uvbloop_accept(loop, server_session->fd, (void *)server_session) == -1) {
+        perror("uvbloop_accept");
         return NULL;
     }
-
-    if(uvbloop_register_fd(loop, server_session->fd, (void *)server_session, UVBLOOP_R) == -1) {
+#else
+    if(uvbloop_register_fd(loop, server_session->fd, (void *)server_session, UVBLOOP_R | LOOP_EDGE) == -1) {
         perror("uvbloop_register_fd");
         return NULL;
     }
+#endif
 
     if((events = calloc(MAXEVENTS, sizeof(uvbloop_event_t))) == NULL) {
         perror("calloc");
         return NULL;
     }
+    // Offline while waiting, which is what lets replaced status pages and
+    // retired counter memory go
+    if(epoch_register() == -1) {
+        return NULL;
+    }
 
+#ifdef UVBLOOP_COMPLETION
+    return completion_loop(loop, events, &parser_settings);
+#else
     while(true) {
-        waiting = uvbloop_wait(loop, events, MAXEVENTS);
+        epoch_offline();
+        waiting = loop_wait(loop, events, MAXEVENTS);
         if(waiting < 0) {
             if(errno != EINTR) {
                 perror("uvbloop_wait");
                 return NULL;
             }
+        } else {
+            metric_add(&metrics->waits, 1);
+            metric_observe(&metrics->wait_batch, waiting);
         }
+        epoch_online();
+        uint64_t woke = metrics_now();
         for(int i=0; i<waiting; i++) {
             session = (connection_t *)uvbloop_event_data(&events[i]);
             if(session == NULL) {
                 continue;
             }
+            metric_latency(&metrics->dispatch_delay, woke, metrics_now());
             if(uvbloop_event_error(&events[i])) {
                 free_connection(session);
                 continue;
             }
             /**
-             * Handles the accept case, add a client new socket to epoll.
+             * Handles the accept case, add new client sockets to epoll.
              */
             else if(data->listen_fd == session->fd) {
-                struct sockaddr in_addr;
-                socklen_t in_len = sizeof(in_addr);
-                int in_fd = -1;
+                int accepted = 0;
+                for(; accepted < ACCEPT_BUDGET; accepted++) {
+                    struct sockaddr_storage in_addr;
+                    socklen_t in_len = sizeof(in_addr);
+                    int in_fd = -1;
+                    int32_t source = ADMIT_UNTRACKED;
 
-                if((in_fd = accept(data->listen_fd, &in_addr, &in_len)) == -1) {
-                    if((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-                        goto loop_accept_failed;
+                    if((in_fd = accept_socket(data->listen_fd, (struct sockaddr *)&in_addr, &in_len)) == -1) {
+                        if(errno == ECONNABORTED) {
+                            continue;
+                        }
+                        if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                            perror("accept");
+                        }
+                        break;
                     }
-                    else {
-                        perror("accept");
-                        goto loop_accept_failed;
+                    if(!connection_admit(loop, in_fd, (struct sockaddr *)&in_addr, &source)) {
+                        continue;
                     }
-                }
 
-                if(unblock_socket(in_fd) == -1) {
-                    //TODO maybe do extra handling of this error case?
-                    perror("unblock_socket");
-                    goto loop_accept_failed;
-                }
-                connection_t *new_session = NULL;
-                if((new_session = malloc(sizeof(connection_t))) == NULL) {
-                    perror("malloc");
-                    goto loop_accept_failed;
+                    connection_t *new_session = NULL;
+                    if((new_session = mempool_alloc(connection_pool)) == NULL) {
+                        perror("mempool_alloc");
+                        admission_disconnect(admission, source);
+                        close(in_fd);
+                        continue;
+                    }
+                    init_connection(new_session, in_fd);
+                    new_session->source = source;
+                    connection_accepted(in_fd);
+                    if(uvbloop_register_fd(loop, in_fd, (void *)new_session, UVBLOOP_R | LOOP_EDGE) == -1) {
+                        perror("uvbloop_register_fd");
+                        free_connection(new_session);
+                        continue;
+                    }
+                    connection_touch(loop, new_session);
                 }
-                init_connection(new_session, in_fd);
-                if(uvbloop_register_fd(loop, in_fd, (void *)new_session, UVBLOOP_R) == -1) {
-                    perror("uvbloop_register_fd");
-                    free_connection(new_session);
-                    goto loop_accept_failed;
+                // Out of budget with connections possibly still queued, an
+                // edge won't come back for those by itself.
+                if(LOOP_EDGE && accepted == ACCEPT_BUDGET) {
+                    uvbloop_modify_fd(loop, data->listen_fd, (void *)server_session, UVBLOOP_R | LOOP_EDGE);
                 }
-
-loop_accept_failed: ;
             }
             else {
                 bool done = false;
+                bool more = false; // stopped reading before the socket ran dry
+                uint64_t read_at = 0;
+                uint64_t requests = session->requests;
 
                 char buf[4096];
-                ssize_t count = -1;
-                if((count = read(session->fd, buf, sizeof(buf))) == -1) {
-                    if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                for(int reads = 0; uvbloop_event_readable(&events[i]); reads++) {
+                    if(reads == READ_BUDGET || outq_length(&session->out) >= OUTQ_HIGH_WATER) {
+                        more = true;
+                        break;
+                    }
+                    ssize_t count = read(session->fd, buf, sizeof(buf));
+                    metric_add(&metrics->reads, 1);
+                    if(count == -1) {
+                        if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                            done = true;
+                        }
+                        break;
+                    } else if(count == 0) {
+                        // EOF, give whatever is still queued one last shot
+                        connection_send(session);
                         done = true;
+                        break;
                     }
-                    goto serviced;
-                } else if(count == 0) {
-                    // EOF
-                    done = true;
-                    goto serviced;
-                }
 
-                // Since we check if count is -1 and back out
-                // before this point this cast should be safe
-                size_t parsed = http_parser_execute(
-                    &session->parser, &parser_settings, buf, (size_t)count);
+                    // Since we check if count is -1 and back out
+                    // before this point this cast should be safe
+                    if(read_at == 0) {
+                        read_at = metrics_now();
+                    }
+                    metric_add(&metrics->bytes_in, count);
+                    if(!admission_request(admission, session->source, uvbloop_now(loop))) {
+                        metric_add(&metrics->requests_shed, 1);
+                        if(outq_length(&session->out) == 0) {
+                            connection_overloaded(session->fd);
+                        }
+                        done = true;
+                        break;
+                    }
+                    connection_touch(loop, session);
+                    uint64_t before = session->requests;
+                    size_t parsed = connection_parse(session, &parser_settings, buf, (size_t)count);
 
-                if(parsed != (size_t)count) {
-                    // ERROR OH NO
+                    if(parsed == (size_t)count) {
+                        http_msg_detach(&session->msg);
+                    }
+                    admission_charge(admission, session->source, session->requests - before);
+                    if(parsed != (size_t)count) {
+                        // ERROR OH NO
+                        // Responses to the requests before the bad one are
+                        // still sent, as far as the socket takes them.
+                        metric_add(&metrics->parse_errors, 1);
+                        connection_send(session);
+                        done = true;
+                        break;
+                    }
+                }
+                if(!done && connection_flush(loop, session) == -1) {
                     done = true;
-                    // goto serviced;
                 }
-serviced:
+                // Edge triggered we have to ask for the rest of the input,
+                // unless the flush stopped reads until the output drains.
+                if(!done && LOOP_EDGE && more && (session->interest & UVBLOOP_R) &&
+                        uvbloop_modify_fd(loop, session->fd, (void *)session, session->interest) == -1) {
+                    done = true;
+                }
+                if(!done && session->requests != requests) {
+                    metric_latency(&metrics->response_latency, read_at, metrics_now());
+                }
                 if(done) {
                     free_connection(session);
                 }
             }
         }
     }
+#endif
+}
+
+/**
+ * Create a non-blocking listening socket for one of the threads
+ */
+static int make_listen_socket(const char *port) {
+    int fd = -1;
+    if((fd = make_server_socket(port)) < 0) {
+        perror("make_server_socket");
+        return -1;
+    }
+    if(unblock_socket(fd) == -1) {
+        perror("unblock_socket");
+        close(fd);
+        return -1;
+    }
+#if defined(UVB_BUSY_POLL) && defined(SO_BUSY_POLL)
+    // Accepted sockets inherit these. Raising them past the sysctl defaults
+    // takes CAP_NET_ADMIN, without it the loops still spin on their own.
+    int usecs = BUSY_POLL_USECS;
+    if(setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == -1) {
+        perror("setsockopt(SO_BUSY_POLL)");
+    }
+#ifdef SO_PREFER_BUSY_POLL
+    int prefer = 1;
+    if(setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) == -1) {
+        perror("setsockopt(SO_PREFER_BUSY_POLL)");
+    }
+#endif
+#endif
+    if(listen(fd, SOMAXCONN) == -1) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+#ifdef UVB_CPU_STEERING
+/**
+ * The thread connections arriving on cpu should go to: the one pinned to
+ * it, otherwise the threads on the same node in turn, -1 if there are none.
+ */
+static int steer_target(const int *cpus, size_t nthreads, int cpu, size_t *spill) {
+    int node = topology_node(&topology, cpu);
+    size_t on_node = 0;
+    for(size_t t = 0; t < nthreads; t++) {
+        if(cpus[t] == cpu) {
+            return (int)t;
+        }
+        if(cpus[t] >= 0 && topology_node(&topology, cpus[t]) == node) {
+            on_node++;
+        }
+    }
+    if(on_node == 0) {
+        return -1;
+    }
+    size_t pick = (*spill)++ % on_node;
+    for(size_t t = 0; t < nthreads; t++) {
+        if(cpus[t] >= 0 && topology_node(&topology, cpus[t]) == node && pick-- == 0) {
+            return (int)t;
+        }
+    }
+    return -1;
+}
+
+
+/**
+ * Have the kernel hand a new connection to the listener of the thread
+ * pinned to the cpu that took its packets, so the softirq, the socket and
+ * the thread serving it all share one core's caches. The program runs
+ * against the whole SO_REUSEPORT group, any of its sockets will do. It
+ * compares the cpu against every online one in turn, cpus it doesn't know
+ * about wrap around onto the threads.
+ */
+static void steer_by_cpu(int fd, const int *cpus, size_t nthreads) {
+    static struct sock_filter code[BPF_MAXINSNS];
+    unsigned short len = 0;
+    size_t spill = 0;
+    code[len++] = (struct sock_filter){ BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU) };
+    for(size_t i = 0; i < topology.ncpus && len + 4 <= BPF_MAXINSNS; i++) {
+        int thread = steer_target(cpus, nthreads, topology.cpus[i].cpu, &spill);
+        if(thread < 0) {
+            continue;
+        }
+        code[len++] = (struct sock_filter){ BPF_JMP | BPF_JEQ | BPF_K, 0, 1, (uint32_t)topology.cpus[i].cpu };
+        code[len++] = (struct sock_filter){ BPF_RET | BPF_K, 0, 0, (uint32_t)thread };
+    }
+    code[len++] = (struct sock_filter){ BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)nthreads };
+    code[len++] = (struct sock_filter){ BPF_RET | BPF_A, 0, 0, 0 };
+    struct sock_fprog prog = { len, code };
+    if(setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1) {
+        // Not fatal, the kernel goes back to hashing connections over the group
+        perror("SO_ATTACH_REUSEPORT_CBPF");
+    }
 }
+#endif
+
 
-server_t *new_server(const size_t nthreads, const char *addr, const char *port) {
+server_t *new_server(const size_t nthreads, const char *addr, const char *port, placement_t placement) {
     (void)addr;
-    // create the standard response for increments
-    inc_response_sz = make_http_response(&inc_response, 200, "OK", "text/plain", "YOLO");
     server_t *server = NULL;
+    int *cpus = NULL;
     if((server = malloc(sizeof(server_t))) == NULL) {
         perror("malloc");
         return NULL;
     }
     server->nthreads = nthreads;
     server->port = port;
-    if((counter = counter_init("./uvb.lmdb", nthreads)) == NULL) {
+    server->threads = NULL;
+    // Initialized before the first failure can jump to the cleanup
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    // Each backend keeps its own file, none of them can read another's
+    char path[64];
+    snprintf(path, sizeof(path), "./uvb.%s", counter_backend_name);
+    if((counter = counter_init(path, nthreads)) == NULL) {
+        goto new_server_free;
+    }
+    if(status_init(counter) == -1) {
+        goto new_server_free;
+    }
+    if(metrics_init(nthreads) == -1) {
+        goto new_server_free;
+    }
+    if(admission_global_init() == -1) {
         goto new_server_free;
     }
     timer_mgr_init(&server->timers);
-    register_timer(&server->timers, counter_gen_stats, STATS_SECS * 1000, (void *)counter);
+    register_timer(&server->timers, status_update, RATE_TICK_MSECS, (void *)counter);
+    register_timer(&server->timers, metrics_merge, STATS_SECS * 1000, NULL);
 
     // Make our array of threads
     if((server->threads = calloc(nthreads, sizeof(pthread_t))) == NULL) {
@@ -361,8 +1116,12 @@ server_t *new_server(const size_t nthreads, const char *addr, const char *port)
     size_t set_sz = sizeof(cpuset_t);
 #endif
 
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
+    if(topology_init(&topology) == -1 || (cpus = calloc(nthreads, sizeof(int))) == NULL) {
+        goto new_server_free;
+    }
+    topology_place(&topology, placement, nthreads, cpus);
+
+    int first_fd = -1;
     for(size_t i=0; i<nthreads; i++) {
         thread_data_t *tdata = NULL;
         if((tdata = malloc(sizeof(thread_data_t))) == NULL) {
@@ -372,20 +1131,48 @@ server_t *new_server(const size_t nthreads, const char *addr, const char *port)
         memset(tdata, 0, sizeof(thread_data_t));
         tdata->port = port;
         tdata->thread_id = i;
+        tdata->cpu = cpus[i];
+        tdata->node = topology_node(&topology, cpus[i]);
+        // Listeners join the SO_REUSEPORT group as they start listening, so
+        // set them all up from here to have socket i of the group be the
+        // one of thread i.
+        if((tdata->listen_fd = make_listen_socket(port)) == -1) {
+            free(tdata);
+            goto new_server_free;
+        }
+        if(first_fd == -1) {
+            first_fd = tdata->listen_fd;
+        }
 
+        printf(" thread %lu: cpu %d node %d\n", i, tdata->cpu, tdata->node);
+
+        // The cpu may be outside what we're allowed to run on, run it
+        // unpinned then.
+        pthread_attr_t *pin = NULL;
 #ifndef __APPLE__
-        memset(&set, 0, set_sz);
-        CPU_SET(i, &set);
-        pthread_attr_setaffinity_np(&attr, set_sz, &set);
+        if(tdata->cpu >= 0) {
+            memset(&set, 0, set_sz);
+            CPU_SET(tdata->cpu, &set);
+            pthread_attr_setaffinity_np(&attr, set_sz, &set);
+            pin = &attr;
+        }
 #endif
-        if(pthread_create(&server->threads[i], NULL, epoll_loop, (void *)tdata) != 0) {
+        if(pthread_create(&server->threads[i], pin, epoll_loop, (void *)tdata) != 0 &&
+                (pin == NULL || pthread_create(&server->threads[i], NULL, epoll_loop, (void *)tdata) != 0)) {
             perror("pthread_create");
             goto new_server_free;
         }
     }
+#ifdef UVB_CPU_STEERING
+    steer_by_cpu(first_fd, cpus, nthreads);
+#else
+    (void)first_fd;
+#endif
+    free(cpus);
     goto new_server_return;
 
 new_server_free:
+    free(cpus);
     free(server->threads);
     free(server);
     server = NULL;
@@ -406,6 +1193,7 @@ void server_wait(server_t *server) {
 int main(int argc, char *argv[]) {
     char *port = "8000";
     size_t threads = 8;
+    placement_t placement = PLACE_COMPACT;
     if(argc > 1) {
         port = argv[1];
     }
@@ -417,8 +1205,12 @@ int main(int argc, char *argv[]) {
             return -1;
         }
     }
+    if(argc > 3 && placement_parse(argv[3], &placement) == -1) {
+        fprintf(stderr, "Unknown placement %s, use compact, spread, linear or none\n", argv[3]);
+        return -1;
+    }
     signal(SIGPIPE, SIG_IGN);
-    printf("Starting UVB Server on port %s with %lu threads\n", port, threads);
-    server_t *server = new_server(threads, "0.0.0.0", port);
+    printf("Starting UVB Server on port %s with %lu threads placed %s\n", port, threads, placement_name(placement));
+    server_t *server = new_server(threads, "0.0.0.0", port, placement);
     server_wait(server);
 }
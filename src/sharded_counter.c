@@ -0,0 +1,344 @@
+/**
+ * File: sharded_counter.c
+ *
+ * A thread-safe hash table counter where every thread increments its own
+ * private shard. A hot key never bounces a cache line between cores, the
+ * shards are only merged when somebody reads the counters.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "counter.h"
+#include "server.h"
+
+#define atomic_load_relaxed(X) (atomic_load_explicit(X, memory_order_relaxed))
+#define atomic_load_acquire(X) (atomic_load_explicit(X, memory_order_acquire))
+#define atomic_store_relaxed(X, v) (atomic_store_explicit(X, v, memory_order_relaxed))
+#define atomic_store_release(X, v) (atomic_store_explicit(X, v, memory_order_release))
+
+/**
+ * A slot is empty until its count is non-zero. The key is written before the
+ * count is published so readers never see a half written key. others is what
+ * the rest of the shards had for the key at the last stats tick, written by
+ * the stats timer so counter_inc can return a total without reading them.
+ */
+struct hashslot {
+    _Atomic uint64_t count;
+    _Atomic uint64_t others;
+    char key[KEYSZ];
+};
+
+struct table {
+    size_t size;
+    size_t used;
+    struct hashslot *slots;
+};
+
+/**
+ * A single thread's table. Only the owning thread writes to it. Readers hold
+ * the lock so the owner can't free the slots out from under them when the
+ * table grows, the owner only takes it to do that.
+ */
+struct shard {
+    struct table tbl;
+    pthread_rwlock_t lock;
+    struct shard *next;
+} __attribute__((aligned(64)));
+
+struct counter {
+    _Atomic(struct shard *) shards;
+    rates_t *rates;
+};
+
+static const int size0 = 128;
+const char *counter_backend_name = "sharded";
+
+static __thread struct shard *local_shard = NULL;
+static __thread counter_t *local_counter = NULL;
+
+
+static int table_init(struct table *tbl, size_t size) {
+    if((tbl->slots = calloc(size, sizeof(struct hashslot))) == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    tbl->size = size;
+    tbl->used = 0;
+    return 0;
+}
+
+static struct hashslot *table_find(struct table *tbl, const char *key) {
+    for (size_t i = key_hash(key) % tbl->size;; i = (i + 1) % tbl->size) {
+        if (atomic_load_acquire(&tbl->slots[i].count) == 0) {
+            return NULL;
+        } else if (key_eq(key, tbl->slots[i].key)) {
+            return &tbl->slots[i];
+        }
+    }
+}
+
+static inline uint64_t table_get(struct table *tbl, const char *key) {
+    struct hashslot *slot = table_find(tbl, key);
+    return slot != NULL ? atomic_load_relaxed(&slot->count) : 0;
+}
+
+/**
+ * Add count to key and return its slot. Only ever called by the table's
+ * single writer so a plain load and store is enough, no locked instructions
+ * on the hot path. A new key is turned away with NULL rather than take the
+ * last empty slot, which is what ends every probe, so a table that couldn't
+ * grow stays usable for the keys it has.
+ */
+static struct hashslot *table_add(struct table *tbl, const char *key, uint64_t count) {
+    for (size_t i = key_hash(key) % tbl->size;; i = (i + 1) % tbl->size) {
+        uint64_t old = atomic_load_relaxed(&tbl->slots[i].count);
+        if (old == 0) {
+            if (tbl->used + 1 >= tbl->size) {
+                return NULL;
+            }
+            memcpy(tbl->slots[i].key, key, KEYSZ);
+            atomic_store_release(&tbl->slots[i].count, count);
+            tbl->used += 1;
+            return &tbl->slots[i];
+        } else if (key_eq(key, tbl->slots[i].key)) {
+            atomic_store_relaxed(&tbl->slots[i].count, old + count);
+            return &tbl->slots[i];
+        }
+    }
+}
+
+static int table_expand(struct table *tbl) {
+    struct table new;
+    if (table_init(&new, tbl->size * 2) == -1) {
+        return -1;
+    }
+    for (size_t i = 0; i < tbl->size; ++i) {
+        uint64_t count = atomic_load_relaxed(&tbl->slots[i].count);
+        if (count != 0) {
+            struct hashslot *slot = table_add(&new, tbl->slots[i].key, count);
+            atomic_store_relaxed(&slot->others, atomic_load_relaxed(&tbl->slots[i].others));
+        }
+    }
+    free(tbl->slots);
+    *tbl = new;
+    return 0;
+}
+
+static inline bool table_full(struct table *tbl) {
+    return tbl->used > (tbl->size * 8) / 10;
+}
+
+static void table_destroy(struct table *tbl) {
+    if (tbl != NULL) {
+        free(tbl->slots);
+        free(tbl);
+    }
+}
+
+
+counter_t *counter_init(const char *path, uint64_t threads) {
+    (void)path; (void)threads;
+    counter_t *c = NULL;
+    if((c = malloc(sizeof(counter_t))) == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    if((c->rates = rates_init()) == NULL) {
+        free(c);
+        return NULL;
+    }
+    atomic_init(&c->shards, NULL);
+    return c;
+}
+
+void counter_destroy(counter_t *c) {
+    struct shard *shard = atomic_load(&c->shards);
+    while(shard != NULL) {
+        struct shard *next = shard->next;
+        pthread_rwlock_destroy(&shard->lock);
+        free(shard->tbl.slots);
+        free(shard);
+        shard = next;
+    }
+    rates_destroy(c->rates);
+    free(c);
+}
+
+/**
+ * Get the calling thread's shard, creating and publishing it the first time
+ * a thread increments. Shards live as long as the counter so counts from
+ * threads that have exited are kept.
+ */
+static struct shard *shard_get(counter_t *c) {
+    if(local_counter == c) {
+        return local_shard;
+    }
+    struct shard *shard = NULL;
+    if((shard = aligned_alloc(64, sizeof(struct shard))) == NULL) {
+        perror("aligned_alloc");
+        return NULL;
+    }
+    if(table_init(&shard->tbl, size0) == -1) {
+        free(shard);
+        return NULL;
+    }
+    pthread_rwlock_init(&shard->lock, NULL);
+    shard->next = atomic_load(&c->shards);
+    while(!atomic_compare_exchange_weak(&c->shards, &shard->next, shard));
+
+    local_shard = shard;
+    local_counter = c;
+    return shard;
+}
+
+uint64_t counter_inc(counter_t *c, const char *key) {
+    char clean_key[KEYSZ] = { 0 };
+    key_clean(clean_key, key);
+
+    struct shard *shard = NULL;
+    if((shard = shard_get(c)) == NULL) {
+        return 0;
+    }
+    struct hashslot *slot = NULL;
+    if((slot = table_add(&shard->tbl, clean_key, 1)) == NULL) {
+        return 0;
+    }
+    uint64_t total = atomic_load_relaxed(&slot->count) + atomic_load_relaxed(&slot->others);
+    if(table_full(&shard->tbl)) {
+        pthread_rwlock_wrlock(&shard->lock);
+        table_expand(&shard->tbl);
+        pthread_rwlock_unlock(&shard->lock);
+    }
+    return total;
+}
+
+
+unsigned counter_tier(counter_t *c, uint64_t count) {
+    return rates_tier(c->rates, count);
+}
+
+uint64_t counter_get(counter_t *c, const char *key) {
+    char clean_key[KEYSZ] = { 0 };
+    key_clean(clean_key, key);
+
+    uint64_t total = 0;
+    for(struct shard *s = atomic_load(&c->shards); s != NULL; s = s->next) {
+        pthread_rwlock_rdlock(&s->lock);
+        total += table_get(&s->tbl, clean_key);
+        pthread_rwlock_unlock(&s->lock);
+    }
+    return total;
+}
+
+void counter_sync(counter_t *c) {
+    (void)c;
+}
+
+/**
+ * Lock every shard for reading. Locks are always taken in list order so two
+ * readers can never deadlock against each other or against a growing owner.
+ */
+static struct shard *shards_lock(counter_t *c) {
+    struct shard *head = atomic_load(&c->shards);
+    for(struct shard *s = head; s != NULL; s = s->next) {
+        pthread_rwlock_rdlock(&s->lock);
+    }
+    return head;
+}
+
+static void shards_unlock(struct shard *head) {
+    for(struct shard *s = head; s != NULL; s = s->next) {
+        pthread_rwlock_unlock(&s->lock);
+    }
+}
+
+/**
+ * Merge every shard into a single private table.
+ */
+static struct table *shards_merge(struct shard *head) {
+    struct table *merged = NULL;
+    if((merged = malloc(sizeof(struct table))) == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    if(table_init(merged, size0) == -1) {
+        free(merged);
+        return NULL;
+    }
+    for(struct shard *s = head; s != NULL; s = s->next) {
+        for(size_t i = 0; i < s->tbl.size; ++i) {
+            uint64_t count = atomic_load_acquire(&s->tbl.slots[i].count);
+            if(count == 0) {
+                continue;
+            }
+            if(table_add(merged, s->tbl.slots[i].key, count) == NULL ||
+                    (table_full(merged) && table_expand(merged) == -1)) {
+                free(merged->slots);
+                free(merged);
+                return NULL;
+            }
+        }
+    }
+    return merged;
+}
+
+void counter_dump(counter_t *c, buffer_t *output) {
+    struct shard *head = shards_lock(c);
+    struct table *merged = shards_merge(head);
+    shards_unlock(head);
+    if(merged == NULL) {
+        return;
+    }
+
+    uint64_t rps[RATE_WINDOWS];
+    for (size_t i = 0; i < merged->size; ++i) {
+        uint64_t count = atomic_load_relaxed(&merged->slots[i].count);
+        if (count == 0) {
+            continue;
+        }
+        const char *key = merged->slots[i].key;
+
+        rates_get(c->rates, key, rps);
+        counter_dump_line(output, key, count, rps);
+    }
+    table_destroy(merged);
+}
+
+/**
+ * Feed every shard's counts straight into the rates, they add up a key's
+ * counts from all shards themselves so nothing has to be merged. The totals
+ * they come up with are handed back to the shards for counter_inc.
+ */
+int counter_gen_stats(void *data) {
+    counter_t *c = data;
+    int ret = 0;
+    struct shard *head = shards_lock(c);
+    for(struct shard *s = head; s != NULL && ret == 0; s = s->next) {
+        for(size_t i = 0; i < s->tbl.size && ret == 0; ++i) {
+            uint64_t count = atomic_load_acquire(&s->tbl.slots[i].count);
+            if(count != 0) {
+                ret = rates_add(c->rates, s->tbl.slots[i].key, count);
+            }
+        }
+    }
+    if(ret == 0) {
+        rates_tick(c->rates);
+        for(struct shard *s = head; s != NULL; s = s->next) {
+            for(size_t i = 0; i < s->tbl.size; ++i) {
+                struct hashslot *slot = &s->tbl.slots[i];
+                uint64_t count = atomic_load_acquire(&slot->count);
+                if(count != 0) {
+                    uint64_t total = rates_count(c->rates, slot->key);
+                    atomic_store_relaxed(&slot->others, total > count ? total - count : 0);
+                }
+            }
+        }
+    }
+    shards_unlock(head);
+    return ret;
+}
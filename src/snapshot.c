@@ -0,0 +1,328 @@
+#define _GNU_SOURCE
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Slots sit where the backend's hash put them, so the version goes up
+ * whenever that changes. 2 since key_hash.
+ */
+#define SNAPSHOT_MAGIC "UVBSNAP2"
+
+/**
+ * The slots follow right after, 64 bytes in so they're as aligned as the
+ * backend's own allocations would be.
+ */
+struct snapshot_header {
+    char magic[8];
+    char backend[16];
+    uint64_t slot_size;
+    uint64_t nslots;
+    uint64_t used;
+    uint64_t checksum;
+    uint64_t reserved;
+};
+
+_Static_assert(sizeof(struct snapshot_header) == 64, "snapshot header must stay 64 bytes");
+
+struct snapshot {
+    char *path;
+    char *tmp_path;
+    char backend[16];
+    size_t slot_size;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool busy; // a buffer is handed out or being written
+    bool pending; // the buffer is ready to be written
+    bool stop;
+    int result;
+    void *buf;
+    size_t nslots;
+    size_t used;
+};
+
+
+/**
+ * Eight bytes at a time, slots are always a multiple of that. Not meant to
+ * stand up to anyone, just to catch a torn or damaged file.
+ */
+static uint64_t checksum(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ len;
+    for(; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    for(; len > 0; p++, len--) {
+        h = (h ^ *p) * 0xc4ceb9fe1a85ec53ULL;
+    }
+    return h;
+}
+
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while(len > 0) {
+        ssize_t n = write(fd, p, len);
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+/**
+ * Sync the directory path is in so a rename into it sticks
+ */
+static int sync_dir(const char *path) {
+    char dir[4096];
+    const char *slash = strrchr(path, '/');
+    if(slash == NULL) {
+        strcpy(dir, ".");
+    } else {
+        size_t len = slash == path ? 1 : (size_t)(slash - path);
+        if(len >= sizeof(dir)) {
+            return -1;
+        }
+        memcpy(dir, path, len);
+        dir[len] = '\0';
+    }
+    int fd = -1;
+    if((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        perror("open");
+        return -1;
+    }
+    int ret = fsync(fd);
+    if(ret == -1) {
+        perror("fsync");
+    }
+    close(fd);
+    return ret;
+}
+
+
+static int snapshot_write(snapshot_t *snap) {
+    struct snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    memcpy(header.backend, snap->backend, sizeof(header.backend));
+    header.slot_size = snap->slot_size;
+    header.nslots = snap->nslots;
+    header.used = snap->used;
+    header.checksum = checksum(snap->buf, snap->nslots * snap->slot_size);
+
+    int fd = -1;
+    if((fd = open(snap->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0664)) == -1) {
+        perror("open");
+        return -1;
+    }
+    if(write_all(fd, &header, sizeof(header)) == -1 ||
+            write_all(fd, snap->buf, snap->nslots * snap->slot_size) == -1 ||
+            fsync(fd) == -1) {
+        perror("snapshot");
+        close(fd);
+        unlink(snap->tmp_path);
+        return -1;
+    }
+    close(fd);
+    if(rename(snap->tmp_path, snap->path) == -1) {
+        perror("rename");
+        unlink(snap->tmp_path);
+        return -1;
+    }
+    return sync_dir(snap->path);
+}
+
+
+static void *snapshot_writer(void *data) {
+    snapshot_t *snap = data;
+    pthread_mutex_lock(&snap->lock);
+    while(true) {
+        while(!snap->pending && !snap->stop) {
+            pthread_cond_wait(&snap->cond, &snap->lock);
+        }
+        if(!snap->pending) {
+            break;
+        }
+        pthread_mutex_unlock(&snap->lock);
+        int result = snapshot_write(snap);
+        pthread_mutex_lock(&snap->lock);
+        free(snap->buf);
+        snap->buf = NULL;
+        snap->result = result;
+        snap->pending = false;
+        snap->busy = false;
+        pthread_cond_broadcast(&snap->cond);
+    }
+    pthread_mutex_unlock(&snap->lock);
+    return NULL;
+}
+
+
+snapshot_t *snapshot_init(const char *path, const char *backend, size_t slot_size) {
+    snapshot_t *snap = NULL;
+    if((snap = calloc(1, sizeof(snapshot_t))) == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    if((snap->path = strdup(path)) == NULL || asprintf(&snap->tmp_path, "%s.tmp", path) == -1) {
+        perror("strdup");
+        free(snap->path);
+        free(snap);
+        return NULL;
+    }
+    strncpy(snap->backend, backend, sizeof(snap->backend) - 1);
+    snap->slot_size = slot_size;
+    pthread_mutex_init(&snap->lock, NULL);
+    pthread_cond_init(&snap->cond, NULL);
+    if(pthread_create(&snap->writer, NULL, snapshot_writer, snap) != 0) {
+        perror("pthread_create");
+        pthread_cond_destroy(&snap->cond);
+        pthread_mutex_destroy(&snap->lock);
+        free(snap->tmp_path);
+        free(snap->path);
+        free(snap);
+        return NULL;
+    }
+    return snap;
+}
+
+
+void snapshot_destroy(snapshot_t *snap) {
+    if(snap == NULL) {
+        return;
+    }
+    snapshot_wait(snap);
+    pthread_mutex_lock(&snap->lock);
+    snap->stop = true;
+    pthread_cond_broadcast(&snap->cond);
+    pthread_mutex_unlock(&snap->lock);
+    pthread_join(snap->writer, NULL);
+    pthread_cond_destroy(&snap->cond);
+    pthread_mutex_destroy(&snap->lock);
+    free(snap->tmp_path);
+    free(snap->path);
+    free(snap);
+}
+
+
+void *snapshot_begin(snapshot_t *snap, size_t nslots) {
+    pthread_mutex_lock(&snap->lock);
+    if(snap->busy) {
+        pthread_mutex_unlock(&snap->lock);
+        return NULL;
+    }
+    if((snap->buf = malloc(nslots * snap->slot_size)) == NULL) {
+        perror("malloc");
+        pthread_mutex_unlock(&snap->lock);
+        return NULL;
+    }
+    snap->nslots = nslots;
+    snap->busy = true;
+    pthread_mutex_unlock(&snap->lock);
+    return snap->buf;
+}
+
+
+void snapshot_commit(snapshot_t *snap, size_t used) {
+    pthread_mutex_lock(&snap->lock);
+    snap->used = used;
+    snap->pending = true;
+    pthread_cond_broadcast(&snap->cond);
+    pthread_mutex_unlock(&snap->lock);
+}
+
+
+void snapshot_abort(snapshot_t *snap) {
+    pthread_mutex_lock(&snap->lock);
+    free(snap->buf);
+    snap->buf = NULL;
+    snap->busy = false;
+    pthread_cond_broadcast(&snap->cond);
+    pthread_mutex_unlock(&snap->lock);
+}
+
+
+int snapshot_wait(snapshot_t *snap) {
+    pthread_mutex_lock(&snap->lock);
+    while(snap->busy) {
+        pthread_cond_wait(&snap->cond, &snap->lock);
+    }
+    int result = snap->result;
+    pthread_mutex_unlock(&snap->lock);
+    return result;
+}
+
+
+void *snapshot_load(const char *path, const char *backend, size_t slot_size, size_t *nslots, size_t *used) {
+    int fd = -1;
+    if((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+        if(errno != ENOENT) {
+            perror("open");
+        }
+        return NULL;
+    }
+    struct stat st;
+    if(fstat(fd, &st) == -1) {
+        perror("fstat");
+        close(fd);
+        return NULL;
+    }
+    if((size_t)st.st_size < sizeof(struct snapshot_header)) {
+        fprintf(stderr, "snapshot: %s is too short\n", path);
+        close(fd);
+        return NULL;
+    }
+    char *map = NULL;
+    if((map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE, fd, 0)) == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return NULL;
+    }
+    // The mapping keeps the file around, even once a newer one replaces it
+    close(fd);
+
+    struct snapshot_header *header = (struct snapshot_header *)map;
+    char name[16] = { 0 };
+    strncpy(name, backend, sizeof(name) - 1);
+    if(memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+            memcmp(header->backend, name, sizeof(name)) != 0 ||
+            header->slot_size != slot_size || header->nslots == 0 ||
+            header->used >= header->nslots ||
+            (size_t)st.st_size != sizeof(struct snapshot_header) + header->nslots * slot_size) {
+        fprintf(stderr, "snapshot: %s isn't a %s snapshot\n", path, backend);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    char *slots = map + sizeof(struct snapshot_header);
+    if(checksum(slots, header->nslots * slot_size) != header->checksum) {
+        fprintf(stderr, "snapshot: %s is damaged\n", path);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    *nslots = header->nslots;
+    *used = header->used;
+    return slots;
+}
+
+
+void snapshot_unmap(void *slots, size_t nslots, size_t slot_size) {
+    munmap((char *)slots - sizeof(struct snapshot_header), sizeof(struct snapshot_header) + nslots * slot_size);
+}
@@ -0,0 +1,125 @@
+#include "status.h"
+#include <stdio.h>
+#include <string.h>
+#include "buffer.h"
+#include "epoch.h"
+
+
+static const char header_page1[] = "--- Ultimate Victory Battle (v4.0.0) ---\n"
+                                   " Rules: \n"
+                                   "  - Increment your counter higher/faster than everyone else\n"
+                                   "  - GET /<name> Increments your counter, replies with it and your rank tier\n"
+                                   "  - GET / Displays this page\n"
+                                   "  - Rates are req/s over the last " RATE_WINDOW_NAMES "\n"
+                                   " Source: http://github.com/rossdylan/uvb-server\n"
+                                   " Backend: ";
+static const char header_page2[] = "\n----------------------------------------\n\n";
+static const char http_header[] = "HTTP/1.1 200 OK\r\n"
+                                  "Content-Type: text/plain\r\n"
+                                  "Content-Length: ";
+static uint64_t header_size1 = (sizeof(header_page1)/sizeof(header_page1[0])) - 1;
+static uint64_t header_size2 = (sizeof(header_page2)/sizeof(header_page2[0])) - 1;
+static uint64_t http_header_size = (sizeof(http_header)/sizeof(http_header[0])) - 1;
+
+static _Atomic(status_page_t *) current_page;
+
+/**
+ * Pages that have been replaced. A worker may have loaded a page's pointer
+ * just before it was swapped out and not yet taken its reference, so the
+ * initial reference is only dropped once every worker has been quiescent
+ * since. Only touched by the timer thread.
+ */
+static status_page_t *replaced_pages = NULL;
+
+/**
+ * Scratch space for rendering the body, reused between updates.
+ */
+static buffer_t body;
+
+
+static status_page_t *status_render(counter_t *counter) {
+    buffer_fast_clear(&body);
+    buffer_append(&body, header_page1, header_size1);
+    buffer_append(&body, counter_backend_name, strlen(counter_backend_name));
+    buffer_append(&body, header_page2, header_size2);
+    counter_dump(counter, &body);
+
+    char length[20];
+    size_t length_size = u64toa(buffer_length(&body), length);
+    size_t len = http_header_size + length_size + 4 + buffer_length(&body);
+
+    status_page_t *page = NULL;
+    if((page = malloc(sizeof(status_page_t) + len)) == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    atomic_init(&page->refs, 1);
+    page->replaced = NULL;
+    page->retired = 0;
+    page->len = len;
+
+    char *p = page->data;
+    memcpy(p, http_header, http_header_size);
+    p += http_header_size;
+    memcpy(p, length, length_size);
+    p += length_size;
+    memcpy(p, "\r\n\r\n", 4);
+    p += 4;
+    memcpy(p, body.buffer, buffer_length(&body));
+    return page;
+}
+
+
+static int status_publish(counter_t *counter) {
+    status_page_t *page = NULL;
+    if((page = status_render(counter)) == NULL) {
+        return -1;
+    }
+    status_page_t *old = NULL;
+    if((old = atomic_exchange(&current_page, page)) != NULL) {
+        old->retired = epoch_retire();
+        old->replaced = replaced_pages;
+        replaced_pages = old;
+    }
+    for(status_page_t **p = &replaced_pages; *p != NULL;) {
+        status_page_t *replaced = *p;
+        if(epoch_passed(replaced->retired)) {
+            *p = replaced->replaced;
+            status_release(replaced);
+        } else {
+            p = &replaced->replaced;
+        }
+    }
+    return 0;
+}
+
+
+int status_init(counter_t *counter) {
+    if(buffer_init(&body) == -1) {
+        return -1;
+    }
+    return status_publish(counter);
+}
+
+
+int status_update(void *data) {
+    counter_t *counter = data;
+    if(counter_gen_stats(counter) < 0) {
+        return -1;
+    }
+    return status_publish(counter);
+}
+
+
+status_page_t *status_acquire(void) {
+    status_page_t *page = atomic_load_explicit(&current_page, memory_order_acquire);
+    atomic_fetch_add_explicit(&page->refs, 1, memory_order_relaxed);
+    return page;
+}
+
+
+void status_release(status_page_t *page) {
+    if(atomic_fetch_sub_explicit(&page->refs, 1, memory_order_acq_rel) == 1) {
+        free(page);
+    }
+}
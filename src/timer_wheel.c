@@ -0,0 +1,205 @@
+#include "timer_wheel.h"
+#include <string.h>
+#include <time.h>
+
+
+void uvbloop_timer_init(uvbloop_timer_t *timer, uvbloop_timer_cb cb, void *data) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->cb = cb;
+    timer->data = data;
+}
+
+
+void uvbloop_timer_stop(uvbloop_timer_t *timer) {
+    if(timer->pprev == NULL) {
+        return;
+    }
+    *timer->pprev = timer->next;
+    if(timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+
+bool uvbloop_timer_active(const uvbloop_timer_t *timer) {
+    return timer->pprev != NULL;
+}
+
+
+void wheel_update(timer_wheel_t *wheel) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    wheel->now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+void wheel_init(timer_wheel_t *wheel) {
+    memset(wheel, 0, sizeof(timer_wheel_t));
+    wheel_update(wheel);
+    wheel->tick = wheel->now >> WHEEL_TICK_SHIFT;
+}
+
+
+static inline void slot_push(uvbloop_timer_t **slot, uvbloop_timer_t *timer) {
+    timer->next = *slot;
+    if(timer->next != NULL) {
+        timer->next->pprev = &timer->next;
+    }
+    *slot = timer;
+    timer->pprev = slot;
+}
+
+
+/**
+ * Put an unlinked timer into the slot its expiry falls in, relative to the
+ * tick the wheel is at.
+ */
+static void wheel_insert(timer_wheel_t *wheel, uvbloop_timer_t *timer) {
+    // Anything that's already due goes out with the next tick that's run
+    if(timer->expires < wheel->tick) {
+        timer->expires = wheel->tick;
+    }
+    uint64_t delta = timer->expires - wheel->tick;
+    uint64_t expires = timer->expires;
+    if(delta >= WHEEL_RANGE) {
+        delta = WHEEL_RANGE - 1;
+        expires = wheel->tick + delta;
+    }
+    int level = 0;
+    while(delta >= (1ULL << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    size_t idx = (expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    slot_push(&wheel->slots[level][idx], timer);
+    wheel->occupied[level] |= 1ULL << idx;
+}
+
+
+void wheel_start(timer_wheel_t *wheel, uvbloop_timer_t *timer, uint64_t usecs) {
+    uvbloop_timer_stop(timer);
+    // Round up, a timer may fire late but never early
+    uint64_t deadline = wheel->now + usecs * 1000;
+    timer->expires = (deadline + (1ULL << WHEEL_TICK_SHIFT) - 1) >> WHEEL_TICK_SHIFT;
+    wheel_insert(wheel, timer);
+}
+
+
+/**
+ * Take every timer out of a slot. The first one's pprev is pointed at head
+ * so timers can still be stopped while they sit in the detached list.
+ */
+static void slot_take(timer_wheel_t *wheel, int level, size_t idx, uvbloop_timer_t **head) {
+    *head = wheel->slots[level][idx];
+    wheel->slots[level][idx] = NULL;
+    wheel->occupied[level] &= ~(1ULL << idx);
+    if(*head != NULL) {
+        (*head)->pprev = head;
+    }
+}
+
+
+/**
+ * Move the slot of level that the wheel just reached into the levels below.
+ * Higher levels go first so nothing lands in a slot that was already
+ * cascaded.
+ */
+static void wheel_cascade(timer_wheel_t *wheel, int level) {
+    size_t idx = (wheel->tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    if(idx == 0 && level + 1 < WHEEL_LEVELS) {
+        wheel_cascade(wheel, level + 1);
+    }
+    uvbloop_timer_t *head = NULL;
+    slot_take(wheel, level, idx, &head);
+    while(head != NULL) {
+        uvbloop_timer_t *timer = head;
+        uvbloop_timer_stop(timer);
+        wheel_insert(wheel, timer);
+    }
+}
+
+
+int64_t wheel_timeout(timer_wheel_t *wheel) {
+    uint64_t next = UINT64_MAX;
+    for(int level = 0; level < WHEEL_LEVELS; level++) {
+        int shift = WHEEL_BITS * level;
+        size_t cur = (wheel->tick >> shift) & (WHEEL_SLOTS - 1);
+        while(wheel->occupied[level] != 0) {
+            uint64_t occupied = wheel->occupied[level];
+            // Rotate so bit n is the slot n slots ahead of the current one
+            uint64_t ahead = cur == 0 ? occupied : (occupied >> cur) | (occupied << (WHEEL_SLOTS - cur));
+            uint64_t dist = 0;
+            if(level == 0) {
+                dist = __builtin_ctzll(ahead);
+            } else {
+                // The current slot of an upper level was cascaded when the
+                // wheel got there, whatever is in it now is a full turn out.
+                dist = (ahead & ~1ULL) != 0 ? (uint64_t)__builtin_ctzll(ahead & ~1ULL) : WHEEL_SLOTS;
+            }
+            size_t idx = (cur + dist) & (WHEEL_SLOTS - 1);
+            if(wheel->slots[level][idx] == NULL) {
+                wheel->occupied[level] &= ~(1ULL << idx);
+                continue;
+            }
+            uint64_t tick = level == 0 ? wheel->tick + dist : ((wheel->tick >> shift) + dist) << shift;
+            if(tick < next) {
+                next = tick;
+            }
+            break;
+        }
+    }
+    if(next == UINT64_MAX) {
+        return -1;
+    }
+    uint64_t at = next << WHEEL_TICK_SHIFT;
+    return at > wheel->now ? (int64_t)(at - wheel->now) : 0;
+}
+
+
+static inline bool wheel_empty(timer_wheel_t *wheel) {
+    for(int level = 0; level < WHEEL_LEVELS; level++) {
+        if(wheel->occupied[level] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+int wheel_expire(timer_wheel_t *wheel, uvbloop_t *loop) {
+    uint64_t now_tick = wheel->now >> WHEEL_TICK_SHIFT;
+    int fired = 0;
+    while(wheel->tick <= now_tick) {
+        size_t idx = wheel->tick & (WHEEL_SLOTS - 1);
+        if(wheel_empty(wheel)) {
+            wheel->tick = now_tick + 1;
+            break;
+        }
+        if(idx == 0) {
+            wheel_cascade(wheel, 1);
+        }
+        else if((wheel->occupied[0] >> idx) == 0) {
+            // Nothing left in this turn of level 0, skip to the next
+            // cascade or to now, whichever comes first.
+            uint64_t turn = (wheel->tick | (WHEEL_SLOTS - 1)) + 1;
+            wheel->tick = turn <= now_tick ? turn : now_tick + 1;
+            continue;
+        }
+
+        uvbloop_timer_t *head = NULL;
+        slot_take(wheel, 0, idx, &head);
+        // Timers started from a callback must not land in the slot that's
+        // being run
+        wheel->tick++;
+        while(head != NULL) {
+            uvbloop_timer_t *timer = head;
+            uvbloop_timer_stop(timer);
+            timer->cb(loop, timer);
+            fired++;
+        }
+    }
+    return fired;
+}
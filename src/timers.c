@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <time.h>
 #include <stdbool.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include "uvbloop.h"
 
@@ -10,6 +11,53 @@
 #define MAXEVENTS 64
 
 
+/**
+ * Run an entry and arm it for its next period. The next period is counted
+ * from when this one was due so slow callbacks don't make the timer drift.
+ */
+static void timer_fire(uvbloop_t *loop, uvbloop_timer_t *timer) {
+    timer_entry_t *entry = timer->data;
+    uint64_t now = uvbloop_now(loop);
+    if(entry->func(entry->data) < 0) {
+        perror("timer()");
+    }
+    uint64_t period = entry->msecs * 1000000;
+    entry->due += period;
+    if(entry->due <= now) {
+        entry->due = now + period;
+    }
+    uvbloop_timer_start(loop, timer, (entry->due - now) / 1000);
+}
+
+
+/**
+ * Arm the entries that were registered and drop the ones that were
+ * cancelled since the last time the timer thread was poked.
+ */
+static void timer_sync(timer_mgr_t *t) {
+    char buf[64];
+    while(read(t->wake[0], buf, sizeof(buf)) > 0);
+
+    uint64_t now = uvbloop_now(t->loop);
+    pthread_mutex_lock(&t->mutex);
+    struct rd_list_node *cur = t->funcs.head;
+    while(cur != NULL) {
+        timer_entry_t *entry = RD_LIST_ENTRY(cur, timer_entry_t);
+        cur = cur->next;
+        if(entry->cancelled) {
+            uvbloop_timer_stop(&entry->timer);
+            rd_list_unlink(&t->funcs, &entry->list);
+            free(entry);
+        }
+        else if(!uvbloop_timer_active(&entry->timer)) {
+            entry->due = now + entry->msecs * 1000000;
+            uvbloop_timer_start(t->loop, &entry->timer, entry->msecs * 1000);
+        }
+    }
+    pthread_mutex_unlock(&t->mutex);
+}
+
+
 void *timer_loop(void *ptr) {
     uvbloop_event_t *events;
     if((events = calloc(MAXEVENTS, sizeof(uvbloop_event_t))) == NULL) {
@@ -18,29 +66,71 @@ void *timer_loop(void *ptr) {
     }
     timer_mgr_t *p = (timer_mgr_t *)ptr;
     int waiting;
-    timer_entry_t *entry = NULL;
+    // Completion backends only take submissions from the thread that set
+    // the loop up, so that has to happen here.
+    if((p->loop = uvbloop_init(NULL)) == NULL) {
+        perror("uvbloop_init");
+        return NULL;
+    }
+    if(uvbloop_register_fd(p->loop, p->wake[0], (void *)p, UVBLOOP_R) == -1) {
+        perror("uvbloop_register_fd");
+        return NULL;
+    }
     while(true) {
+        // Timers run from within uvbloop_wait, all we get back are pokes
         waiting = uvbloop_wait(p->loop, events, MAXEVENTS);
-        if(waiting > 0) {
-            for(int i=0; i<waiting; i++) {
-                entry = (timer_entry_t *)uvbloop_event_data(&events[i]);
-                uvbloop_reset_timer(p->loop, entry->id);
-                if(entry->func(entry->data) < 0) {
-                    perror("timer()");
-                }
+        for(int i=0; i<waiting; i++) {
+            if(uvbloop_event_data(&events[i]) == p) {
+                timer_sync(p);
             }
         }
+    }
+}
+
 
+/**
+ * Wake the timer thread up so it picks up changes to the list
+ */
+static void timer_poke(timer_mgr_t *t) {
+    if(write(t->wake[1], "", 1) == -1) {
+        // The pipe being full means a poke is pending anyway
     }
 }
 
 
+/**
+ * A non-blocking, close-on-exec pipe. Without pipe2 the flags are set one
+ * end at a time.
+ */
+static int wake_pipe(int fds[2]) {
+#ifdef __APPLE__
+    if(pipe(fds) == -1) {
+        return -1;
+    }
+    for(int i = 0; i < 2; i++) {
+        int flags;
+        if((flags = fcntl(fds[i], F_GETFL, 0)) == -1 ||
+                fcntl(fds[i], F_SETFL, flags | O_NONBLOCK) == -1 ||
+                fcntl(fds[i], F_SETFD, FD_CLOEXEC) == -1) {
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
+    }
+    return 0;
+#else
+    return pipe2(fds, O_NONBLOCK | O_CLOEXEC);
+#endif
+}
+
+
 int timer_mgr_init(timer_mgr_t *t) {
     pthread_mutex_init(&t->mutex, NULL);
     t->loop = NULL;
+    t->next_id = 0;
     RD_LIST_INIT(&t->funcs);
-    if((t->loop = uvbloop_init(NULL)) == NULL) {
-        perror("uvbloop_init");
+    if(wake_pipe(t->wake) == -1) {
+        perror("pipe");
         return -1;
     }
     if(pthread_create(&t->thread, NULL, timer_loop, (void *)t) != 0) {
@@ -49,56 +139,46 @@ int timer_mgr_init(timer_mgr_t *t) {
     }
     return 0;
 }
-static int32_t timer_id_filter(struct rd_list_node *node, void *cmpdata) {
-    int id= *(int *)cmpdata;
-    timer_entry_t *entry = RD_LIST_ENTRY(node, timer_entry_t);
-    if(entry->id == id) {
-        return 1;
-    }
-    return 0;
-}
 
 
-int register_timer(timer_mgr_t *t, timer_func_t func, uint64_t secs, void *data) {
-    int ret = 0;
-
+int register_timer(timer_mgr_t *t, timer_func_t func, uint64_t msecs, void *data) {
     timer_entry_t *entry = NULL;
-    // set up the server sockets epoll event data
     if((entry = calloc(1, sizeof(timer_entry_t))) == NULL) {
-        perror("malloc");
-        goto register_timer_error;
+        perror("calloc");
+        return -1;
     }
 
     entry->func = func;
-    entry->secs= secs;
+    entry->msecs = msecs;
     entry->data = data;
+    entry->cancelled = false;
+    uvbloop_timer_init(&entry->timer, timer_fire, entry);
 
     pthread_mutex_lock(&t->mutex);
+    int id = entry->id = t->next_id++;
     rd_list_append(&t->funcs, &entry->list);
     pthread_mutex_unlock(&t->mutex);
 
-    if((entry->id = uvbloop_register_timer(t->loop, secs, entry)) == -1) {
-        perror("uvbloop_register_timer");
-        goto register_timer_error;
-    }
-    ret = entry->id;
-    goto register_timer_ret;
-register_timer_error:
-    free(entry);
-    ret = -1;
-register_timer_ret:
-    return ret;
+    timer_poke(t);
+    return id;
 }
 
 
 int unregister_timer(timer_mgr_t *t, int id) {
+    int ret = -1;
+    timer_entry_t *entry = NULL;
     pthread_mutex_lock(&t->mutex);
-    struct rd_list_node *node = rd_list_remove_by_func(&t->funcs, timer_id_filter, &id);
+    RD_LIST_FOREACH(&t->funcs, entry, timer_entry_t)
+        if(entry->id == id && !entry->cancelled) {
+            entry->cancelled = true;
+            ret = 0;
+            break;
+        }
+    }
     pthread_mutex_unlock(&t->mutex);
-    if(node == NULL) {
-        return -1;
+    if(ret == 0) {
+        // The timer thread owns the wheel, it unlinks and frees the entry
+        timer_poke(t);
     }
-    timer_entry_t *entry = RD_LIST_ENTRY(node, timer_entry_t);
-    free(entry);
-    return 0;
+    return ret;
 }
@@ -3,6 +3,9 @@
  *
  * A thread-safe hash table counter implementation, written with
  * transactional memory
+ *
+ * Every SNAPSHOT_TICKS stats runs the table is copied out to a snapshot at
+ * path, and counter_init maps the last one back in.
  */
 
 #define _GNU_SOURCE
@@ -12,8 +15,13 @@
 #include <stdbool.h>
 #include "counter.h"
 #include "server.h"
+#include "snapshot.h"
 
-static const unsigned char zero_key[KEYSZ] = { 0 };
+/**
+ * Slots copied per transaction when taking a snapshot, so incrementing
+ * threads are never held up for long
+ */
+#define SNAPSHOT_CHUNK 4096
 
 struct hashslot {
     unsigned char key[KEYSZ];
@@ -24,61 +32,80 @@ struct counter {
     size_t size;
     size_t used;
     struct hashslot *slots;
-    struct counter *prev, *prev2;
+    rates_t *rates;
+    bool mapped; // slots come from snapshot_load
+    snapshot_t *snap;
+    uint64_t ticks;
 };
 
 static const int size0 = 128;
 const char *counter_backend_name = "tm";
 
+static void slots_free(counter_t *tbl) {
+    if (tbl->mapped) {
+        snapshot_unmap(tbl->slots, tbl->size, sizeof(struct hashslot));
+    } else {
+        free(tbl->slots);
+    }
+}
+
 counter_t *counter_init(const char *path, uint64_t threads) {
-    (void)path; (void)threads;
+    (void)threads;
     struct counter *tbl = malloc(sizeof(struct counter));
-    tbl->size = size0;
-    tbl->slots = calloc(size0, sizeof(struct hashslot));
-    tbl->used = 0;
-    tbl->prev = tbl->prev2 = NULL;
+    if (tbl == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    tbl->slots = snapshot_load(path, counter_backend_name, sizeof(struct hashslot), &tbl->size, &tbl->used);
+    tbl->mapped = tbl->slots != NULL;
+    if (!tbl->mapped) {
+        tbl->size = size0;
+        tbl->used = 0;
+        if ((tbl->slots = calloc(size0, sizeof(struct hashslot))) == NULL) {
+            perror("calloc");
+            free(tbl);
+            return NULL;
+        }
+    }
+    if ((tbl->rates = rates_init()) == NULL) {
+        slots_free(tbl);
+        free(tbl);
+        return NULL;
+    }
+    if ((tbl->snap = snapshot_init(path, counter_backend_name, sizeof(struct hashslot))) == NULL) {
+        rates_destroy(tbl->rates);
+        slots_free(tbl);
+        free(tbl);
+        return NULL;
+    }
+    tbl->ticks = 0;
     return tbl;
 }
 
-/* djb2 hash
- */
-size_t hash(const unsigned char *key) {
-    size_t hash = 5381;
-
-    int c;
-    while ((c = *key++)) {
-        hash = (hash * 33) ^ c;
-    }
-    return hash;
-}
+static void counter_snapshot(counter_t *tbl);
 
 void counter_destroy(counter_t *tbl) {
     if (tbl != NULL) {
-        free(tbl->slots);
+        snapshot_wait(tbl->snap);
+        counter_snapshot(tbl);
+        snapshot_destroy(tbl->snap);
+        rates_destroy(tbl->rates);
+        slots_free(tbl);
         free(tbl);
     }
 }
 
-counter_t *counter_copy(counter_t *tbl) {
-    counter_t *tbl1 = malloc(sizeof(counter_t));
-    tbl1->size = tbl->size;
-    tbl1->used = tbl->used;
-    tbl1->slots = malloc(tbl1->size * sizeof(struct hashslot));
-    memcpy(tbl1->slots, tbl->slots, tbl1->size * sizeof(struct hashslot));
-    return tbl1;
-}
-
 static void table_expand(counter_t *tbl);
 
 static inline uint64_t key_incr0(counter_t *tbl,
                                  const unsigned char *key,
                                  uint64_t count) {
-    for (size_t i = hash(key) % tbl->size;; i = (i + 1) % tbl->size) {
-        if (memcmp(key, &tbl->slots[i].key, KEYSZ) == 0) {
+    for (size_t i = key_hash(key) % tbl->size;; i = (i + 1) % tbl->size) {
+        if (key_eq(key, tbl->slots[i].key)) {
             uint64_t old = tbl->slots[i].count;
             tbl->slots[i].count += count;
             return old;
-        } else if (memcmp(zero_key, &tbl->slots[i].key, KEYSZ) == 0) {
+        } else if (key_empty(tbl->slots[i].key)) {
             memcpy(&tbl->slots[i].key, key, KEYSZ);
             tbl->slots[i].count = count;
             tbl->used += 1;
@@ -105,18 +132,22 @@ static void table_expand(counter_t *tbl) {
     tbl->slots = calloc(tbl->size, sizeof(struct hashslot));
 
     for (size_t i = 0; i < oldsize; ++i) {
-        if (memcmp(oldslots[i].key, zero_key, KEYSZ) != 0) {
+        if (!key_empty(oldslots[i].key)) {
             key_incr0(tbl, oldslots[i].key, oldslots[i].count);
         }
     }
+    if (tbl->mapped) {
+        snapshot_unmap(oldslots, oldsize, sizeof(struct hashslot));
+        tbl->mapped = false;
+    }
 }
 
 static inline uint64_t key_get(counter_t *tbl,
                                const unsigned char *key) {
-    for (size_t i = hash(key) % tbl->size;; i = (i + 1) % tbl->size) {
-        if (memcmp(key, &tbl->slots[i].key, KEYSZ) == 0) {
+    for (size_t i = key_hash(key) % tbl->size;; i = (i + 1) % tbl->size) {
+        if (key_eq(key, tbl->slots[i].key)) {
             return tbl->slots[i].count;
-        } else if (memcmp(zero_key, &tbl->slots[i].key, KEYSZ) == 0) {
+        } else if (key_empty(tbl->slots[i].key)) {
             return 0;
         }
     }
@@ -124,16 +155,20 @@ static inline uint64_t key_get(counter_t *tbl,
 
 uint64_t counter_inc(counter_t *tbl, const char *key) {
     unsigned char clean_key[KEYSZ] = { 0 }; // 15 characters + \0
-    key_clean(clean_key, key);
+    key_clean((char *)clean_key, key);
 
     __transaction_relaxed {
-        return key_incr(tbl, clean_key, 1);
+        return key_incr(tbl, clean_key, 1) + 1;
     }
 }
 
+unsigned counter_tier(counter_t *tbl, uint64_t count) {
+    return rates_tier(tbl->rates, count);
+}
+
 uint64_t counter_get(counter_t *tbl, const char *key) {
     unsigned char clean_key[KEYSZ] = { 0 };
-    key_clean(clean_key, key);
+    key_clean((char *)clean_key, key);
 
     __transaction_relaxed {
         return key_get(tbl, clean_key);
@@ -141,33 +176,100 @@ uint64_t counter_get(counter_t *tbl, const char *key) {
 }
 
 void counter_dump(counter_t *tbl, buffer_t *output) {
+    uint64_t rps[RATE_WINDOWS];
     __transaction_relaxed {
         for (size_t i = 0; i < tbl->size; ++i) {
-            if (memcmp(tbl->slots[i].key, zero_key, KEYSZ) != 0) {
-                char *str = NULL;
-
-                uint64_t prev = tbl->prev != NULL ? key_get(tbl->prev, tbl->slots[i].key) : 0;
-                uint64_t prev2 = tbl->prev2 != NULL ? key_get(tbl->prev2, tbl->slots[i].key) : 0;
-                uint64_t rate = (prev - prev2) / STATS_SECS;
-
-                size_t size = asprintf(&str, "%.*s: %lu - %lurps\n",
-                                       KEYSZ,
-                                       tbl->slots[i].key,
-                                       tbl->slots[i].count,
-                                       rate);
-                buffer_append(output, str, size);
-                free(str);
+            if (!key_empty(tbl->slots[i].key)) {
+                rates_get(tbl->rates, (const char *)tbl->slots[i].key, rps);
+                counter_dump_line(output, (const char *)tbl->slots[i].key,
+                                  tbl->slots[i].count, rps);
             }
         }
     }
 }
 
+static size_t slots_used(const struct hashslot *slots, size_t size) {
+    size_t used = 0;
+    for (size_t i = 0; i < size; ++i) {
+        if (!key_empty(slots[i].key)) {
+            used++;
+        }
+    }
+    return used;
+}
+
+/**
+ * The table's slots and size as of one transaction. This and snapshot_chunk
+ * stay out of line so their transactions' restart points don't clobber
+ * counter_snapshot's locals.
+ */
+static __attribute__((noinline)) struct hashslot *table_slots(counter_t *tbl, size_t *size) {
+    __transaction_relaxed {
+        *size = tbl->size;
+        return tbl->slots;
+    }
+}
+
+/**
+ * Copy slots [start, end) into buf in one transaction. False if the table
+ * isn't on slots any more.
+ */
+static __attribute__((noinline)) bool snapshot_chunk(counter_t *tbl, const struct hashslot *slots,
+                                                     struct hashslot *buf, size_t start, size_t end) {
+    __transaction_relaxed {
+        if (tbl->slots != slots) {
+            return false;
+        }
+        memcpy(&buf[start], &slots[start], (end - start) * sizeof(struct hashslot));
+        return true;
+    }
+}
+
+/**
+ * Copy the table out to the snapshot writer a chunk per transaction, unless
+ * the last snapshot is still being written. Each chunk is consistent in
+ * itself. If the table expands in between the copy is dropped, the next try
+ * gets it.
+ */
+static void counter_snapshot(counter_t *tbl) {
+    size_t size = 0;
+    struct hashslot *slots = table_slots(tbl, &size);
+    struct hashslot *buf = NULL;
+    if ((buf = snapshot_begin(tbl->snap, size)) == NULL) {
+        return;
+    }
+    for (size_t start = 0; start < size; start += SNAPSHOT_CHUNK) {
+        size_t end = start + SNAPSHOT_CHUNK < size ? start + SNAPSHOT_CHUNK : size;
+        if (!snapshot_chunk(tbl, slots, buf, start, end)) {
+            snapshot_abort(tbl->snap);
+            return;
+        }
+    }
+    snapshot_commit(tbl->snap, slots_used(buf, size));
+}
+
+void counter_sync(counter_t *tbl) {
+    snapshot_wait(tbl->snap);
+    counter_snapshot(tbl);
+    snapshot_wait(tbl->snap);
+}
+
 int counter_gen_stats(void *data) {
+    counter_t *tbl = data;
+    int ret = 0;
+    // Only the sampling has to see a consistent table, the rates are ours
     __transaction_relaxed {
-        counter_t *tbl = data;
-        counter_destroy(tbl->prev2);
-        tbl->prev2 = tbl->prev;
-        tbl->prev = counter_copy(tbl);
-        return 0;
+        for (size_t i = 0; i < tbl->size && ret == 0; ++i) {
+            if (!key_empty(tbl->slots[i].key)) {
+                ret = rates_add(tbl->rates, (const char *)tbl->slots[i].key, tbl->slots[i].count);
+            }
+        }
+    }
+    if (ret == 0) {
+        rates_tick(tbl->rates);
+        if (++tbl->ticks % SNAPSHOT_TICKS == 0) {
+            counter_snapshot(tbl);
+        }
     }
+    return ret;
 }
@@ -0,0 +1,243 @@
+#define _GNU_SOURCE
+#include "topology.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+#define SYSFS_CPU "/sys/devices/system/cpu"
+#define SYSFS_NODE "/sys/devices/system/node"
+#define TOPO_MAX_NODES 1024
+
+
+/**
+ * Read a single integer out of a sysfs file
+ */
+static int read_int(const char *path, int *value) {
+    FILE *f = NULL;
+    if((f = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    int ret = fscanf(f, "%d", value) == 1 ? 0 : -1;
+    fclose(f);
+    return ret;
+}
+
+
+/**
+ * Call fn for every cpu in a sysfs cpu list such as "0-3,8-11"
+ */
+static int read_cpulist(const char *path, void (*fn)(topology_t *, int, int), topology_t *topo, int arg) {
+    FILE *f = NULL;
+    char buf[4096];
+    if((f = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    if(fgets(buf, sizeof(buf), f) == NULL) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    char *cur = buf;
+    while(*cur != '\0' && *cur != '\n') {
+        char *end = NULL;
+        long first = strtol(cur, &end, 10);
+        if(end == cur) {
+            return -1;
+        }
+        long last = first;
+        if(*end == '-') {
+            cur = end + 1;
+            last = strtol(cur, &end, 10);
+        }
+        for(long cpu = first; cpu <= last; cpu++) {
+            fn(topo, (int)cpu, arg);
+        }
+        cur = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
+
+
+static void add_online(topology_t *topo, int cpu, int arg) {
+    (void)arg;
+    if(topo->ncpus < TOPO_MAX_CPUS) {
+        topo_cpu_t *c = &topo->cpus[topo->ncpus++];
+        c->cpu = cpu;
+        c->core = cpu;
+        c->package = 0;
+        c->node = 0;
+        c->smt = 0;
+    }
+}
+
+
+static void set_node(topology_t *topo, int cpu, int node) {
+    for(size_t i = 0; i < topo->ncpus; i++) {
+        if(topo->cpus[i].cpu == cpu) {
+            topo->cpus[i].node = node;
+        }
+    }
+}
+
+
+int topology_init(topology_t *topo) {
+    memset(topo, 0, sizeof(topology_t));
+    topo->nnodes = 1;
+    if(read_cpulist(SYSFS_CPU "/online", add_online, topo, 0) == -1 || topo->ncpus == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        topo->ncpus = 0;
+        for(long cpu = 0; cpu < (ncpu > 0 ? ncpu : 1); cpu++) {
+            add_online(topo, (int)cpu, 0);
+        }
+        return 0;
+    }
+
+    char path[256];
+    for(size_t i = 0; i < topo->ncpus; i++) {
+        topo_cpu_t *c = &topo->cpus[i];
+        snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/core_id", c->cpu);
+        read_int(path, &c->core);
+        snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/physical_package_id", c->cpu);
+        read_int(path, &c->package);
+        for(size_t j = 0; j < i; j++) {
+            if(topo->cpus[j].core == c->core && topo->cpus[j].package == c->package) {
+                c->smt++;
+            }
+        }
+    }
+
+    DIR *dir = NULL;
+    if((dir = opendir(SYSFS_NODE)) == NULL) {
+        return 0;
+    }
+    struct dirent *entry = NULL;
+    int max_node = 0;
+    while((entry = readdir(dir)) != NULL) {
+        int node = -1;
+        if(sscanf(entry->d_name, "node%d", &node) != 1) {
+            continue;
+        }
+        snprintf(path, sizeof(path), SYSFS_NODE "/node%d/cpulist", node);
+        read_cpulist(path, set_node, topo, node);
+        if(node > max_node) {
+            max_node = node;
+        }
+    }
+    closedir(dir);
+    topo->nnodes = (size_t)max_node + 1;
+    return 0;
+}
+
+
+static const char *placement_names[] = { "compact", "spread", "linear", "none" };
+
+
+int placement_parse(const char *name, placement_t *policy) {
+    for(size_t i = 0; i < sizeof(placement_names) / sizeof(placement_names[0]); i++) {
+        if(strcmp(name, placement_names[i]) == 0) {
+            *policy = (placement_t)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+const char *placement_name(placement_t policy) {
+    return placement_names[policy];
+}
+
+
+struct ranked {
+    uint64_t key;
+    int cpu;
+};
+
+
+static int ranked_cmp(const void *a, const void *b) {
+    uint64_t ka = ((const struct ranked *)a)->key;
+    uint64_t kb = ((const struct ranked *)b)->key;
+    return ka < kb ? -1 : ka > kb;
+}
+
+
+void topology_place(const topology_t *topo, placement_t policy, size_t nthreads, int *cpus) {
+    if(policy == PLACE_NONE || topo->ncpus == 0) {
+        for(size_t t = 0; t < nthreads; t++) {
+            cpus[t] = -1;
+        }
+        return;
+    }
+
+    struct ranked order[TOPO_MAX_CPUS];
+    for(size_t i = 0; i < topo->ncpus; i++) {
+        const topo_cpu_t *c = &topo->cpus[i];
+        uint64_t key = i;
+        if(policy == PLACE_COMPACT) {
+            key = ((uint64_t)c->node << 48) | ((uint64_t)c->smt << 32) | i;
+        }
+        else if(policy == PLACE_SPREAD) {
+            // How many cpus of the same node and SMT rank come before this
+            // one decides the round it gets used in.
+            uint64_t round = 0;
+            for(size_t j = 0; j < i; j++) {
+                if(topo->cpus[j].node == c->node && topo->cpus[j].smt == c->smt) {
+                    round++;
+                }
+            }
+            key = ((uint64_t)c->smt << 48) | (round << 24) | (uint64_t)c->node;
+        }
+        order[i].key = key;
+        order[i].cpu = c->cpu;
+    }
+    qsort(order, topo->ncpus, sizeof(struct ranked), ranked_cmp);
+    for(size_t t = 0; t < nthreads; t++) {
+        cpus[t] = order[t % topo->ncpus].cpu;
+    }
+}
+
+
+int topology_node(const topology_t *topo, int cpu) {
+    for(size_t i = 0; i < topo->ncpus; i++) {
+        if(topo->cpus[i].cpu == cpu) {
+            return topo->cpus[i].node;
+        }
+    }
+    return -1;
+}
+
+
+int topology_bind_memory(int node) {
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+    if(node < 0) {
+        return 0;
+    }
+    unsigned long mask[TOPO_MAX_NODES / (8 * sizeof(unsigned long))];
+    memset(mask, 0, sizeof(mask));
+    if((size_t)node >= sizeof(mask) * 8) {
+        return -1;
+    }
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    // Preferred rather than bound, running out on the node shouldn't be fatal
+    if(syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8) == -1) {
+        // Kernels without NUMA support don't have it and don't need it
+        if(errno != ENOSYS) {
+            perror("set_mempolicy");
+        }
+        return -1;
+    }
+#else
+    (void)node;
+#endif
+    return 0;
+}
@@ -0,0 +1,581 @@
+/**
+ * File: uvb_bench.c
+ * Load generator for UVB. M pinned threads drive N keep-alive connections
+ * over loopback, either closed loop with a fixed number of pipelined
+ * requests in flight per connection, or open loop at a constant request
+ * rate. In open loop mode latency is measured from when a request was due
+ * rather than when it actually went out, so a stalled server can't hide
+ * its stalls by slowing us down (coordinated omission).
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "buffer.h"
+#include "hist.h"
+#include "uvbloop.h"
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#ifdef __FreeBSD__
+#include <sys/param.h>
+#include <sys/cpuset.h>
+#include <pthread_np.h>
+#endif
+
+#define MAXEVENTS 64
+#define INFLIGHT_MAX 1024
+#define INBUF_SIZE (16 * 1024)
+#define TICK_USECS 1000
+
+typedef struct {
+    const char *host;
+    const char *port;
+    uint64_t conns;
+    uint64_t threads;
+    uint64_t depth;
+    uint64_t rate;
+    uint64_t secs;
+    uint64_t warmup;
+    uint64_t keys;
+    uint64_t busy_poll; // usecs to spin before blocking, 0 to not spin
+    int cpu;
+} bench_opts_t;
+
+typedef struct {
+    int fd;
+    bool open;
+    const char *req;
+    size_t req_len;
+    buffer_t out;
+    uint64_t out_off;
+    uvbloop_nset_t interest;
+    // send times of the requests in flight, oldest first
+    uint64_t inflight[INFLIGHT_MAX];
+    uint64_t head;
+    uint64_t tail;
+    size_t in_len;
+    char in[INBUF_SIZE];
+} bench_conn_t;
+
+typedef struct {
+    uint64_t id;
+    bench_opts_t *opts;
+    pthread_t thread;
+    uvbloop_t *loop;
+    bench_conn_t *conns;
+    uint64_t nconns;
+    uint64_t next_conn;
+    uint64_t record_from;
+    uint64_t stop_at;
+    uint64_t interval;
+    uint64_t next_send;
+    uint64_t completed;
+    uint64_t errors;
+    uvbloop_timer_t tick;
+    hist_t hist;
+} bench_thread_t;
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static int unblock_socket(int fd) {
+    int flags;
+    if((flags = fcntl(fd, F_GETFL, 0)) == -1) {
+        perror("fcntl");
+        return -1;
+    }
+    if(fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        return -1;
+    }
+    return 0;
+}
+
+
+static int bench_connect(bench_opts_t *opts) {
+    struct addrinfo hints;
+    struct addrinfo *result, *rp;
+    int fd = -1, s = 0;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if((s = getaddrinfo(opts->host, opts->port, &hints, &result)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
+        return -1;
+    }
+    for(rp = result; rp != NULL; rp = rp->ai_next) {
+        if((fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) == -1) {
+            continue;
+        }
+        if(connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    if(fd == -1) {
+        perror("connect");
+        return -1;
+    }
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    if(unblock_socket(fd) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+static void conn_close(bench_thread_t *t, bench_conn_t *conn) {
+    if(conn->open) {
+        uvbloop_unregister_fd(t->loop, conn->fd);
+        close(conn->fd);
+        conn->open = false;
+        t->errors++;
+    }
+}
+
+
+/**
+ * Write out whatever requests are queued and only watch for writability
+ * while some are left.
+ */
+static int conn_flush(bench_thread_t *t, bench_conn_t *conn) {
+    while(conn->out_off < buffer_length(&conn->out)) {
+        ssize_t n = write(conn->fd, conn->out.buffer + conn->out_off,
+                buffer_length(&conn->out) - conn->out_off);
+        if(n == -1) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        conn->out_off += n;
+    }
+    if(conn->out_off == buffer_length(&conn->out)) {
+        buffer_fast_clear(&conn->out);
+        conn->out_off = 0;
+    }
+    uvbloop_nset_t nset = UVBLOOP_R;
+    if(conn->out_off < buffer_length(&conn->out)) {
+        nset |= UVBLOOP_W;
+    }
+    if(nset != conn->interest) {
+        if(uvbloop_modify_fd(t->loop, conn->fd, conn, nset) == -1) {
+            return -1;
+        }
+        conn->interest = nset;
+    }
+    return 0;
+}
+
+
+/**
+ * Queue a request that was due at the given time. Returns false if the
+ * connection already has INFLIGHT_MAX requests outstanding.
+ */
+static bool conn_queue(bench_conn_t *conn, uint64_t due) {
+    if(conn->tail - conn->head == INFLIGHT_MAX) {
+        return false;
+    }
+    conn->inflight[conn->tail++ % INFLIGHT_MAX] = due;
+    buffer_append(&conn->out, conn->req, conn->req_len);
+    return true;
+}
+
+
+/**
+ * Find the length of the first complete response in buf, 0 if there isn't
+ * one yet and -1 if it's garbage.
+ */
+static ssize_t response_length(const char *buf, size_t len) {
+    const char *end = memmem(buf, len, "\r\n\r\n", 4);
+    if(end == NULL) {
+        return len >= INBUF_SIZE ? -1 : 0;
+    }
+    size_t header_len = end - buf + 4;
+    const char *cl = memmem(buf, header_len, "Content-Length: ", 16);
+    if(cl == NULL) {
+        return -1;
+    }
+    size_t body_len = strtoul(cl + 16, NULL, 10);
+    if(header_len + body_len > INBUF_SIZE) {
+        return -1;
+    }
+    return header_len + body_len <= len ? (ssize_t)(header_len + body_len) : 0;
+}
+
+
+/**
+ * Read whatever responses arrived and record their latency. In closed loop
+ * mode every completed request is replaced right away.
+ */
+static int conn_read(bench_thread_t *t, bench_conn_t *conn) {
+    while(true) {
+        ssize_t count = read(conn->fd, conn->in + conn->in_len, INBUF_SIZE - conn->in_len);
+        if(count == -1) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        } else if(count == 0) {
+            return -1;
+        }
+        conn->in_len += count;
+
+        uint64_t now = now_ns();
+        size_t off = 0;
+        ssize_t rsp_len = 0;
+        while((rsp_len = response_length(conn->in + off, conn->in_len - off)) > 0) {
+            if(conn->head == conn->tail) {
+                // a response we never asked for
+                return -1;
+            }
+            uint64_t due = conn->inflight[conn->head++ % INFLIGHT_MAX];
+            if(now >= t->record_from && now < t->stop_at) {
+                hist_record(&t->hist, now - due);
+                t->completed++;
+            }
+            if(t->opts->rate == 0 && now < t->stop_at) {
+                conn_queue(conn, now);
+            }
+            off += rsp_len;
+        }
+        if(rsp_len == -1) {
+            return -1;
+        }
+        memmove(conn->in, conn->in + off, conn->in_len - off);
+        conn->in_len -= off;
+        if(conn_flush(t, conn) == -1) {
+            return -1;
+        }
+    }
+}
+
+
+/**
+ * Open loop: send every request that has come due since the last tick,
+ * spreading them over the connections round robin.
+ */
+static void bench_tick(bench_thread_t *t, uint64_t now) {
+    if(t->opts->rate == 0) {
+        return;
+    }
+    while(t->next_send <= now && t->next_send < t->stop_at) {
+        bench_conn_t *conn = NULL;
+        for(uint64_t tries = 0; tries < t->nconns; tries++) {
+            bench_conn_t *c = &t->conns[t->next_conn++ % t->nconns];
+            if(c->open && conn_queue(c, t->next_send)) {
+                conn = c;
+                break;
+            }
+        }
+        if(conn == NULL) {
+            // Everything is backed up, what's due stays due and keeps aging
+            break;
+        }
+        t->next_send += t->interval;
+    }
+    for(uint64_t i = 0; i < t->nconns; i++) {
+        bench_conn_t *conn = &t->conns[i];
+        if(conn->open && buffer_length(&conn->out) > conn->out_off && conn_flush(t, conn) == -1) {
+            conn_close(t, conn);
+        }
+    }
+}
+
+
+/**
+ * Runs every tick, or sooner when the next open loop request is due before
+ * that. Closed loop only needs it to notice the run is over.
+ */
+static void bench_timer(uvbloop_t *loop, uvbloop_timer_t *timer) {
+    bench_thread_t *t = timer->data;
+    uint64_t now = now_ns();
+    bench_tick(t, now);
+    uint64_t usecs = TICK_USECS;
+    if(t->opts->rate != 0 && t->next_send > now && (t->next_send - now) / 1000 < usecs) {
+        usecs = (t->next_send - now) / 1000;
+    }
+    uvbloop_timer_start(loop, timer, usecs);
+}
+
+
+static void pin_thread(int cpu) {
+    if(cpu < 0) {
+        return;
+    }
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+#ifdef __FreeBSD__
+    cpuset_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+
+static void *bench_loop(void *ptr) {
+    bench_thread_t *t = ptr;
+    bench_opts_t *opts = t->opts;
+    uvbloop_event_t events[MAXEVENTS];
+
+    if(opts->cpu >= 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        pin_thread((opts->cpu + t->id) % (ncpu > 0 ? ncpu : 1));
+    }
+    if((t->loop = uvbloop_init(NULL)) == NULL) {
+        perror("uvbloop_init");
+        return NULL;
+    }
+    uvbloop_timer_init(&t->tick, bench_timer, t);
+    uvbloop_timer_start(t->loop, &t->tick, TICK_USECS);
+
+    uint64_t start = now_ns();
+    t->record_from = start + opts->warmup * 1000000000ULL;
+    t->stop_at = t->record_from + opts->secs * 1000000000ULL;
+    t->next_send = start;
+    for(uint64_t i = 0; i < t->nconns; i++) {
+        bench_conn_t *conn = &t->conns[i];
+        if(!conn->open) {
+            continue;
+        }
+        if(uvbloop_register_fd(t->loop, conn->fd, conn, UVBLOOP_R) == -1) {
+            conn_close(t, conn);
+            continue;
+        }
+        conn->interest = UVBLOOP_R;
+        for(uint64_t d = 0; opts->rate == 0 && d < opts->depth; d++) {
+            conn_queue(conn, start);
+        }
+        if(conn_flush(t, conn) == -1) {
+            conn_close(t, conn);
+        }
+    }
+
+    while(true) {
+        int waiting = 0;
+        if(opts->busy_poll > 0) {
+            // Spin first so the client's own wakeups don't end up in the latencies
+            uint64_t until = now_ns() + opts->busy_poll * 1000;
+            while((waiting = uvbloop_poll(t->loop, events, MAXEVENTS)) == 0 && now_ns() < until);
+        }
+        if(waiting == 0) {
+            waiting = uvbloop_wait(t->loop, events, MAXEVENTS);
+        }
+        if(waiting < 0) {
+            if(errno != EINTR) {
+                perror("uvbloop_wait");
+                break;
+            }
+            continue;
+        }
+        uint64_t now = now_ns();
+        for(int i = 0; i < waiting; i++) {
+            bench_conn_t *conn = uvbloop_event_data(&events[i]);
+            if(conn == NULL || !conn->open) {
+                continue;
+            }
+            if(uvbloop_event_error(&events[i])) {
+                conn_close(t, conn);
+                continue;
+            }
+            if(uvbloop_event_readable(&events[i]) && conn_read(t, conn) == -1) {
+                conn_close(t, conn);
+                continue;
+            }
+            if(uvbloop_event_writable(&events[i]) && conn_flush(t, conn) == -1) {
+                conn_close(t, conn);
+            }
+        }
+        if(now >= t->stop_at) {
+            break;
+        }
+    }
+    uvbloop_destroy(t->loop);
+    return NULL;
+}
+
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -h host      server address (127.0.0.1)\n"
+        "  -p port      server port (8000)\n"
+        "  -c conns     keep-alive connections in total (64)\n"
+        "  -t threads   load generating threads (4)\n"
+        "  -d depth     closed loop: requests in flight per connection (1)\n"
+        "  -r rate      open loop: requests per second in total, 0 for closed loop (0)\n"
+        "  -s secs      measured duration (10)\n"
+        "  -w secs      warmup before measuring (1)\n"
+        "  -k keys      distinct names to increment (100)\n"
+        "  -b usecs     spin this long before blocking for events, 0 to not spin (0)\n"
+        "  -a cpu       pin threads to consecutive cpus starting here, -1 to not pin\n"
+        "               (the top cpus, the server pins itself to the bottom ones)\n",
+        name);
+}
+
+
+static uint64_t parse_u64(const char *arg, const char *name) {
+    char *end = NULL;
+    errno = 0;
+    uint64_t value = strtoull(arg, &end, 10);
+    if(errno != 0 || end == arg || *end != '\0') {
+        fprintf(stderr, "invalid %s: %s\n", name, arg);
+        exit(1);
+    }
+    return value;
+}
+
+
+int main(int argc, char *argv[]) {
+    bench_opts_t opts = {
+        .host = "127.0.0.1", .port = "8000", .conns = 64, .threads = 4,
+        .depth = 1, .rate = 0, .secs = 10, .warmup = 1, .keys = 100, .busy_poll = 0, .cpu = -2,
+    };
+    int opt;
+    while((opt = getopt(argc, argv, "h:p:c:t:d:r:s:w:k:b:a:")) != -1) {
+        switch(opt) {
+            case 'h': opts.host = optarg; break;
+            case 'p': opts.port = optarg; break;
+            case 'c': opts.conns = parse_u64(optarg, "connections"); break;
+            case 't': opts.threads = parse_u64(optarg, "threads"); break;
+            case 'd': opts.depth = parse_u64(optarg, "depth"); break;
+            case 'r': opts.rate = parse_u64(optarg, "rate"); break;
+            case 's': opts.secs = parse_u64(optarg, "duration"); break;
+            case 'w': opts.warmup = parse_u64(optarg, "warmup"); break;
+            case 'k': opts.keys = parse_u64(optarg, "keys"); break;
+            case 'b': opts.busy_poll = parse_u64(optarg, "busy poll"); break;
+            case 'a': opts.cpu = strtol(optarg, NULL, 10); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(opts.threads == 0 || opts.conns < opts.threads || opts.keys == 0 ||
+            opts.depth == 0 || opts.depth > INFLIGHT_MAX) {
+        usage(argv[0]);
+        return 1;
+    }
+    if(opts.cpu == -2) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        opts.cpu = ncpu > (long)opts.threads ? ncpu - opts.threads : 0;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    bench_thread_t *threads = NULL;
+    if((threads = calloc(opts.threads, sizeof(bench_thread_t))) == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    // Build every connection and its request up front
+    uint64_t conn_id = 0;
+    for(uint64_t i = 0; i < opts.threads; i++) {
+        bench_thread_t *t = &threads[i];
+        t->id = i;
+        t->opts = &opts;
+        t->nconns = opts.conns / opts.threads + (i < opts.conns % opts.threads ? 1 : 0);
+        if(opts.rate > 0) {
+            t->interval = 1000000000ULL * opts.threads / opts.rate;
+            t->interval = t->interval > 0 ? t->interval : 1;
+        }
+        if((t->conns = calloc(t->nconns, sizeof(bench_conn_t))) == NULL) {
+            perror("calloc");
+            return 1;
+        }
+        for(uint64_t c = 0; c < t->nconns; c++, conn_id++) {
+            bench_conn_t *conn = &t->conns[c];
+            char *req = NULL;
+            int len = asprintf(&req, "GET /bench%lu HTTP/1.1\r\nHost: %s\r\n\r\n",
+                    conn_id % opts.keys, opts.host);
+            if(len == -1) {
+                perror("asprintf");
+                return 1;
+            }
+            conn->req = req;
+            conn->req_len = len;
+            buffer_init(&conn->out);
+            if((conn->fd = bench_connect(&opts)) == -1) {
+                return 1;
+            }
+            conn->open = true;
+        }
+    }
+
+    if(opts.rate > 0) {
+        printf("open loop, %lu req/s over %lu connections from %lu threads for %lus\n",
+                opts.rate, opts.conns, opts.threads, opts.secs);
+    } else {
+        printf("closed loop, depth %lu over %lu connections from %lu threads for %lus\n",
+                opts.depth, opts.conns, opts.threads, opts.secs);
+    }
+    for(uint64_t i = 0; i < opts.threads; i++) {
+        if(pthread_create(&threads[i].thread, NULL, bench_loop, &threads[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    hist_t *total = NULL;
+    if((total = calloc(1, sizeof(hist_t))) == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    uint64_t completed = 0, errors = 0;
+    for(uint64_t i = 0; i < opts.threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        hist_merge(total, &threads[i].hist);
+        completed += threads[i].completed;
+        errors += threads[i].errors;
+    }
+
+    printf("requests: %lu  errors: %lu\n", completed, errors);
+    printf("rps:      %.0f\n", (double)completed / opts.secs);
+    printf("latency:  p50 %.1fus  p99 %.1fus  p999 %.1fus  max %.1fus\n",
+            hist_percentile(total, 50.0) / 1000.0, hist_percentile(total, 99.0) / 1000.0,
+            hist_percentile(total, 99.9) / 1000.0, total->max / 1000.0);
+
+    for(uint64_t i = 0; i < opts.threads; i++) {
+        for(uint64_t c = 0; c < threads[i].nconns; c++) {
+            bench_conn_t *conn = &threads[i].conns[c];
+            if(conn->open) {
+                close(conn->fd);
+            }
+            buffer_free(&conn->out);
+            free((char *)conn->req);
+        }
+        free(threads[i].conns);
+    }
+    free(threads);
+    free(total);
+    return errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,1114 @@
+/**
+ * File: wal_counter.c
+ *
+ * Counters kept in memory like the sharded backend and made persistent with
+ * a log per thread. Every increment appends an 8 byte record to the
+ * incrementing thread's current segment, a file mapped into memory, so
+ * persisting one is a store and nothing is shared between threads.
+ *
+ * A segment starts out as SEGMENT_SIZE zero bytes. The first time a key
+ * shows up in it a define record gives it an id, increments after that
+ * only carry the id. A record with id 0 marks the end of what was written.
+ * Full segments are sealed and handed to the compactor, which folds them
+ * into the checkpoint every COMPACT_MSECS and deletes them. The checkpoint
+ * lists the segments it has folded in, so segments that are still around
+ * after a crash between writing it and deleting them aren't counted twice.
+ *
+ * Startup loads the checkpoint, replays every other segment in parallel,
+ * writes a checkpoint with all of it and starts logging to fresh segments.
+ *
+ * Like the lmdb backend this survives the process going away, not the
+ * machine, unless counter_sync is called. The logs are only msync'd there.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "counter.h"
+#include "server.h"
+
+#define atomic_load_relaxed(X) (atomic_load_explicit(X, memory_order_relaxed))
+#define atomic_load_acquire(X) (atomic_load_explicit(X, memory_order_acquire))
+#define atomic_store_relaxed(X, v) (atomic_store_explicit(X, v, memory_order_relaxed))
+#define atomic_store_release(X, v) (atomic_store_explicit(X, v, memory_order_release))
+
+#define SEGMENT_SIZE (4 << 20)
+#define COMPACT_MSECS 1000
+#define ROTATE_RETRY_SECS 1
+#define RECOVER_THREADS 16
+#define CHECKPOINT_MAGIC "UVBWAL01"
+#define CHECKPOINT_NAME "checkpoint"
+#define CHECKPOINT_TMP "checkpoint.tmp"
+
+/**
+ * A log record. delta 0 defines id as the KEYSZ bytes of key that follow,
+ * anything else adds delta to the key of id.
+ */
+struct walrec {
+    uint32_t id;
+    uint32_t delta;
+};
+
+// Room a single increment can take up: a define, its key and the increment
+#define RECORD_MAX (2 * sizeof(struct walrec) + KEYSZ)
+
+struct checkpoint_header {
+    char magic[8];
+    uint64_t nkeys;
+    uint64_t nfolded;
+};
+
+struct checkpoint_entry {
+    char key[KEYSZ];
+    uint64_t count;
+};
+
+/**
+ * A segment file. The thread logging to it is the only one that touches it
+ * until it's sealed, the compactor owns it after that.
+ */
+struct segment {
+    uint64_t seq;
+    int fd;
+    char *map;
+    size_t off;
+    uint32_t next_id;
+    struct segment *next;
+};
+
+/**
+ * A slot is empty until its count is non-zero, the key is written before the
+ * count is published. others is what everyone else has for the key as of the
+ * last stats tick, like in the sharded backend. seq and id are the segment
+ * the key was last defined in and the id it has there.
+ */
+struct hashslot {
+    _Atomic uint64_t count;
+    _Atomic uint64_t others;
+    uint64_t seq;
+    uint32_t id;
+    char key[KEYSZ];
+};
+
+struct table {
+    size_t size;
+    size_t used;
+    struct hashslot *slots;
+};
+
+/**
+ * A single thread's counts and log. Readers hold the lock so the owner can't
+ * free the slots or swap the segment out from under them, the owner only
+ * takes it to do that. The counts recovered at startup sit in a shard of
+ * their own that nobody increments. Once a new segment can't be created the
+ * shard is degraded: increments are only counted in memory and creating one
+ * is tried again every ROTATE_RETRY_SECS. Those fields are the owner's.
+ */
+struct shard {
+    struct table tbl;
+    struct segment *seg;
+    bool degraded;
+    time_t retry_at;
+    uint64_t unlogged;
+    pthread_rwlock_t lock;
+    struct shard *next;
+} __attribute__((aligned(64)));
+
+struct counter {
+    int dirfd;
+    _Atomic(struct shard *) shards;
+    struct shard *recovered;
+    _Atomic uint64_t next_seq;
+    // Sealed segments waiting for the compactor
+    pthread_mutex_t sealed_lock;
+    struct segment *sealed;
+    // Held while compacting. checkpoint is every count the checkpoint file
+    // has plus whatever is in folded, the segments it's waiting to be
+    // written out with.
+    pthread_mutex_t compact_lock;
+    struct table checkpoint;
+    struct segment *folded;
+    pthread_mutex_t stop_lock;
+    pthread_cond_t stop_cond;
+    bool stop;
+    pthread_t compactor;
+    rates_t *rates;
+};
+
+static const int size0 = 128;
+const char *counter_backend_name = "wal";
+
+static __thread struct shard *local_shard = NULL;
+static __thread counter_t *local_counter = NULL;
+
+
+static int table_init(struct table *tbl, size_t size) {
+    if((tbl->slots = calloc(size, sizeof(struct hashslot))) == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    tbl->size = size;
+    tbl->used = 0;
+    return 0;
+}
+
+static struct hashslot *table_find(struct table *tbl, const char *key) {
+    for (size_t i = key_hash(key) % tbl->size;; i = (i + 1) % tbl->size) {
+        if (atomic_load_acquire(&tbl->slots[i].count) == 0) {
+            return NULL;
+        } else if (key_eq(key, tbl->slots[i].key)) {
+            return &tbl->slots[i];
+        }
+    }
+}
+
+static inline uint64_t table_get(struct table *tbl, const char *key) {
+    struct hashslot *slot = table_find(tbl, key);
+    return slot != NULL ? atomic_load_relaxed(&slot->count) : 0;
+}
+
+/**
+ * Add count to key and return its slot. Only ever called by the table's
+ * single writer so a plain load and store is enough. A new key is turned
+ * away with NULL rather than take the last empty slot, which is what ends
+ * every probe.
+ */
+static struct hashslot *table_add(struct table *tbl, const char *key, uint64_t count) {
+    for (size_t i = key_hash(key) % tbl->size;; i = (i + 1) % tbl->size) {
+        uint64_t old = atomic_load_relaxed(&tbl->slots[i].count);
+        if (old == 0) {
+            if (tbl->used + 1 >= tbl->size) {
+                return NULL;
+            }
+            memcpy(tbl->slots[i].key, key, KEYSZ);
+            atomic_store_release(&tbl->slots[i].count, count);
+            tbl->used += 1;
+            return &tbl->slots[i];
+        } else if (key_eq(key, tbl->slots[i].key)) {
+            atomic_store_relaxed(&tbl->slots[i].count, old + count);
+            return &tbl->slots[i];
+        }
+    }
+}
+
+static int table_expand(struct table *tbl) {
+    struct hashslot *slots = NULL;
+    size_t size = tbl->size * 2;
+    if ((slots = calloc(size, sizeof(struct hashslot))) == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    for (size_t i = 0; i < tbl->size; ++i) {
+        struct hashslot *old = &tbl->slots[i];
+        if (atomic_load_relaxed(&old->count) == 0) {
+            continue;
+        }
+        for (size_t j = key_hash(old->key) % size;; j = (j + 1) % size) {
+            if (atomic_load_relaxed(&slots[j].count) == 0) {
+                memcpy(&slots[j], old, sizeof(struct hashslot));
+                break;
+            }
+        }
+    }
+    free(tbl->slots);
+    tbl->slots = slots;
+    tbl->size = size;
+    return 0;
+}
+
+static inline bool table_full(struct table *tbl) {
+    return tbl->used > (tbl->size * 8) / 10;
+}
+
+/**
+ * Grow tbl until n more keys fit without it filling up, so adding them
+ * can't fail halfway
+ */
+static int table_reserve(struct table *tbl, size_t n) {
+    while(tbl->used + n > (tbl->size * 8) / 10) {
+        if(table_expand(tbl) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Add every count in src to dst
+ */
+static int table_merge(struct table *dst, struct table *src) {
+    for (size_t i = 0; i < src->size; ++i) {
+        uint64_t count = atomic_load_relaxed(&src->slots[i].count);
+        if (count == 0) {
+            continue;
+        }
+        if (table_add(dst, src->slots[i].key, count) == NULL ||
+                (table_full(dst) && table_expand(dst) == -1)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static struct shard *shard_new(void) {
+    struct shard *shard = NULL;
+    if((shard = aligned_alloc(64, sizeof(struct shard))) == NULL) {
+        perror("aligned_alloc");
+        return NULL;
+    }
+    if(table_init(&shard->tbl, size0) == -1) {
+        free(shard);
+        return NULL;
+    }
+    shard->seg = NULL;
+    shard->degraded = false;
+    shard->retry_at = 0;
+    shard->unlogged = 0;
+    pthread_rwlock_init(&shard->lock, NULL);
+    shard->next = NULL;
+    return shard;
+}
+
+static void shard_publish(counter_t *c, struct shard *shard) {
+    shard->next = atomic_load(&c->shards);
+    while(!atomic_compare_exchange_weak(&c->shards, &shard->next, shard));
+}
+
+
+static void segment_name(uint64_t seq, char *name, size_t len) {
+    snprintf(name, len, "%lu.seg", seq);
+}
+
+/**
+ * Create, allocate and map the next segment. The blocks are reserved up
+ * front, a sparse file would turn a full disk into a SIGBUS on some later
+ * store into the map rather than an error here.
+ */
+static struct segment *segment_create(counter_t *c) {
+    struct segment *seg = NULL;
+    if((seg = calloc(1, sizeof(struct segment))) == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    char name[32];
+    seg->seq = atomic_fetch_add(&c->next_seq, 1);
+    seg->next_id = 1;
+    segment_name(seg->seq, name, sizeof(name));
+    if((seg->fd = openat(c->dirfd, name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0664)) == -1) {
+        perror("openat");
+        goto error;
+    }
+    int rc = 0;
+    if((rc = posix_fallocate(seg->fd, 0, SEGMENT_SIZE)) != 0) {
+        errno = rc;
+        perror("posix_fallocate");
+        goto error;
+    }
+    if((seg->map = mmap(NULL, SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0)) == MAP_FAILED) {
+        perror("mmap");
+        goto error;
+    }
+    return seg;
+
+error:
+    if(seg->fd != -1) {
+        close(seg->fd);
+        unlinkat(c->dirfd, name, 0);
+    }
+    free(seg);
+    return NULL;
+}
+
+/**
+ * Unmap and close a segment, deleting the file too if it has been folded
+ * into a checkpoint.
+ */
+static void segment_close(counter_t *c, struct segment *seg, bool remove) {
+    if(seg->map != NULL) {
+        munmap(seg->map, SEGMENT_SIZE);
+    }
+    if(seg->fd != -1) {
+        close(seg->fd);
+    }
+    if(remove) {
+        char name[32];
+        segment_name(seg->seq, name, sizeof(name));
+        if(unlinkat(c->dirfd, name, 0) == -1 && errno != ENOENT) {
+            perror("unlinkat");
+        }
+    }
+    free(seg);
+}
+
+/**
+ * Add up the records of a segment into tbl. Anything that doesn't look like
+ * a record we wrote ends the segment, that's where the writer stopped.
+ */
+static int segment_replay(const char *map, size_t size, struct table *tbl) {
+    char (*names)[KEYSZ] = NULL;
+    size_t nnames = 0;
+    uint32_t next_id = 1;
+    int ret = 0;
+
+    for(size_t off = 0; off + sizeof(struct walrec) <= size;) {
+        struct walrec rec;
+        memcpy(&rec, map + off, sizeof(rec));
+        off += sizeof(rec);
+        if(rec.id == 0) {
+            break;
+        }
+        if(rec.delta == 0) {
+            if(rec.id != next_id || off + KEYSZ > size) {
+                break;
+            }
+            if(next_id >= nnames) {
+                size_t n = nnames == 0 ? 1024 : nnames * 2;
+                char (*grown)[KEYSZ] = NULL;
+                if((grown = realloc(names, n * KEYSZ)) == NULL) {
+                    perror("realloc");
+                    ret = -1;
+                    break;
+                }
+                names = grown;
+                nnames = n;
+            }
+            memcpy(names[next_id++], map + off, KEYSZ);
+            off += KEYSZ;
+            continue;
+        }
+        if(rec.id >= next_id) {
+            break;
+        }
+        if(table_add(tbl, names[rec.id], rec.delta) == NULL ||
+                (table_full(tbl) && table_expand(tbl) == -1)) {
+            ret = -1;
+            break;
+        }
+    }
+    free(names);
+    return ret;
+}
+
+/**
+ * Replay a segment file that isn't mapped, one left behind by a previous run
+ */
+static int segment_load(counter_t *c, uint64_t seq, struct table *tbl) {
+    char name[32];
+    segment_name(seq, name, sizeof(name));
+    int fd = -1;
+    if((fd = openat(c->dirfd, name, O_RDONLY | O_CLOEXEC)) == -1) {
+        perror("openat");
+        return -1;
+    }
+    struct stat st;
+    if(fstat(fd, &st) == -1) {
+        perror("fstat");
+        close(fd);
+        return -1;
+    }
+    if(st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    char *map = NULL;
+    if((map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0)) == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return -1;
+    }
+    int ret = segment_replay(map, st.st_size, tbl);
+    munmap(map, st.st_size);
+    close(fd);
+    return ret;
+}
+
+
+/**
+ * Write out a checkpoint of tbl that lists the segments in folded as part of
+ * it. It only replaces the old one once it's completely on disk.
+ */
+static int checkpoint_write(counter_t *c, struct table *tbl, struct segment *folded) {
+    int fd = -1;
+    FILE *f = NULL;
+    if((fd = openat(c->dirfd, CHECKPOINT_TMP, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0664)) == -1) {
+        perror("openat");
+        return -1;
+    }
+    if((f = fdopen(fd, "w")) == NULL) {
+        perror("fdopen");
+        close(fd);
+        return -1;
+    }
+
+    struct checkpoint_header header;
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.nkeys = tbl->used;
+    header.nfolded = 0;
+    for(struct segment *seg = folded; seg != NULL; seg = seg->next) {
+        header.nfolded++;
+    }
+    fwrite(&header, sizeof(header), 1, f);
+    for(struct segment *seg = folded; seg != NULL; seg = seg->next) {
+        fwrite(&seg->seq, sizeof(uint64_t), 1, f);
+    }
+    for(size_t i = 0; i < tbl->size; ++i) {
+        struct checkpoint_entry entry;
+        if((entry.count = atomic_load_relaxed(&tbl->slots[i].count)) == 0) {
+            continue;
+        }
+        memcpy(entry.key, tbl->slots[i].key, KEYSZ);
+        fwrite(&entry, sizeof(entry), 1, f);
+    }
+    if(fflush(f) == EOF || ferror(f) || fsync(fd) == -1) {
+        perror("checkpoint");
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    if(renameat(c->dirfd, CHECKPOINT_TMP, c->dirfd, CHECKPOINT_NAME) == -1) {
+        perror("renameat");
+        return -1;
+    }
+    if(fsync(c->dirfd) == -1) {
+        perror("fsync");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Load the checkpoint into tbl. The segments it says it has folded in come
+ * back through folded, sorted. A missing checkpoint is an empty one.
+ */
+static int checkpoint_load(counter_t *c, struct table *tbl, uint64_t **folded, size_t *nfolded) {
+    *folded = NULL;
+    *nfolded = 0;
+    int fd = -1;
+    FILE *f = NULL;
+    if((fd = openat(c->dirfd, CHECKPOINT_NAME, O_RDONLY | O_CLOEXEC)) == -1) {
+        if(errno == ENOENT) {
+            return 0;
+        }
+        perror("openat");
+        return -1;
+    }
+    if((f = fdopen(fd, "r")) == NULL) {
+        perror("fdopen");
+        close(fd);
+        return -1;
+    }
+
+    struct checkpoint_header header;
+    if(fread(&header, sizeof(header), 1, f) != 1 ||
+            memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "wal: checkpoint is corrupt\n");
+        goto error;
+    }
+    if(header.nfolded > 0) {
+        if((*folded = malloc(header.nfolded * sizeof(uint64_t))) == NULL) {
+            perror("malloc");
+            goto error;
+        }
+        if(fread(*folded, sizeof(uint64_t), header.nfolded, f) != header.nfolded) {
+            fprintf(stderr, "wal: checkpoint is truncated\n");
+            goto error;
+        }
+        *nfolded = header.nfolded;
+    }
+    for(uint64_t i = 0; i < header.nkeys; i++) {
+        struct checkpoint_entry entry;
+        if(fread(&entry, sizeof(entry), 1, f) != 1) {
+            fprintf(stderr, "wal: checkpoint is truncated\n");
+            goto error;
+        }
+        entry.key[KEYSZ - 1] = '\0';
+        if(table_add(tbl, entry.key, entry.count) == NULL ||
+                (table_full(tbl) && table_expand(tbl) == -1)) {
+            goto error;
+        }
+    }
+    fclose(f);
+    return 0;
+
+error:
+    free(*folded);
+    *folded = NULL;
+    *nfolded = 0;
+    fclose(f);
+    return -1;
+}
+
+
+/**
+ * Fold the segments sealed since the last time into the checkpoint, write it
+ * and delete them. If the write fails they stay folded in memory and go out
+ * with the next one. A segment is replayed into a table of its own first and
+ * only folded in once that worked, one that can't be stays sealed and is
+ * tried again next time.
+ */
+static int counter_compact(counter_t *c) {
+    pthread_mutex_lock(&c->compact_lock);
+    pthread_mutex_lock(&c->sealed_lock);
+    struct segment *sealed = c->sealed;
+    c->sealed = NULL;
+    pthread_mutex_unlock(&c->sealed_lock);
+
+    int ret = 0;
+    while(sealed != NULL) {
+        struct segment *seg = sealed;
+        sealed = seg->next;
+        struct table replayed = { 0 };
+        if(table_init(&replayed, size0) == -1 ||
+                segment_replay(seg->map, SEGMENT_SIZE, &replayed) == -1 ||
+                table_reserve(&c->checkpoint, replayed.used) == -1) {
+            free(replayed.slots);
+            pthread_mutex_lock(&c->sealed_lock);
+            seg->next = c->sealed;
+            c->sealed = seg;
+            pthread_mutex_unlock(&c->sealed_lock);
+            ret = -1;
+            continue;
+        }
+        table_merge(&c->checkpoint, &replayed);
+        free(replayed.slots);
+        seg->next = c->folded;
+        c->folded = seg;
+    }
+    if(c->folded != NULL && checkpoint_write(c, &c->checkpoint, c->folded) == 0) {
+        while(c->folded != NULL) {
+            struct segment *seg = c->folded;
+            c->folded = seg->next;
+            segment_close(c, seg, true);
+        }
+    } else if(c->folded != NULL) {
+        ret = -1;
+    }
+    pthread_mutex_unlock(&c->compact_lock);
+    return ret;
+}
+
+/**
+ * Compactor thread. Compacts every COMPACT_MSECS until counter_destroy.
+ */
+static void *counter_compactor(void *data) {
+    counter_t *c = data;
+    pthread_mutex_lock(&c->stop_lock);
+    while(!c->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += COMPACT_MSECS / 1000;
+        deadline.tv_nsec += (COMPACT_MSECS % 1000) * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&c->stop_cond, &c->stop_lock, &deadline);
+        pthread_mutex_unlock(&c->stop_lock);
+        counter_compact(c);
+        pthread_mutex_lock(&c->stop_lock);
+    }
+    pthread_mutex_unlock(&c->stop_lock);
+    return NULL;
+}
+
+
+struct recovery {
+    counter_t *c;
+    const uint64_t *seqs;
+    size_t nseqs;
+    _Atomic size_t next;
+};
+
+struct recoverer {
+    pthread_t thread;
+    struct recovery *rec;
+    struct table tbl;
+    int ret;
+};
+
+/**
+ * Replay segments off the shared list into a table of our own until there
+ * are none left
+ */
+static void *recover_segments(void *data) {
+    struct recoverer *r = data;
+    size_t i = 0;
+    while((i = atomic_fetch_add(&r->rec->next, 1)) < r->rec->nseqs) {
+        if(segment_load(r->rec->c, r->rec->seqs[i], &r->tbl) == -1) {
+            r->ret = -1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Replay the segments in seqs into tbl, spread over up to RECOVER_THREADS
+ * threads that each add up their share before it's merged.
+ */
+static int counter_recover(counter_t *c, const uint64_t *seqs, size_t nseqs, struct table *tbl) {
+    struct recovery rec = { .c = c, .seqs = seqs, .nseqs = nseqs };
+    atomic_init(&rec.next, 0);
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = ncpus > 0 ? (size_t)ncpus : 1;
+    nthreads = nthreads < RECOVER_THREADS ? nthreads : RECOVER_THREADS;
+    nthreads = nthreads < nseqs ? nthreads : nseqs;
+
+    struct recoverer *rs = NULL;
+    if((rs = calloc(nthreads, sizeof(struct recoverer))) == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    int ret = 0;
+    size_t started = 0;
+    for(; started < nthreads; started++) {
+        rs[started].rec = &rec;
+        if(table_init(&rs[started].tbl, size0) == -1) {
+            ret = -1;
+            break;
+        }
+        if(pthread_create(&rs[started].thread, NULL, recover_segments, &rs[started]) != 0) {
+            perror("pthread_create");
+            free(rs[started].tbl.slots);
+            ret = -1;
+            break;
+        }
+    }
+    // With no threads at all nothing would ever replay them
+    if(started == 0 && nseqs > 0) {
+        free(rs);
+        return -1;
+    }
+    for(size_t t = 0; t < started; t++) {
+        pthread_join(rs[t].thread, NULL);
+        if(rs[t].ret == -1 || table_merge(tbl, &rs[t].tbl) == -1) {
+            ret = -1;
+        }
+        free(rs[t].tbl.slots);
+    }
+    free(rs);
+    return ret;
+}
+
+
+static int seq_cmp(const void *a, const void *b) {
+    uint64_t sa = *(const uint64_t *)a;
+    uint64_t sb = *(const uint64_t *)b;
+    return sa < sb ? -1 : sa > sb;
+}
+
+/**
+ * Get everything back that's on disk into the recovered shard, then fold it
+ * all into a new checkpoint so the next start doesn't replay it again.
+ */
+static int counter_open(counter_t *c) {
+    uint64_t *folded = NULL;
+    size_t nfolded = 0;
+    if(checkpoint_load(c, &c->recovered->tbl, &folded, &nfolded) == -1) {
+        return -1;
+    }
+    uint64_t max_seq = 0;
+    for(size_t i = 0; i < nfolded; i++) {
+        max_seq = folded[i] > max_seq ? folded[i] : max_seq;
+    }
+
+    DIR *dir = NULL;
+    int dupfd = -1;
+    if((dupfd = dup(c->dirfd)) == -1 || (dir = fdopendir(dupfd)) == NULL) {
+        perror("fdopendir");
+        if(dupfd != -1) {
+            close(dupfd);
+        }
+        free(folded);
+        return -1;
+    }
+    uint64_t *seqs = NULL;
+    size_t nseqs = 0, cap = 0;
+    struct dirent *entry = NULL;
+    while((entry = readdir(dir)) != NULL) {
+        uint64_t seq = 0;
+        char tail = '\0';
+        if(sscanf(entry->d_name, "%lu.se%c", &seq, &tail) != 2 || tail != 'g') {
+            continue;
+        }
+        max_seq = seq > max_seq ? seq : max_seq;
+        if(nfolded > 0 && bsearch(&seq, folded, nfolded, sizeof(uint64_t), seq_cmp) != NULL) {
+            // Counted already, it just wasn't deleted yet
+            unlinkat(c->dirfd, entry->d_name, 0);
+            continue;
+        }
+        if(nseqs == cap) {
+            cap = cap == 0 ? 64 : cap * 2;
+            uint64_t *grown = NULL;
+            if((grown = realloc(seqs, cap * sizeof(uint64_t))) == NULL) {
+                perror("realloc");
+                closedir(dir);
+                free(seqs);
+                free(folded);
+                return -1;
+            }
+            seqs = grown;
+        }
+        seqs[nseqs++] = seq;
+    }
+    closedir(dir);
+    free(folded);
+    atomic_init(&c->next_seq, max_seq + 1);
+
+    int ret = 0;
+    if(nseqs > 0) {
+        ret = counter_recover(c, seqs, nseqs, &c->recovered->tbl);
+    }
+    if(ret == 0) {
+        ret = table_merge(&c->checkpoint, &c->recovered->tbl);
+    }
+    // The replayed segments go through the usual folded list so they're
+    // deleted once a checkpoint with them in it is written.
+    for(size_t i = 0; i < nseqs && ret == 0; i++) {
+        struct segment *seg = NULL;
+        if((seg = calloc(1, sizeof(struct segment))) == NULL) {
+            perror("calloc");
+            ret = -1;
+            break;
+        }
+        seg->seq = seqs[i];
+        seg->fd = -1;
+        seg->next = c->folded;
+        c->folded = seg;
+    }
+    free(seqs);
+    if(ret == 0 && nseqs > 0) {
+        ret = counter_compact(c);
+    }
+    return ret;
+}
+
+
+counter_t *counter_init(const char *path, uint64_t threads) {
+    (void)threads;
+    counter_t *c = NULL;
+    if((c = calloc(1, sizeof(counter_t))) == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    c->dirfd = -1;
+    if(mkdir(path, 0775) == -1 && errno != EEXIST) {
+        perror("mkdir");
+        goto error;
+    }
+    if((c->dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        perror("open");
+        goto error;
+    }
+    if((c->rates = rates_init()) == NULL || (c->recovered = shard_new()) == NULL ||
+            table_init(&c->checkpoint, size0) == -1) {
+        goto error;
+    }
+    atomic_init(&c->shards, NULL);
+    pthread_mutex_init(&c->sealed_lock, NULL);
+    pthread_mutex_init(&c->compact_lock, NULL);
+    pthread_mutex_init(&c->stop_lock, NULL);
+    pthread_cond_init(&c->stop_cond, NULL);
+    c->stop = false;
+    if(counter_open(c) == -1) {
+        fprintf(stderr, "wal: recovery failed\n");
+        goto error;
+    }
+    shard_publish(c, c->recovered);
+    if(pthread_create(&c->compactor, NULL, counter_compactor, c) != 0) {
+        perror("pthread_create");
+        goto error;
+    }
+    return c;
+
+error:
+    // Whatever was recovered is still on disk, nothing is deleted before
+    // it's in a checkpoint.
+    if(c->dirfd != -1) {
+        close(c->dirfd);
+    }
+    rates_destroy(c->rates);
+    free(c);
+    return NULL;
+}
+
+void counter_destroy(counter_t *c) {
+    pthread_mutex_lock(&c->stop_lock);
+    c->stop = true;
+    pthread_cond_signal(&c->stop_cond);
+    pthread_mutex_unlock(&c->stop_lock);
+    pthread_join(c->compactor, NULL);
+    counter_compact(c);
+
+    // Segments still being logged to stay on disk for the next start to
+    // replay, sealed ones that couldn't be replayed and folded ones that
+    // couldn't be checkpointed likewise.
+    struct shard *shard = atomic_load(&c->shards);
+    while(shard != NULL) {
+        struct shard *next = shard->next;
+        if(shard->seg != NULL) {
+            segment_close(c, shard->seg, false);
+        }
+        pthread_rwlock_destroy(&shard->lock);
+        free(shard->tbl.slots);
+        free(shard);
+        shard = next;
+    }
+    while(c->sealed != NULL) {
+        struct segment *seg = c->sealed;
+        c->sealed = seg->next;
+        segment_close(c, seg, false);
+    }
+    while(c->folded != NULL) {
+        struct segment *seg = c->folded;
+        c->folded = seg->next;
+        segment_close(c, seg, false);
+    }
+    pthread_cond_destroy(&c->stop_cond);
+    pthread_mutex_destroy(&c->stop_lock);
+    pthread_mutex_destroy(&c->compact_lock);
+    pthread_mutex_destroy(&c->sealed_lock);
+    free(c->checkpoint.slots);
+    close(c->dirfd);
+    rates_destroy(c->rates);
+    free(c);
+}
+
+/**
+ * Get the calling thread's shard, creating and publishing it the first time
+ * a thread increments. It gets a segment on its first increment.
+ */
+static struct shard *shard_get(counter_t *c) {
+    if(local_counter == c) {
+        return local_shard;
+    }
+    struct shard *shard = NULL;
+    if((shard = shard_new()) == NULL) {
+        return NULL;
+    }
+    shard_publish(c, shard);
+    local_shard = shard;
+    local_counter = c;
+    return shard;
+}
+
+static time_t now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * Start logging to a fresh segment and hand the full one to the compactor.
+ * A degraded shard doesn't try again before retry_at, so a full disk costs
+ * a clock read per increment and a message per ROTATE_RETRY_SECS.
+ */
+static int log_rotate(counter_t *c, struct shard *shard) {
+    struct segment *seg = NULL;
+    if(shard->degraded && now_secs() < shard->retry_at) {
+        return -1;
+    }
+    if((seg = segment_create(c)) == NULL) {
+        if(!shard->degraded) {
+            fprintf(stderr, "wal: can't start a segment, not logging increments\n");
+        } else {
+            fprintf(stderr, "wal: still can't start a segment, %lu increments not logged\n", shard->unlogged);
+        }
+        shard->degraded = true;
+        shard->retry_at = now_secs() + ROTATE_RETRY_SECS;
+        return -1;
+    }
+    if(shard->degraded) {
+        fprintf(stderr, "wal: logging again, %lu increments weren't logged\n", shard->unlogged);
+        shard->degraded = false;
+        shard->unlogged = 0;
+    }
+    pthread_rwlock_wrlock(&shard->lock);
+    struct segment *old = shard->seg;
+    shard->seg = seg;
+    pthread_rwlock_unlock(&shard->lock);
+    if(old != NULL) {
+        pthread_mutex_lock(&c->sealed_lock);
+        old->next = c->sealed;
+        c->sealed = old;
+        pthread_mutex_unlock(&c->sealed_lock);
+    }
+    return 0;
+}
+
+/**
+ * Log one increment of slot's key, defining the key first if this segment
+ * hasn't seen it. Each record is published with a single 8 byte store after
+ * everything it refers to, so a reader never sees half of one.
+ */
+static int log_inc(counter_t *c, struct shard *shard, struct hashslot *slot) {
+    struct segment *seg = shard->seg;
+    if(seg == NULL || seg->off + RECORD_MAX > SEGMENT_SIZE) {
+        if(log_rotate(c, shard) == -1) {
+            return -1;
+        }
+        seg = shard->seg;
+    }
+    if(slot->seq != seg->seq) {
+        struct walrec define = { .id = seg->next_id++, .delta = 0 };
+        memcpy(seg->map + seg->off + sizeof(struct walrec), slot->key, KEYSZ);
+        __atomic_store((struct walrec *)(seg->map + seg->off), &define, __ATOMIC_RELEASE);
+        seg->off += sizeof(struct walrec) + KEYSZ;
+        slot->seq = seg->seq;
+        slot->id = define.id;
+    }
+    struct walrec inc = { .id = slot->id, .delta = 1 };
+    __atomic_store((struct walrec *)(seg->map + seg->off), &inc, __ATOMIC_RELEASE);
+    seg->off += sizeof(struct walrec);
+    return 0;
+}
+
+uint64_t counter_inc(counter_t *c, const char *key) {
+    char clean_key[KEYSZ] = { 0 };
+    key_clean(clean_key, key);
+
+    struct shard *shard = NULL;
+    if((shard = shard_get(c)) == NULL) {
+        return 0;
+    }
+    struct hashslot *slot = NULL;
+    if((slot = table_add(&shard->tbl, clean_key, 1)) == NULL) {
+        return 0;
+    }
+    if(atomic_load_relaxed(&slot->count) == 1) {
+        // New to this thread, start from what was recovered until the next
+        // stats tick fills in the rest
+        atomic_store_relaxed(&slot->others, table_get(&c->recovered->tbl, clean_key));
+    }
+    if(log_inc(c, shard, slot) == -1) {
+        shard->unlogged += 1;
+    }
+    uint64_t total = atomic_load_relaxed(&slot->count) + atomic_load_relaxed(&slot->others);
+    if(table_full(&shard->tbl)) {
+        pthread_rwlock_wrlock(&shard->lock);
+        table_expand(&shard->tbl);
+        pthread_rwlock_unlock(&shard->lock);
+    }
+    return total;
+}
+
+
+unsigned counter_tier(counter_t *c, uint64_t count) {
+    return rates_tier(c->rates, count);
+}
+
+uint64_t counter_get(counter_t *c, const char *key) {
+    char clean_key[KEYSZ] = { 0 };
+    key_clean(clean_key, key);
+
+    uint64_t total = 0;
+    for(struct shard *s = atomic_load(&c->shards); s != NULL; s = s->next) {
+        pthread_rwlock_rdlock(&s->lock);
+        total += table_get(&s->tbl, clean_key);
+        pthread_rwlock_unlock(&s->lock);
+    }
+    return total;
+}
+
+/**
+ * Checkpoint the sealed segments and flush the ones being logged to
+ */
+void counter_sync(counter_t *c) {
+    counter_compact(c);
+    for(struct shard *s = atomic_load(&c->shards); s != NULL; s = s->next) {
+        pthread_rwlock_rdlock(&s->lock);
+        if(s->seg != NULL && msync(s->seg->map, SEGMENT_SIZE, MS_SYNC) == -1) {
+            perror("msync");
+        }
+        pthread_rwlock_unlock(&s->lock);
+    }
+}
+
+/**
+ * Lock every shard for reading. Locks are always taken in list order so two
+ * readers can never deadlock against each other or against a growing owner.
+ */
+static struct shard *shards_lock(counter_t *c) {
+    struct shard *head = atomic_load(&c->shards);
+    for(struct shard *s = head; s != NULL; s = s->next) {
+        pthread_rwlock_rdlock(&s->lock);
+    }
+    return head;
+}
+
+static void shards_unlock(struct shard *head) {
+    for(struct shard *s = head; s != NULL; s = s->next) {
+        pthread_rwlock_unlock(&s->lock);
+    }
+}
+
+void counter_dump(counter_t *c, buffer_t *output) {
+    struct table merged;
+    if(table_init(&merged, size0) == -1) {
+        return;
+    }
+    struct shard *head = shards_lock(c);
+    int ret = 0;
+    for(struct shard *s = head; s != NULL && ret == 0; s = s->next) {
+        ret = table_merge(&merged, &s->tbl);
+    }
+    shards_unlock(head);
+
+    uint64_t rps[RATE_WINDOWS];
+    for (size_t i = 0; i < merged.size && ret == 0; ++i) {
+        uint64_t count = atomic_load_relaxed(&merged.slots[i].count);
+        if (count == 0) {
+            continue;
+        }
+        const char *key = merged.slots[i].key;
+
+        rates_get(c->rates, key, rps);
+        counter_dump_line(output, key, count, rps);
+    }
+    free(merged.slots);
+}
+
+/**
+ * Same as the sharded backend: feed every shard's counts into the rates and
+ * hand the totals back for counter_inc.
+ */
+int counter_gen_stats(void *data) {
+    counter_t *c = data;
+    int ret = 0;
+    struct shard *head = shards_lock(c);
+    for(struct shard *s = head; s != NULL && ret == 0; s = s->next) {
+        for(size_t i = 0; i < s->tbl.size && ret == 0; ++i) {
+            uint64_t count = atomic_load_acquire(&s->tbl.slots[i].count);
+            if(count != 0) {
+                ret = rates_add(c->rates, s->tbl.slots[i].key, count);
+            }
+        }
+    }
+    if(ret == 0) {
+        rates_tick(c->rates);
+        for(struct shard *s = head; s != NULL; s = s->next) {
+            for(size_t i = 0; i < s->tbl.size; ++i) {
+                struct hashslot *slot = &s->tbl.slots[i];
+                uint64_t count = atomic_load_acquire(&slot->count);
+                if(count != 0) {
+                    uint64_t total = rates_count(c->rates, slot->key);
+                    atomic_store_relaxed(&slot->others, total > count ? total - count : 0);
+                }
+            }
+        }
+    }
+    shards_unlock(head);
+    return ret;
+}